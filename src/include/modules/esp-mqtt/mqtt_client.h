@@ -5,29 +5,159 @@
 #include <espconn.h>
 #include <osapi.h>
 #include "mqtt_proto.h"
+#include "mqtt_router.h"
 
 #define MQTT_DEBUG         1
 #define MQTT_DEBUG_PACKET  1
 
+// Broker address reused on reconnections (s, 0 = resolve always, max 6871)
+#define MQTT_DNS_TTL              300
+
+// Subscriptions restored on reconnections (max 32)
+#define MQTT_MAX_SUBSCRIPTIONS    32
+// SUBSCRIBE packets waiting SUBACK (per-filter status report)
+#define MQTT_MAX_PENDING_SUBACKS  4
+
+// Deferred dispatch: handlers run from a system task, not from the socket
+// receive callback (messages queued per lane, 0 = handlers run inline)
+#ifndef MQTT_DISPATCH_QUEUE
+#define MQTT_DISPATCH_QUEUE       0
+#endif
+#define MQTT_DISPATCH_PRIO        USER_TASK_PRIO_1
+#define MQTT_DISPATCH_BUDGET      4   // messages handled per task run
+#define MQTT_DISPATCH_CLIENTS     2   // clients using deferred dispatch
+
+// Broker copies of a message matching several subscriptions are suppressed
+// when they arrive within MQTT_DEDUP_WINDOW (0 = off). Only for brokers
+// sending one copy per matching subscription (MQTT 3.1.1 3.3.5 allows both),
+// with brokers sending a single copy identical messages published within
+// the window would be dropped
+#ifndef MQTT_DEDUP_SLOTS
+#define MQTT_DEDUP_SLOTS          0     // recent messages remembered
+#endif
+#define MQTT_DEDUP_WINDOW         250   // ms
+
+// Publish delivery, own subscription handlers are called in-process
+// (loopback) without a broker round trip
+enum mqtt_delivery {
+  MQTT_DELIVER_REMOTE = 0,  // broker only
+  MQTT_DELIVER_LOCAL,       // own handlers only
+  MQTT_DELIVER_BOTH         // broker and own handlers (broker copies also handled unless MQTT_DEDUP_SLOTS)
+};
+
+struct mqtt_pending_suback {
+  uint16_t packet_id;     // 0 = free
+  uint8_t first;          // 1st registry entry on SUBSCRIBE
+  uint8_t count;
+};
+
+enum mqtt_dispatch_lane {
+  MQTT_LANE_CONTROL = 0,    // subscriptions flagged "control"
+  MQTT_LANE_BULK,
+  MQTT_LANES
+};
+
+struct mqtt_dispatch_stats {
+  uint32_t dispatched;      // messages handled from queue
+  uint32_t overflows;       // queue full, oldest message handled on receive callback
+  uint64_t dwell_total;     // us queued (dwell_total / dispatched = average)
+  uint32_t dwell_max;       // us
+  uint8_t depth;            // messages queued
+  uint8_t depth_max;
+};
+
+struct mqtt_dedup_stats {
+  uint32_t suppressed;      // broker copies not passed to handlers
+  uint32_t bytes;           // topic and payload bytes of those copies
+};
+
+#if MQTT_DEDUP_SLOTS
+struct mqtt_dedup_entry {
+  uint32_t hash;            // topic and payload
+  uint32_t time;            // system time (us) of first copy
+  uint8_t copies;           // more copies expected
+};
+#endif
+
+#if MQTT_DISPATCH_QUEUE
+struct mqtt_dispatch_queue {
+  struct mqtt_message *messages[MQTT_DISPATCH_QUEUE];   // copies
+  uint32_t queued_at[MQTT_DISPATCH_QUEUE];              // system time (us)
+  bool local[MQTT_DISPATCH_QUEUE];                      // loopback delivery
+  uint8_t first;
+  struct mqtt_dispatch_stats stats;
+};
+#endif
+
 struct mqtt_client {
   bool secure;
   char *host_name;
   uint16_t host_port;
   struct ip_addr host_ip;
+  os_timer_t host_timer;        // MQTT_DNS_TTL since "host_ip" resolution
+  bool host_cached;             // "host_ip" usable until "host_timer" fires
+  bool host_reached;            // TCP connected to "host_ip"
   struct mqtt_connection mqtt_conn;
   struct espconn *tcp_conn;
-  os_timer_t *ping_timer;
+  os_timer_t ping_timer;
+  const struct mqtt_subscription *subs;   // registered on "mqtt_client_connect"
+  uint8_t subs_cnt;
+  enum mqtt_delivery delivery;  // of publishes with no explicit delivery
   void (*user_connect_cb)(struct mqtt_connection *);
-  void (*user_subscribe_cb)(struct mqtt_connection *, const uint16_t);
+  void (*user_pipeline_cb)(struct mqtt_connection *);   // first flight (pipelined connect)
+  void (*user_subscribe_cb)(struct mqtt_connection *, char *, enum mqtt_suback_status);
   void (*user_message_cb)(struct mqtt_connection *, struct mqtt_message *);
   void (*user_disconnet_cb)(struct mqtt_connection *);
+  void (*user_tx_ready_cb)(struct mqtt_connection *);
+  void (*stream_cb)(struct mqtt_connection *, uint32_t);
+  #if MQTT_V5
+  void (*user_reason_cb)(struct mqtt_connection *, enum mqtt_packet_type, uint16_t, enum mqtt_reason_code);
+  #endif
+  struct mqtt_pending_suback pending_subacks[MQTT_MAX_PENDING_SUBACKS];
+  struct mqtt_subscription registry[MQTT_MAX_SUBSCRIPTIONS];   // topic NULL = free
+  struct mqtt_router router;    // subscription handlers
+  #if MQTT_DEDUP_SLOTS
+  struct mqtt_dedup_entry dedup[MQTT_DEDUP_SLOTS];
+  uint8_t dedup_next;
+  #endif
+  struct mqtt_dedup_stats dedup_stats;
+  #if MQTT_DISPATCH_QUEUE
+  struct mqtt_dispatch_queue dispatch[MQTT_LANES];
+  bool dispatch_posted;         // task run pending
+  #endif
+  uint32_t registry_granted;    // entries subscribed on broker session
+  uint32_t registry_pending;    // entries waiting SUBACK
+  bool session;                 // broker expected to keep our session
+  bool online;                  // packets can be queued on current connection
 };
 
 // Client operations
 void mqtt_client_connect(struct mqtt_client *cfg);
-void mqtt_client_publish(struct mqtt_connection *conn, char *topic, uint8_t *message, enum mqtt_qos qos, bool retain);
-void mqtt_client_subscribe(struct mqtt_connection *conn, char *topic, enum mqtt_qos qos,
-                          void (*cb)(struct mqtt_connection *, struct mqtt_message *));
-void mqtt_client_unsubscribe(struct mqtt_connection *conn, char *topic);
+enum mqtt_status mqtt_client_publish(struct mqtt_connection *conn, char *topic, uint8_t *message, enum mqtt_qos qos, bool retain);
+enum mqtt_status mqtt_client_publishv(struct mqtt_connection *conn, char *topic, const struct mqtt_fragment *frags,
+                                      uint8_t frags_cnt, enum mqtt_qos qos, bool retain,
+                                      void (*cb)(struct mqtt_connection *, uint16_t));
+enum mqtt_status mqtt_client_publish_to(struct mqtt_connection *conn, char *topic, const struct mqtt_fragment *frags,
+                                        uint8_t frags_cnt, enum mqtt_qos qos, bool retain, enum mqtt_delivery delivery,
+                                        void (*cb)(struct mqtt_connection *, uint16_t));
+enum mqtt_status mqtt_client_publish_topic(struct mqtt_connection *conn, const struct mqtt_topic *topic,
+                                           const struct mqtt_fragment *frags, uint8_t frags_cnt,
+                                           void (*cb)(struct mqtt_connection *, uint16_t));
+enum mqtt_status mqtt_client_publish_stream(struct mqtt_connection *conn, char *topic, uint32_t message_len,
+                                            enum mqtt_qos qos, bool retain,
+                                            void (*cb)(struct mqtt_connection *, uint32_t));
+uint16_t mqtt_client_publish_chunk(struct mqtt_connection *conn, const uint8_t *data, uint16_t data_len);
+enum mqtt_status mqtt_client_subscribe(struct mqtt_connection *conn, char *topic, enum mqtt_qos qos,
+                                       void (*cb)(struct mqtt_connection *, struct mqtt_message *));
+enum mqtt_status mqtt_client_subscribev(struct mqtt_connection *conn, const struct mqtt_subscription *subs,
+                                        uint8_t subs_cnt);
+enum mqtt_status mqtt_client_unsubscribe(struct mqtt_connection *conn, char *topic);
+enum mqtt_status mqtt_client_unsubscribev(struct mqtt_connection *conn, char **topics, uint8_t topics_cnt);
+uint16_t mqtt_client_topic_id(struct mqtt_connection *conn, char *topic);
+const struct mqtt_intern_stats *mqtt_client_intern_stats(struct mqtt_connection *conn);
+const struct mqtt_router_stats *mqtt_client_router_stats(struct mqtt_connection *conn);
+const struct mqtt_route_stats *mqtt_client_route_stats(struct mqtt_connection *conn, char *topic);
+const struct mqtt_dedup_stats *mqtt_client_dedup_stats(struct mqtt_connection *conn);
+const struct mqtt_dispatch_stats *mqtt_client_dispatch_stats(struct mqtt_connection *conn, enum mqtt_dispatch_lane lane);
 
 #endif
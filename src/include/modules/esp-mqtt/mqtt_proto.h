@@ -2,26 +2,70 @@
 #define ESP_MQTT_PROTO_H
 
 #include <stdint.h>
+#include "modules/utils/hashtable.h"
 
 #define MQTT_BUFFER_SIZE    512
 #define MQTT_SSL_SIZE       1024 * 5 // rule of thumb (PUBLIC_KEY_SIZE / 2) * 5
+#define MQTT_MAX_REMLEN     268435455 // 4 bytes Multi-Byte Integer
+#ifndef MQTT_ZERO_COPY
+#define MQTT_ZERO_COPY      0         // messages point to receive buffer (not NULL terminated)
+#endif
+
+#define MQTT_TX_BUFFER_SIZE     1024  // transmit queue (encoded packets waiting transport)
+#define MQTT_TX_SLOTS           8     // max packets on transmit queue
+#define MQTT_TX_LOW_WATERMARK   256   // queued bytes to wake producers up after "would block"
+#define MQTT_MAX_PENDING_ACKS   8     // acks held while transmit queue can't take them
+#define MQTT_TX_RETRY_DELAY     20    // ms before retrying a write rejected by transport
+
+#define MQTT_MAX_INFLIGHT   8      // QoS 1/2 messages waiting ack (max 32)
+#define MQTT_MAX_INBOUND    8      // QoS 2 messages received waiting PUBREL
+#define MQTT_RETRY_TIMEOUT  10000  // ms before resending unacknowledged messages (MQTT 3.1.1 only)
+#define MQTT_CONNECT_CACHE  1      // keep encoded CONNECT for reconnections
+#define MQTT_MAX_CAPTURES   4      // wildcard levels passed to subscription handlers
+
+#ifndef MQTT_TOPIC_INTERN
+#define MQTT_TOPIC_INTERN        0    // inbound topics kept interned (0 = copied per message, e.g. 16)
+#endif
+#define MQTT_TOPIC_INTERN_LEN    64   // longest interned topic
+
+#ifndef MQTT_TX_COALESCE
+#define MQTT_TX_COALESCE         0    // pack consecutive packets on one transport write
+#endif
+#define MQTT_TX_COALESCE_BYTES   256  // write as soon as queued bytes reach it
+#define MQTT_TX_COALESCE_PACKETS 4    // write as soon as queued packets reach it
+#define MQTT_TX_COALESCE_DELAY   5    // max ms waiting for more packets
+
+#ifndef MQTT_V5
+#define MQTT_V5                  0    // MQTT 5.0 protocol (3.1.1 otherwise)
+#endif
+#define MQTT_V5_ALIASES_OUT      8    // topic aliases for outbound QoS 0 PUBLISH
+#define MQTT_V5_ALIASES_IN       8    // topic aliases accepted from broker
+#define MQTT_V5_SESSION_EXPIRY   3600 // s session kept by broker (clean_session not set)
 
-// MQTT packet types (QoS 2 packets not supported)
+// MQTT packet types
 enum mqtt_packet_type {
   MQTT_CONNECT       = 1,
   MQTT_CONNACK       = 2,
   MQTT_PUBLISH       = 3,
   MQTT_PUBACK        = 4,
-  MQTT_PUBREC        = 5, // not supported
-  MQTT_PUBREL        = 6, // not supported
-  MQTT_PUBCOMP       = 7, // not supported
+  MQTT_PUBREC        = 5,
+  MQTT_PUBREL        = 6,
+  MQTT_PUBCOMP       = 7,
   MQTT_SUBSCRIBE     = 8,
   MQTT_SUBACK        = 9,
   MQTT_UNSUBSCRIBE   = 10,
   MQTT_UNSUBACK      = 11,
   MQTT_PINGREQ       = 12,
   MQTT_PINGRESP      = 13,
-  MQTT_DISCONNECT    = 14
+  MQTT_DISCONNECT    = 14,
+  MQTT_AUTH          = 15   // MQTT 5.0 only
+};
+
+enum mqtt_status {
+  MQTT_OK,
+  MQTT_WOULD_BLOCK,   // transmit queue or in-flight window full, retry on "tx_ready_cb"
+  MQTT_ERROR,         // can't be encoded (e.g. bigger than transmit queue)
+  MQTT_NO_MEMORY      // out of memory (e.g. QoS 1/2 copy kept for retransmission)
 };
 
 enum mqtt_qos {
@@ -39,6 +83,67 @@ enum mqtt_connack_status {
   MQTT_CONNACK_FAIL_NOT_AUTHORIZED       = 0x05
 };
 
+// MQTT 5.0 reason codes (>= 0x80 are failures)
+enum mqtt_reason_code {
+  MQTT_REASON_SUCCESS                    = 0x00,
+  MQTT_REASON_NO_MATCHING_SUBSCRIBERS    = 0x10,
+  MQTT_REASON_NO_SUBSCRIPTION_EXISTED    = 0x11,
+  MQTT_REASON_UNSPECIFIED_ERROR          = 0x80,
+  MQTT_REASON_MALFORMED_PACKET           = 0x81,
+  MQTT_REASON_PROTOCOL_ERROR             = 0x82,
+  MQTT_REASON_IMPLEMENTATION_SPECIFIC    = 0x83,
+  MQTT_REASON_NOT_AUTHORIZED             = 0x87,
+  MQTT_REASON_SERVER_BUSY                = 0x89,
+  MQTT_REASON_TOPIC_NAME_INVALID         = 0x90,
+  MQTT_REASON_PACKET_ID_IN_USE           = 0x91,
+  MQTT_REASON_PACKET_ID_NOT_FOUND        = 0x92,
+  MQTT_REASON_RECEIVE_MAXIMUM_EXCEEDED   = 0x93,
+  MQTT_REASON_TOPIC_ALIAS_INVALID        = 0x94,
+  MQTT_REASON_PACKET_TOO_LARGE           = 0x95,
+  MQTT_REASON_QUOTA_EXCEEDED             = 0x97,
+  MQTT_REASON_PAYLOAD_FORMAT_INVALID     = 0x99
+};
+
+// MQTT 5.0 properties
+enum mqtt_property_id {
+  MQTT_PROP_PAYLOAD_FORMAT               = 0x01,
+  MQTT_PROP_MESSAGE_EXPIRY               = 0x02,
+  MQTT_PROP_CONTENT_TYPE                 = 0x03,
+  MQTT_PROP_RESPONSE_TOPIC               = 0x08,
+  MQTT_PROP_CORRELATION_DATA             = 0x09,
+  MQTT_PROP_SUBSCRIPTION_ID              = 0x0B,
+  MQTT_PROP_SESSION_EXPIRY               = 0x11,
+  MQTT_PROP_ASSIGNED_CLIENT_ID           = 0x12,
+  MQTT_PROP_SERVER_KEEP_ALIVE            = 0x13,
+  MQTT_PROP_AUTH_METHOD                  = 0x15,
+  MQTT_PROP_AUTH_DATA                    = 0x16,
+  MQTT_PROP_REQUEST_PROBLEM_INFO         = 0x17,
+  MQTT_PROP_WILL_DELAY                   = 0x18,
+  MQTT_PROP_REQUEST_RESPONSE_INFO        = 0x19,
+  MQTT_PROP_RESPONSE_INFO                = 0x1A,
+  MQTT_PROP_SERVER_REFERENCE             = 0x1C,
+  MQTT_PROP_REASON_STRING                = 0x1F,
+  MQTT_PROP_RECEIVE_MAXIMUM              = 0x21,
+  MQTT_PROP_TOPIC_ALIAS_MAXIMUM          = 0x22,
+  MQTT_PROP_TOPIC_ALIAS                  = 0x23,
+  MQTT_PROP_MAXIMUM_QOS                  = 0x24,
+  MQTT_PROP_RETAIN_AVAILABLE             = 0x25,
+  MQTT_PROP_USER_PROPERTY                = 0x26,
+  MQTT_PROP_MAXIMUM_PACKET_SIZE          = 0x27,
+  MQTT_PROP_WILDCARD_SUB_AVAILABLE       = 0x28,
+  MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE    = 0x29,
+  MQTT_PROP_SHARED_SUB_AVAILABLE         = 0x2A
+};
+
+struct mqtt_property {
+  uint8_t id;           // enum mqtt_property_id
+  uint32_t value;       // integer properties
+  uint8_t *data;        // string/binary properties (user property name)
+  uint16_t len;
+  uint8_t *data2;       // user property value
+  uint16_t len2;
+};
+
 enum mqtt_suback_status {
   MQTT_SUBACK_SUCCESS_QOS_0      = 0x00,
   MQTT_SUBACK_SUCCESS_QOS_1      = 0x01,
@@ -49,12 +154,142 @@ enum mqtt_suback_status {
 struct mqtt_buffer {
   uint8_t *data;
   uint16_t offset;
+  uint16_t size;
+  bool overflow;
+};
+
+struct mqtt_tx_slot {
+  uint16_t offset;
+  uint16_t len;
+};
+
+struct mqtt_tx_stats {
+  uint32_t writes;    // transport writes
+  uint32_t packets;   // packets sent (packets / writes = packets per write)
+  uint32_t bytes;     // bytes sent
+};
+
+struct mqtt_tx_queue {
+  uint8_t *data;
+  struct mqtt_tx_slot slots[MQTT_TX_SLOTS];
+  uint8_t first;
+  uint8_t count;
+  uint8_t inflight;
+  uint16_t tail;
+  uint16_t queued;
+  bool blocked;
+  bool stopped;         // connection lost (until "mqtt_connect")
+  struct mqtt_tx_stats stats;
+  os_timer_t timer;     // coalescing deadline, transport retry
+  bool timer_armed;
+};
+
+struct mqtt_ack_queue {
+  uint8_t types[MQTT_MAX_PENDING_ACKS];   // enum mqtt_packet_type
+  uint16_t ids[MQTT_MAX_PENDING_ACKS];
+  uint8_t first;
+  uint8_t count;
+  bool ping;            // PINGREQ held too
+};
+
+enum mqtt_parser_state {
+  MQTT_PARSER_HEADER,   // waiting fixed header 1st byte
+  MQTT_PARSER_REMLEN,   // decoding remaining length (1 to 4 bytes)
+  MQTT_PARSER_BODY,     // buffering variable header + payload
+  MQTT_PARSER_DISCARD   // skipping packet bigger than buffer
+};
+
+struct mqtt_parser {
+  enum mqtt_parser_state state;
+  uint8_t header;
+  uint8_t remlen_bytes;
+  uint32_t remlen;
+  uint32_t pending;
+  struct mqtt_buffer buffer;
+};
+
+struct mqtt_stream {
+  uint32_t remaining;
+};
+
+struct mqtt_connection;
+
+enum mqtt_inflight_state {
+  MQTT_INFLIGHT_PUBACK,   // QoS 1 PUBLISH sent
+  MQTT_INFLIGHT_PUBREC,   // QoS 2 PUBLISH sent
+  MQTT_INFLIGHT_PUBCOMP   // QoS 2 PUBREL sent
+};
+
+struct mqtt_inflight {
+  uint16_t packet_id;
+  uint8_t state;        // enum mqtt_inflight_state
+  uint8_t age;          // retransmission timer ticks
+  uint8_t *packet;      // encoded PUBLISH (for retransmission)
+  uint16_t packet_len;
+  void (*delivered_cb)(struct mqtt_connection *, uint16_t);
+};
+
+struct mqtt_session {
+  uint32_t used;        // in-flight slots bitmap
+  uint8_t count;
+  bool blocked;         // packet ID refused, "tx_ready_cb" on next release
+  struct mqtt_inflight inflight[MQTT_MAX_INFLIGHT];
+  uint16_t inbound[MQTT_MAX_INBOUND];  // QoS 2 ids waiting PUBREL (0 = free)
+  #if !MQTT_V5
+  os_timer_t timer;     // retransmissions
+  #endif
+};
+
+struct mqtt_alias {
+  uint8_t *topic;       // pool copy (NULL = free)
+  uint16_t topic_len;
+};
+
+struct mqtt_v5_session {
+  uint16_t receive_max;       // broker Receive Maximum (QoS 1/2 in-flight)
+  uint16_t alias_max;         // broker Topic Alias Maximum
+  uint32_t max_packet_size;   // broker Maximum Packet Size (0 = no limit)
+  uint8_t alias_next;         // next outbound alias replaced (round robin)
+  struct mqtt_alias alias_out[MQTT_V5_ALIASES_OUT];
+  struct mqtt_alias alias_in[MQTT_V5_ALIASES_IN];
+};
+
+struct mqtt_capture {
+  uint16_t offset;      // on topic
+  uint16_t len;
 };
 
 struct mqtt_message {
-  uint8_t *topic;
+  uint8_t *topic;       // valid during "message_cb" only (interned ones too), see "mqtt_message_copy"
+  uint16_t topic_len;
   uint8_t *data;
   uint16_t data_len;
+  #if MQTT_V5
+  uint8_t *props;       // PUBLISH properties (valid during "message_cb" only)
+  uint16_t props_len;
+  #endif
+  struct mqtt_capture captures[MQTT_MAX_CAPTURES];  // "+" levels and "#" tail of handler filter (client routing)
+  uint8_t captures_cnt;
+  uint16_t topic_id;    // interned topic (0 = not interned), see "mqtt_topic_id"
+};
+
+struct mqtt_subscription {
+  char *topic;
+  enum mqtt_qos qos;
+  void (*cb)(struct mqtt_connection *, struct mqtt_message *);  // optional (client routing)
+  bool control;         // control traffic (client deferred dispatch)
+  bool once;            // overlapping "once" subscriptions: most specific one handles
+};
+
+struct mqtt_topic {
+  uint8_t fixed_hd;     // PUBLISH fixed header (QoS/retain flags)
+  uint16_t len;
+  uint8_t *data;        // length prefixed topic
+};
+
+struct mqtt_fragment {
+  const uint8_t *data;
+  uint16_t len;
 };
 
 struct mqtt_last_will {
@@ -64,28 +299,110 @@ struct mqtt_last_will {
   enum mqtt_qos qos;
 };
 
+struct mqtt_connect_cache {
+  uint8_t *data;          // encoded CONNECT (NULL = none)
+  uint16_t len;
+  // Fields it was encoded from
+  char *client_id;
+  char *username;
+  char *password;
+  uint8_t *will_topic;
+  uint8_t *will_data;
+  uint16_t kalive;
+  uint8_t flags;
+};
+
+struct mqtt_intern_stats {
+  uint32_t hits;        // inbound topics found interned (no allocation)
+  uint32_t misses;      // topics interned
+  uint32_t evictions;   // least recently used topic replaced by a new one
+  uint32_t skipped;     // not interned (too long, pinned slots or out of memory)
+};
+
+#if MQTT_TOPIC_INTERN
+struct mqtt_interned_topic {
+  uint8_t *topic;       // NULL terminated (NULL = free)
+  uint16_t len;
+  uint16_t id;          // kept while interned
+  uint32_t used;        // intern clock on last use
+  bool pinned;          // never evicted
+};
+
+struct mqtt_topic_intern {
+  struct mqtt_interned_topic topics[MQTT_TOPIC_INTERN];
+  hash_t *index;        // topic -> entry (created on first use)
+  uint32_t clock;
+  uint16_t next_id;
+};
+#endif
+
 struct mqtt_connection {
   uint16_t kalive;
   bool clean_session;
+  bool pipelined;       // queue packets right after CONNECT (not waiting CONNACK)
   char *client_id;
   char *username;
   char *password;
-  int packet_id;
+  uint16_t packet_id;
   struct mqtt_last_will last_will;
+  struct mqtt_parser parser;
+  struct mqtt_stream stream;
+  struct mqtt_tx_queue tx;
+  struct mqtt_ack_queue acks;
+  struct mqtt_session session;
+  #if MQTT_CONNECT_CACHE
+  struct mqtt_connect_cache connect;
+  #endif
+  #if MQTT_V5
+  struct mqtt_v5_session v5;
+  #endif
+  #if MQTT_TOPIC_INTERN
+  struct mqtt_topic_intern intern;
+  #endif
+  struct mqtt_intern_stats intern_stats;
   void *reverse;
-  void (*connect_cb)(struct mqtt_connection *, enum mqtt_connack_status);
-  void (*subscribe_cb)(struct mqtt_connection *, enum mqtt_suback_status, const uint16_t);
-  void (*send_cb)(struct mqtt_connection *, uint8_t *, int);
+  void (*connect_cb)(struct mqtt_connection *, enum mqtt_connack_status, bool);
+  void (*subscribe_cb)(struct mqtt_connection *, const uint16_t, const uint8_t *, uint16_t);
+  bool (*send_cb)(struct mqtt_connection *, uint8_t *, int);
+  void (*tx_ready_cb)(struct mqtt_connection *);
   void (*message_cb)(struct mqtt_connection *, struct mqtt_message *);
+  #if MQTT_V5
+  void (*reason_cb)(struct mqtt_connection *, enum mqtt_packet_type, uint16_t, enum mqtt_reason_code);
+  #endif
 };
 
 // MQTT client methods
-void mqtt_connect(struct mqtt_connection *conn);
-void mqtt_disconnect(struct mqtt_connection *conn);
-void mqtt_subscribe(struct mqtt_connection *conn, char *topic, enum mqtt_qos qos);
-void mqtt_unsubscribe(struct mqtt_connection *conn, char *topic);
-void mqtt_publish(struct mqtt_connection *conn, char *topic, uint8_t *message, enum mqtt_qos qos, bool retain);
-void mqtt_ping(struct mqtt_connection *conn);
+enum mqtt_status mqtt_connect(struct mqtt_connection *conn);
+void mqtt_connect_invalidate(struct mqtt_connection *conn);
+enum mqtt_status mqtt_disconnect(struct mqtt_connection *conn);
+enum mqtt_status mqtt_subscribe(struct mqtt_connection *conn, char *topic, enum mqtt_qos qos);
+enum mqtt_status mqtt_subscribev(struct mqtt_connection *conn, const struct mqtt_subscription *subs,
+                                 uint8_t subs_cnt, uint8_t *packed, uint16_t *packet_id);
+enum mqtt_status mqtt_unsubscribe(struct mqtt_connection *conn, char *topic);
+enum mqtt_status mqtt_unsubscribev(struct mqtt_connection *conn, char **topics, uint8_t topics_cnt, uint8_t *packed);
+enum mqtt_status mqtt_publish(struct mqtt_connection *conn, char *topic, uint8_t *message, enum mqtt_qos qos, bool retain);
+enum mqtt_status mqtt_publishv(struct mqtt_connection *conn, char *topic, const struct mqtt_fragment *frags,
+                               uint8_t frags_cnt, enum mqtt_qos qos, bool retain,
+                               void (*cb)(struct mqtt_connection *, uint16_t));
+enum mqtt_status mqtt_publish_topic(struct mqtt_connection *conn, const struct mqtt_topic *topic,
+                                    const struct mqtt_fragment *frags, uint8_t frags_cnt,
+                                    void (*cb)(struct mqtt_connection *, uint16_t));
+enum mqtt_status mqtt_publish_begin(struct mqtt_connection *conn, char *topic, uint32_t message_len,
+                                    enum mqtt_qos qos, bool retain);
+uint16_t mqtt_publish_chunk(struct mqtt_connection *conn, const uint8_t *data, uint16_t data_len);
+enum mqtt_status mqtt_ping(struct mqtt_connection *conn);
+struct mqtt_topic *mqtt_topic_register(const char *topic, const char *arg, enum mqtt_qos qos, bool retain);
+void mqtt_topic_unregister(struct mqtt_topic *topic);
+uint16_t mqtt_topic_id(struct mqtt_connection *conn, const char *topic);
+struct mqtt_message *mqtt_message_copy(struct mqtt_message *message);
+void mqtt_message_free(struct mqtt_message *message);
+void mqtt_parser_reset(struct mqtt_connection *conn);
+void mqtt_flush(struct mqtt_connection *conn);
+void mqtt_sent(struct mqtt_connection *conn);
+void mqtt_disconnected(struct mqtt_connection *conn);
 void mqtt_parse_packet(struct mqtt_connection *conn, uint8_t *data, int data_len);
+#if MQTT_V5
+bool mqtt_property_next(uint8_t **props, uint16_t *props_len, struct mqtt_property *prop);
+#endif
 
 #endif
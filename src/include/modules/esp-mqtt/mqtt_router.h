@@ -0,0 +1,111 @@
+#ifndef ESP_MQTT_ROUTER_H
+#define ESP_MQTT_ROUTER_H
+
+#include <osapi.h>
+#include "mqtt_proto.h"
+
+#define MQTT_ROUTER_MAX_MATCHES   8   // filters collected per message
+#ifndef MQTT_ROUTER_CACHE_SIZE
+#define MQTT_ROUTER_CACHE_SIZE    8   // topics with cached handlers (0 = no cache)
+#endif
+#define MQTT_ROUTER_CACHE_TOPIC   32  // longest cached topic
+
+// Route flags
+#define MQTT_ROUTE_CONTROL        0x01  // control traffic (dispatched ahead of bulk)
+#define MQTT_ROUTE_ONCE           0x02  // overlapping "once" filters: most specific one handles
+
+/**
+ *  Topic filter trie
+ *
+ *  One node per filter level, filters are compiled on subscription and
+ *  topics matched level by level (MQTT 3.1.1 section 4.7 rules) with no
+ *  allocation.
+ *  Match results of recent topics (including "no match") are cached until
+ *  filters change.
+ *  Routes keep which levels of their filter are wildcards, so the topic
+ *  parts taken by them are found without looking at the filter again.
+ *
+ *  Subscription sets known at build time can be compiled into a static
+ *  route table (tools/mqtt_routes.py): levels kept in flash, matching code
+ *  specialised to the set, no heap. Static routes are matched first, the
+ *  trie holds the filters added later (overlaps between both not counted).
+ */
+
+struct mqtt_route_stats {
+  uint32_t handled;     // messages passed to handler
+  uint32_t skipped;     // matched, handled by a more specific "once" filter
+  uint32_t duplicates;  // matched, suppressed as broker copy (overlapping subscriptions)
+  uint8_t overlaps;     // other filters matching common topics
+};
+
+struct mqtt_route_node {
+  struct mqtt_route_node **children;  // exact levels (sorted by "level_hash")
+  uint16_t children_cnt;
+  uint16_t children_size;
+  struct mqtt_route_node *plus;       // "+" level
+  struct mqtt_route_node *hash;       // "#" level
+  void (*cb)(struct mqtt_connection *, struct mqtt_message *);   // filter ends here
+  uint8_t flags;                      // MQTT_ROUTE_*
+  uint8_t specificity;                // exact levels count 2, "+" 1, "#" 0
+  uint8_t levels;                     // filter levels
+  uint32_t plus_levels;               // bit per "+" level (first 32 levels)
+  struct mqtt_route_stats stats;
+  char *level;                        // not NULL terminated
+  uint16_t level_len;
+  uint16_t level_hash;
+};
+
+struct mqtt_route_cache {
+  uint32_t hash;                      // 0 = free
+  uint8_t topic_len;
+  uint8_t routes_cnt;                 // 0 = no match (fallback handler)
+  uint8_t flags;
+  char topic[MQTT_ROUTER_CACHE_TOPIC];
+  struct mqtt_route_node *routes[MQTT_ROUTER_MAX_MATCHES];
+};
+
+struct mqtt_route_matches {
+  struct mqtt_route_node **routes;
+  uint8_t max;
+  uint8_t count;
+  uint8_t flags;                      // merged MQTT_ROUTE_*
+};
+
+struct mqtt_route_table {
+  void (*match)(const char *topic, const char *end, struct mqtt_route_matches *matches);
+  struct mqtt_route_node *routes;     // one per subscription (handler, flags, counters)
+  const struct mqtt_subscription *subs;
+  uint8_t subs_cnt;
+};
+
+struct mqtt_router_stats {
+  uint32_t hits;      // topics resolved from cache
+  uint32_t misses;    // topics matched on trie
+};
+
+struct mqtt_router {
+  const struct mqtt_route_table *table;   // static routes (optional)
+  struct mqtt_route_node root;
+  #if MQTT_ROUTER_CACHE_SIZE
+  struct mqtt_route_cache cache[MQTT_ROUTER_CACHE_SIZE];   // direct mapped (topic hash)
+  #endif
+  struct mqtt_router_stats stats;
+};
+
+bool mqtt_router_add(struct mqtt_router *router, const char *filter,
+                     void (*cb)(struct mqtt_connection *, struct mqtt_message *), uint8_t flags);
+bool mqtt_router_remove(struct mqtt_router *router, const char *filter);
+uint8_t mqtt_router_match(struct mqtt_router *router, const char *topic, uint16_t topic_len,
+                          struct mqtt_route_node *routes[], uint8_t max, uint8_t *flags);
+uint8_t mqtt_router_captures(const struct mqtt_route_node *route, const char *topic, uint16_t topic_len,
+                             struct mqtt_capture captures[], uint8_t max);
+struct mqtt_route_node *mqtt_router_find(struct mqtt_router *router, const char *filter);
+void mqtt_router_clear(struct mqtt_router *router);
+void mqtt_router_invalidate(struct mqtt_router *router);
+
+// Static route table matching (generated code)
+uint16_t mqtt_router_level(const char *level, const char *end, uint16_t *hash);
+bool mqtt_router_level_is(const char *level, uint16_t len, const uint32_t *name, uint16_t name_len);
+void mqtt_router_collect(struct mqtt_route_matches *matches, struct mqtt_route_node *route);
+
+#endif
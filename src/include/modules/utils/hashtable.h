@@ -2,22 +2,33 @@
 #define _HASHTABLE_H
 
 /**
- *  Adapted from:
+ *  String keyed hash table (Robin Hood open addressing)
  *
- *  https://rosettacode.org/wiki/Associative_arrays/Creation/C
+ *  Keys are copied on insert and compared by content (not NULL terminated,
+ *  explicit lengths). Hashes are kept next to the slots so probing mostly
+ *  scans the "hashes" array, keys are compared only on equal hashes.
+ *  Deletion shifts the following entries back (no tombstones) and the
+ *  table doubles when HASH_LOAD_FACTOR is reached.
  */
 
+#define HASH_MIN_SIZE       8       // slots (power of 2)
+#define HASH_LOAD_FACTOR    75      // % of slots used before growing
+
 typedef struct {
-    int size;
-    void **keys;
+    uint32_t *hashes;       // 0 = free slot
+    char **keys;
+    uint16_t *key_lens;
     void **values;
+    uint16_t size;          // slots (power of 2)
+    uint16_t count;         // entries
 } hash_t;
 
-hash_t *hash_create (int size);
-int hash_index(hash_t *h, void *key);
-void hash_insert (hash_t *h, void *key, void *value);
-void* hash_lookup (hash_t *h, void *key);
-void hash_delete(hash_t *h, void *key);
+hash_t *hash_create(int size);
+void hash_destroy(hash_t *h);
+bool hash_insert(hash_t *h, const char *key, uint16_t key_len, void *value);
+void *hash_lookup(hash_t *h, const char *key, uint16_t key_len);
+bool hash_delete(hash_t *h, const char *key, uint16_t key_len);
 bool hash_is_empty(hash_t *h);
+uint32_t hash_string(const char *key, uint16_t key_len);
 
-#endif
\ No newline at end of file
+#endif
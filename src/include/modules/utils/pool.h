@@ -0,0 +1,42 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/**
+ *  Fixed-size block pool (slab classes)
+ *
+ *  Requests are served by the smallest class that fits, when all blocks of
+ *  that class are in use by the next larger class with free blocks. Heap
+ *  is used only when every class that fits is exhausted (or the size is
+ *  too big).
+ */
+
+#define POOL_CLASSES        4
+#define POOL_CLASS_0_SIZE   16
+#define POOL_CLASS_0_COUNT  16
+#define POOL_CLASS_1_SIZE   32
+#define POOL_CLASS_1_COUNT  8
+#define POOL_CLASS_2_SIZE   64
+#define POOL_CLASS_2_COUNT  8
+#define POOL_CLASS_3_SIZE   128
+#define POOL_CLASS_3_COUNT  4
+
+#define POOL_ARENA_SIZE     ((POOL_CLASS_0_SIZE * POOL_CLASS_0_COUNT) + \
+                             (POOL_CLASS_1_SIZE * POOL_CLASS_1_COUNT) + \
+                             (POOL_CLASS_2_SIZE * POOL_CLASS_2_COUNT) + \
+                             (POOL_CLASS_3_SIZE * POOL_CLASS_3_COUNT))
+
+typedef struct {
+    uint16_t size;          // block size
+    uint16_t count;         // blocks on class
+    uint16_t used;          // blocks in use
+    uint16_t high_water;    // max blocks in use
+    uint32_t borrowed;      // requests served by a larger class (class exhausted)
+    uint32_t fallbacks;     // requests served by heap (class and larger ones exhausted)
+} pool_stats_t;
+
+void *pool_alloc(uint32_t size);
+void *pool_zalloc(uint32_t size);
+void pool_free(void *ptr);
+bool pool_stats(uint8_t cls, pool_stats_t *stats);
+
+#endif
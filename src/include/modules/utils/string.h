@@ -1,8 +0,0 @@
-#ifndef _STRING_UTILS_H_
-#define _STRING_UTILS_H_
-
-bool starts_with(char* base, char* str);
-bool ends_with(char* base, char* str);
-void split(char *base, char *str, char *splits[]);
-
-#endif
\ No newline at end of file
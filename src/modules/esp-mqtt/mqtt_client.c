@@ -3,43 +3,199 @@
 #include <espconn.h>
 #include <mem.h>
 
+#include "modules/utils/pool.h"
 #include "modules/utils/hashtable.h"
-#include "modules/utils/string.h"
 #include "modules/esp-mqtt/mqtt_client.h"
 
-#define MAX_MQTT_CALLBACKS 10
-
-// Features
-static hash_t *sub_hash;
-
 /******************************************************************************
  * Remove old subscription callback
  *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
-remove_subscription_callback(char *pattern)
+remove_subscription_callback(struct mqtt_client *cli, char *pattern)
 {
-  if(sub_hash != NULL)
-      hash_delete(sub_hash, pattern);
+  mqtt_router_remove(&cli->router, pattern);
 }
 
 /******************************************************************************
  * Add new subscription callback
  *
+ * Returns FALSE if filter is invalid or out of memory
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+add_subscription_callback(struct mqtt_client *cli, const struct mqtt_subscription *sub)
+{
+  uint8_t flags = 0;
+
+  if(sub->control)
+    flags |= MQTT_ROUTE_CONTROL;
+  if(sub->once)
+    flags |= MQTT_ROUTE_ONCE;
+
+  // Defines specific callback? (replaces previous one)
+  if(sub->cb != NULL)
+    return mqtt_router_add(&cli->router, sub->topic, sub->cb, flags);
+  return TRUE;
+}
+
+//
+// SUBSCRIPTION REGISTRY
+//
+
+/******************************************************************************
+ * Find registered subscription
+ *
+ *******************************************************************************/
+static int8_t ICACHE_FLASH_ATTR
+registry_find(struct mqtt_client *cli, char *topic)
+{
+  int8_t i;
+
+  for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+  {
+    char *entry = cli->registry[i].topic;
+    if(entry != NULL && (entry == topic || os_strcmp(entry, topic) == 0))
+      return i;
+  }
+  return -1;
+}
+
+/******************************************************************************
+ * Free registry entries needed by subscriptions (new topic filters)
+ *
+ *******************************************************************************/
+static uint8_t ICACHE_FLASH_ATTR
+registry_needed(struct mqtt_client *cli, const struct mqtt_subscription *subs, uint8_t subs_cnt)
+{
+  uint8_t i, j, needed = 0;
+
+  for(i = 0; i < subs_cnt; i++)
+  {
+    if(registry_find(cli, subs[i].topic) >= 0)
+      continue;
+    // Repeated on "subs" (last one replaces the others)
+    for(j = 0; j < i && os_strcmp(subs[j].topic, subs[i].topic) != 0; j++);
+    if(j == i)
+      ++needed;
+  }
+  return needed;
+}
+
+/******************************************************************************
+ * Free registry entries
+ *
+ *******************************************************************************/
+static uint8_t ICACHE_FLASH_ATTR
+registry_available(struct mqtt_client *cli)
+{
+  uint8_t i, available = 0;
+
+  for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    if(cli->registry[i].topic == NULL)
+      ++available;
+  return available;
+}
+
+/******************************************************************************
+ * Register subscription (replaces the one with same topic filter)
+ *
+ * An unchanged one keeps its broker state (not sent again while the broker
+ * keeps our session). Returns FALSE if it can't be registered (registry
+ * full, invalid filter or out of memory), a new one is not kept then.
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+registry_add(struct mqtt_client *cli, const struct mqtt_subscription *sub)
+{
+  int8_t i = registry_find(cli, sub->topic);
+  const struct mqtt_subscription *entry = (i < 0) ? NULL : &cli->registry[i];
+
+  if(entry != NULL && entry->qos == sub->qos && entry->cb == sub->cb &&
+     entry->control == sub->control && entry->once == sub->once)
+    return TRUE;
+
+  // New one takes a free entry
+  if(i < 0)
+  {
+    for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS && cli->registry[i].topic != NULL; i++);
+    if(i == MQTT_MAX_SUBSCRIPTIONS)
+      return FALSE;
+  }
+
+  // Not granted yet (QoS or callback may have changed)
+  if(!add_subscription_callback(cli, sub) && entry == NULL)
+    return FALSE;
+  cli->registry[i] = *sub;
+  cli->registry_granted &= ~(1UL << i);
+  cli->registry_pending &= ~(1UL << i);
+  return TRUE;
+}
+
+/******************************************************************************
+ * Unregister subscription
+ *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
-add_subscription_callback(char *pattern, void (*cb)(struct mqtt_connection *, struct mqtt_message *))
+registry_remove(struct mqtt_client *cli, char *topic)
+{
+  int8_t i = registry_find(cli, topic);
+
+  remove_subscription_callback(cli, topic);
+  if(i < 0)
+    return;
+  cli->registry[i].topic = NULL;
+  cli->registry_granted &= ~(1UL << i);
+  cli->registry_pending &= ~(1UL << i);
+}
+
+/******************************************************************************
+ * Send registered subscriptions not granted nor waiting SUBACK
+ *
+ * Consecutive entries go packed on as few SUBSCRIBE packets as possible
+ *
+ *******************************************************************************/
+static enum mqtt_status ICACHE_FLASH_ATTR
+registry_send(struct mqtt_client *cli)
 {
-   // Create internal hashtable if required
-  if(sub_hash == NULL)
-    sub_hash = hash_create(MAX_MQTT_CALLBACKS);
+  struct mqtt_pending_suback *pending;
+  enum mqtt_status status;
+  uint32_t done;
+  uint8_t i, j, k, n, packed;
+  uint16_t packet_id;
 
-  // Defines specific callback?
-  if(cb != NULL)
+  for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i = j)
   {
-    remove_subscription_callback(pattern);
-    hash_insert(sub_hash, pattern, cb);
+    // Run of entries to send
+    done = cli->registry_granted | cli->registry_pending;
+    for(j = i; j < MQTT_MAX_SUBSCRIPTIONS && cli->registry[j].topic != NULL && (done & (1UL << j)) == 0; j++);
+    if(j == i)
+    {
+      j = i + 1;
+      continue;
+    }
+
+    for(k = i; k < j; k += packed)
+    {
+      // Free SUBACK tracking entry
+      for(pending = cli->pending_subacks; pending < cli->pending_subacks + MQTT_MAX_PENDING_SUBACKS; pending++)
+        if(pending->packet_id == 0)
+          break;
+      if(pending == cli->pending_subacks + MQTT_MAX_PENDING_SUBACKS)
+        return MQTT_WOULD_BLOCK;
+
+      status = mqtt_subscribev(&cli->mqtt_conn, &cli->registry[k], j - k, &packed, &packet_id);
+      if(status != MQTT_OK)
+        return status;
+
+      pending->first = k;
+      pending->count = packed;
+      pending->packet_id = packet_id;
+      for(n = k; n < k + packed; n++)
+        cli->registry_pending |= 1UL << n;
+    }
   }
+  return MQTT_OK;
 }
 
 /******************************************************************************
@@ -70,23 +226,40 @@ ping_timer_cb(void *arg)
 /******************************************************************************
  * Callback called on MQTT connection
  *
+ * Registered subscriptions are restored unless the broker kept our session
+ * (then only the ones never granted are sent). The ones the transmit queue
+ * can't take yet are sent when it drains ("mqtt_tx_ready_handler").
+ *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
-mqtt_connected_handler(struct mqtt_connection *mqtt_conn, enum mqtt_connack_status status)
+mqtt_connected_handler(struct mqtt_connection *mqtt_conn, enum mqtt_connack_status status, bool session_present)
 {
   #if MQTT_DEBUG
-  LOGGER("MQTT: Connection status = %d\n", status);
+  LOGGER("MQTT: Connection status = %d session = %d\n", status, session_present);
   #endif
 
+  struct mqtt_client *cli = (struct mqtt_client *) mqtt_conn->reverse;
+
+  // Pipelined SUBSCRIBEs are lost with the connection
   if(status != MQTT_CONNACK_SUCCESS)
+  {
+    cli->online = FALSE;
+    cli->registry_pending = 0;
+    os_memset(cli->pending_subacks, 0, sizeof(cli->pending_subacks));
     return;
+  }
 
-  struct mqtt_client *cli = (struct mqtt_client *) mqtt_conn->reverse;
-  // Register ping timer
-  cli->ping_timer = NULL;
-  cli->ping_timer = (os_timer_t *) os_zalloc(sizeof(os_timer_t));
-  os_timer_setfn(cli->ping_timer, ping_timer_cb, cli);
-  os_timer_arm(cli->ping_timer, cli->mqtt_conn.kalive * 1000, 1);
+  // Broker lost (or never had) our subscriptions
+  if(!session_present)
+    cli->registry_granted = 0;
+  cli->session = !mqtt_conn->clean_session;
+  cli->online = TRUE;
+  registry_send(cli);
+
+  // Arm ping timer
+  os_timer_disarm(&cli->ping_timer);
+  os_timer_setfn(&cli->ping_timer, ping_timer_cb, cli);
+  os_timer_arm(&cli->ping_timer, cli->mqtt_conn.kalive * 1000, 1);
   // Call user callback
   if (*cli->user_connect_cb)
     cli->user_connect_cb(mqtt_conn);
@@ -95,105 +268,452 @@ mqtt_connected_handler(struct mqtt_connection *mqtt_conn, enum mqtt_connack_stat
 /******************************************************************************
  * Callback called on MQTT subscribe
  *
+ * Reports the granted QoS (or failure) of each topic filter on the SUBSCRIBE,
+ * failed filters drop their message callback.
+ *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
-mqtt_subscribe_handler(struct mqtt_connection *mqtt_conn, enum mqtt_suback_status status, const uint16_t packet_id)
+mqtt_subscribe_handler(struct mqtt_connection *mqtt_conn, const uint16_t packet_id, const uint8_t *codes,
+                       uint16_t codes_cnt)
 {
-  #if MQTT_DEBUG
-  LOGGER("MQTT: Subscribe status = %d\n", status);
-  #endif
+  struct mqtt_client *cli = (struct mqtt_client *) mqtt_conn->reverse;
+  struct mqtt_pending_suback *pending = NULL;
+  enum mqtt_suback_status status;
+  uint32_t entry;
+  char *topic;
+  uint16_t i;
 
-  if(status == MQTT_SUBACK_FAIL)
+  for(i = 0; i < MQTT_MAX_PENDING_SUBACKS; i++)
+    if(cli->pending_subacks[i].packet_id == packet_id)
+      pending = &cli->pending_subacks[i];
+  if(pending == NULL)
     return;
 
+  for(i = 0; i < codes_cnt && i < pending->count; i++)
+  {
+    // Registry entry replaced meanwhile (its SUBSCRIBE is another one)
+    entry = 1UL << (pending->first + i);
+    if((cli->registry_pending & entry) == 0)
+      continue;
+    cli->registry_pending &= ~entry;
+
+    topic = cli->registry[pending->first + i].topic;
+    status = codes[i];
+
+    #if MQTT_DEBUG
+    LOGGER("MQTT: Subscribe %s status = %d\n", topic, status);
+    #endif
+
+    // MQTT 5.0 has many failure reason codes (all >= 0x80)
+    if(status >= MQTT_SUBACK_FAIL)
+      registry_remove(cli, topic);
+    else
+      cli->registry_granted |= entry;
+
+    if (*cli->user_subscribe_cb)
+      cli->user_subscribe_cb(mqtt_conn, topic, status);
+  }
+  pending->packet_id = 0;
+
+  // SUBACK tracking entry free, send subscriptions left waiting for one
+  if(cli->online)
+    registry_send(cli);
+}
+
+#if MQTT_V5
+/******************************************************************************
+ * Callback called on MQTT 5.0 failure reason codes
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+mqtt_reason_handler(struct mqtt_connection *mqtt_conn, enum mqtt_packet_type type, uint16_t packet_id,
+                    enum mqtt_reason_code reason)
+{
+  #if MQTT_DEBUG
+  LOGGER("MQTT: Packet type %d id %d reason = 0x%02x\n", type, packet_id, reason);
+  #endif
+
   struct mqtt_client *cli = (struct mqtt_client *) mqtt_conn->reverse;
-  if (*cli->user_subscribe_cb)
-    cli->user_subscribe_cb(mqtt_conn, packet_id);
+  if (*cli->user_reason_cb)
+    cli->user_reason_cb(mqtt_conn, type, packet_id, reason);
 }
+#endif
 
 /******************************************************************************
  * Callback called to send MQTT messages
  *
  *******************************************************************************/
-static void ICACHE_FLASH_ATTR
+static bool ICACHE_FLASH_ATTR
 mqtt_send_handler(struct mqtt_connection *mqtt_conn, uint8_t *data, int data_len)
 {
   #if MQTT_DEBUG_PACKET
   print_packet(data, data_len);
   #endif
 
+  sint8 err;
   struct mqtt_client *cli = (struct mqtt_client *) mqtt_conn->reverse;
   if(cli->secure)
-    espconn_secure_send(cli->tcp_conn, data, data_len);
+    err = espconn_secure_send(cli->tcp_conn, data, data_len);
   else
-    espconn_send(cli->tcp_conn, data, data_len);
+    err = espconn_send(cli->tcp_conn, data, data_len);
+
+  #if MQTT_DEBUG
+  if(err != ESPCONN_OK)
+    LOGGER("MQTT: Send error %d\n", err);
+  #endif
+  return err == ESPCONN_OK;
 }
 
 /******************************************************************************
- * Callback called to handle MQTT messages
+ * Callback called when transmit queue can take more packets
  *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
-mqtt_message_handler(struct mqtt_connection *mqtt_conn, struct mqtt_message *message)
+mqtt_tx_ready_handler(struct mqtt_connection *mqtt_conn)
 {
   struct mqtt_client *cli = (struct mqtt_client *) mqtt_conn->reverse;
-  uint8_t matches = 0;
-  uint8_t i = 0;
 
-  // Check subscription hashmap
-  if(sub_hash != NULL)
+  // Streamed PUBLISH goes first (nothing else is queued meanwhile)
+  if(mqtt_conn->stream.remaining > 0)
   {
-    for(i = 0; i < sub_hash->size; ++i)
+    if(cli->stream_cb != NULL)
+      cli->stream_cb(mqtt_conn, mqtt_conn->stream.remaining);
+    return;
+  }
+
+  // Subscriptions the queue couldn't take on connection (e.g. full in-flight
+  // window resent first)
+  if(cli->online)
+    registry_send(cli);
+
+  if(cli->user_tx_ready_cb != NULL)
+    cli->user_tx_ready_cb(mqtt_conn);
+}
+
+#if MQTT_DEDUP_SLOTS
+/******************************************************************************
+ * Gets dedup key of message (topic and payload)
+ *
+ *******************************************************************************/
+static uint32_t ICACHE_FLASH_ATTR
+dedup_hash(struct mqtt_message *message)
+{
+  return hash_string((const char *) message->topic, message->topic_len) ^
+         (hash_string((const char *) message->data, message->data_len) * 16777619u);
+}
+
+/******************************************************************************
+ * Checks message is an expected broker copy
+ *
+ * Broker may send one copy per matching subscription (and one more of our
+ * own loopback publishes), copies with the same topic and payload seen
+ * within MQTT_DEDUP_WINDOW of the first one are counted down.
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+dedup_check(struct mqtt_client *cli, struct mqtt_message *message)
+{
+  const uint32_t now = system_get_time();
+  struct mqtt_dedup_entry *entry;
+  uint32_t hash = 0;
+  uint8_t i;
+
+  for(i = 0; i < MQTT_DEDUP_SLOTS; i++)
+  {
+    entry = &cli->dedup[i];
+    if(entry->copies == 0 || now - entry->time >= MQTT_DEDUP_WINDOW * 1000UL)
+      continue;
+    // Hashed only while copies are expected
+    if(hash == 0)
+      hash = dedup_hash(message);
+    if(entry->hash == hash)
     {
-      char* sub_pattern = sub_hash->keys[i];
-      void (*cb)(struct mqtt_connection *, struct mqtt_message *) = sub_hash->values[i];
-      if(sub_pattern == NULL || cb == NULL)
-        continue;
-
-      // Match multi-level?
-      if(ends_with(sub_pattern, "/#"))
-      {
-        // Compare subscription and message topic
-        char* parts[2];
-        split(sub_pattern, "#", parts);
-        if(starts_with(message->topic, parts[0]))
-        {
-          cb(mqtt_conn, message);
-          ++matches;
-          continue;
-        }
-      }
-
-      // Match single-level? (supports just one level)
-      if(os_strstr(sub_pattern, "/+"))
-      {
-          // Compare subscription and message topic
-          char* parts[2];
-          split(sub_pattern, "+", parts);
-          //if(starts_with(message->topic, parts[0]) && ends_with(message->topic, part[1]))
-          if(starts_with(message->topic, parts[0]))
-          {
-            cb(mqtt_conn, message);
-            ++matches;
-            continue;
-          }
-      }
-
-      // Exact match?
-      const uint16_t topic_len = os_strlen(message->topic);
-      if (os_strncmp(sub_pattern, message->topic, topic_len) == 0)
-      {
-        cb(mqtt_conn, message);
-        ++matches;
-        continue;
-      }
+      --entry->copies;
+      ++cli->dedup_stats.suppressed;
+      cli->dedup_stats.bytes += message->topic_len + message->data_len;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
 
+/******************************************************************************
+ * Remembers message expecting "copies" more from broker
+ *
+ * Replaces the oldest remembered message
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+dedup_expect(struct mqtt_client *cli, struct mqtt_message *message, uint8_t copies)
+{
+  struct mqtt_dedup_entry *entry = &cli->dedup[cli->dedup_next];
+
+  cli->dedup_next = (cli->dedup_next + 1) % MQTT_DEDUP_SLOTS;
+  entry->hash = dedup_hash(message);
+  entry->time = system_get_time();
+  entry->copies = copies;
+}
+#endif
+
+/******************************************************************************
+ * Call handlers of matching subscriptions (fallback handler if none)
+ *
+ * "routes" are the ones "mqtt_router_match" found for the message topic.
+ * Among matching "once" subscriptions only the most specific one handles
+ * the message, the others are skipped (counted on their routes).
+ * Handlers find the topic parts taken by their filter wildcards on
+ * message "captures".
+ * "local" messages (loopback publishes) are never taken as broker copies
+ * and skip the fallback handler.
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+message_deliver(struct mqtt_client *cli, struct mqtt_message *message, struct mqtt_route_node **routes,
+                uint8_t matches, uint8_t flags, bool local)
+{
+  struct mqtt_route_node *once = NULL;
+  uint8_t i;
+
+  #if MQTT_DEDUP_SLOTS
+  if(!local && matches > 0 && dedup_check(cli, message))
+  {
+    for(i = 0; i < matches; i++)
+      ++routes[i]->stats.duplicates;
+    return;
+  }
+  if(!local && matches > 1)
+    dedup_expect(cli, message, matches - 1);
+  #endif
+
+  if(flags & MQTT_ROUTE_ONCE)
+  {
+    for(i = 0; i < matches; i++)
+      if((routes[i]->flags & MQTT_ROUTE_ONCE) && (once == NULL || routes[i]->specificity > once->specificity))
+        once = routes[i];
+  }
+
+  for(i = 0; i < matches; i++)
+  {
+    if((routes[i]->flags & MQTT_ROUTE_ONCE) && routes[i] != once)
+    {
+      ++routes[i]->stats.skipped;
+      continue;
     }
+    ++routes[i]->stats.handled;
+    message->captures_cnt = mqtt_router_captures(routes[i], (const char *) message->topic, message->topic_len,
+                                                 message->captures, MQTT_MAX_CAPTURES);
+    routes[i]->cb(&cli->mqtt_conn, message);
   }
 
   // If nothing matches call global callback
-  if (matches == 0 && *cli->user_message_cb)
-    cli->user_message_cb(mqtt_conn, message);
+  message->captures_cnt = 0;
+  if (matches == 0 && !local && *cli->user_message_cb)
+    cli->user_message_cb(&cli->mqtt_conn, message);
+}
+
+#if MQTT_DISPATCH_QUEUE
+//
+// DEFERRED DISPATCH
+//
+
+static os_event_t dispatch_events[MQTT_DISPATCH_CLIENTS];
+
+/******************************************************************************
+ * Handle oldest message queued on lane
+ *
+ * Returns FALSE if lane is empty
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+dispatch_next(struct mqtt_client *cli, enum mqtt_dispatch_lane lane)
+{
+  struct mqtt_dispatch_queue *queue = &cli->dispatch[lane];
+  struct mqtt_route_node *routes[MQTT_ROUTER_MAX_MATCHES];
+  struct mqtt_message *message;
+  uint8_t matches, flags;
+  uint32_t dwell;
+  bool local;
+
+  if(queue->stats.depth == 0)
+    return FALSE;
+
+  message = queue->messages[queue->first];
+  local = queue->local[queue->first];
+  dwell = system_get_time() - queue->queued_at[queue->first];
+  queue->first = (queue->first + 1) % MQTT_DISPATCH_QUEUE;
+  --queue->stats.depth;
+
+  ++queue->stats.dispatched;
+  queue->stats.dwell_total += dwell;
+  if(dwell > queue->stats.dwell_max)
+    queue->stats.dwell_max = dwell;
+
+  // Matched again, subscriptions may have changed while queued
+  matches = mqtt_router_match(&cli->router, (const char *) message->topic, message->topic_len, routes,
+                              MQTT_ROUTER_MAX_MATCHES, &flags);
+  message_deliver(cli, message, routes, matches, flags, local);
+  mqtt_message_free(message);
+  return TRUE;
+}
+
+/******************************************************************************
+ * Schedule dispatch task run for client
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+dispatch_post(struct mqtt_client *cli)
+{
+  if(!cli->dispatch_posted)
+    cli->dispatch_posted = system_os_post(MQTT_DISPATCH_PRIO, 0, (os_param_t) cli);
+}
+
+/******************************************************************************
+ * Dispatch task
+ *
+ * Handles up to MQTT_DISPATCH_BUDGET messages (control lane first) and
+ * yields, next run is posted while messages remain.
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+dispatch_task(os_event_t *event)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) event->par;
+  uint8_t budget = MQTT_DISPATCH_BUDGET;
+  uint8_t lane;
+
+  cli->dispatch_posted = FALSE;
+  for(lane = 0; lane < MQTT_LANES; lane++)
+    while(budget > 0 && dispatch_next(cli, lane))
+      --budget;
+
+  for(lane = 0; lane < MQTT_LANES; lane++)
+    if(cli->dispatch[lane].stats.depth > 0)
+      dispatch_post(cli);
+}
+
+/******************************************************************************
+ * Queue message copy for dispatch task
+ *
+ * Lane is picked from the "flags" of the matching routes. On a full lane
+ * the oldest queued message is handled right away to make room (order is
+ * kept).
+ * Returns FALSE if message must be handled inline.
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+dispatch_enqueue(struct mqtt_client *cli, struct mqtt_message *message, uint8_t flags, bool local)
+{
+  const enum mqtt_dispatch_lane lane = (flags & MQTT_ROUTE_CONTROL) ? MQTT_LANE_CONTROL : MQTT_LANE_BULK;
+  struct mqtt_dispatch_queue *queue = &cli->dispatch[lane];
+  struct mqtt_message *copy;
+  uint8_t slot;
+
+  // Copied first: handled inline on failure, with the caller routes
+  // untouched by handlers
+  copy = mqtt_message_copy(message);
+  if(copy == NULL)
+    return FALSE;
+
+  if(queue->stats.depth == MQTT_DISPATCH_QUEUE)
+  {
+    ++queue->stats.overflows;
+    dispatch_next(cli, lane);
+  }
+
+  slot = (queue->first + queue->stats.depth) % MQTT_DISPATCH_QUEUE;
+  queue->messages[slot] = copy;
+  queue->queued_at[slot] = system_get_time();
+  queue->local[slot] = local;
+  if(++queue->stats.depth > queue->stats.depth_max)
+    queue->stats.depth_max = queue->stats.depth;
+
+  dispatch_post(cli);
+  return TRUE;
+}
+#endif
+
+/******************************************************************************
+ * Callback called to handle MQTT messages
+ *
+ * With MQTT_DISPATCH_QUEUE handlers run later from the dispatch task (on a
+ * message copy, MQTT 5.0 properties not kept).
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+mqtt_message_handler(struct mqtt_connection *mqtt_conn, struct mqtt_message *message)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) mqtt_conn->reverse;
+  struct mqtt_route_node *routes[MQTT_ROUTER_MAX_MATCHES];
+  uint8_t matches, flags;
+
+  // Routes of all matching subscriptions
+  matches = mqtt_router_match(&cli->router, (const char *) message->topic, message->topic_len, routes,
+                              MQTT_ROUTER_MAX_MATCHES, &flags);
+
+  #if MQTT_DISPATCH_QUEUE
+  if(dispatch_enqueue(cli, message, flags, FALSE))
+    return;
+  #endif
+  message_deliver(cli, message, routes, matches, flags, FALSE);
+}
+
+/******************************************************************************
+ * Delivers publish to own subscription handlers (loopback)
+ *
+ * Nothing is done if no subscription matches. Handlers get a message copy
+ * (NULL terminated topic and payload), right away or from the dispatch
+ * task. With "echo" set the broker copies of the publish are expected and
+ * suppressed.
+ *
+ *******************************************************************************/
+static enum mqtt_status ICACHE_FLASH_ATTR
+publish_local(struct mqtt_client *cli, const uint8_t *topic, uint16_t topic_len,
+              const struct mqtt_fragment *frags, uint8_t frags_cnt, bool echo)
+{
+  struct mqtt_route_node *routes[MQTT_ROUTER_MAX_MATCHES];
+  struct mqtt_message *message;
+  uint32_t data_len = 0;
+  uint8_t matches, flags, i;
+  uint8_t *data;
+
+  matches = mqtt_router_match(&cli->router, (const char *) topic, topic_len, routes, MQTT_ROUTER_MAX_MATCHES, &flags);
+  if(matches == 0)
+    return MQTT_OK;
+
+  for(i = 0; i < frags_cnt; i++)
+    data_len += frags[i].len;
+  if(data_len > 0xFFFF)
+    return MQTT_ERROR;
+
+  // Layout: struct | topic | '\0' | data | '\0' (as "mqtt_message_copy")
+  message = (struct mqtt_message *) pool_zalloc(sizeof(struct mqtt_message) + topic_len + data_len + 2);
+  if(message == NULL)
+    return MQTT_NO_MEMORY;
+  message->topic = (uint8_t *) (message + 1);
+  message->topic_len = topic_len;
+  os_memcpy(message->topic, topic, topic_len);
+  message->data = message->topic + topic_len + 1;
+  message->data_len = data_len;
+  for(data = message->data, i = 0; i < frags_cnt; data += frags[i].len, i++)
+    os_memcpy(data, frags[i].data, frags[i].len);
+
+  #if MQTT_DEDUP_SLOTS
+  if(echo)
+    dedup_expect(cli, message, matches);
+  #else
+  (void) echo;
+  #endif
+
+  #if MQTT_DISPATCH_QUEUE
+  if(dispatch_enqueue(cli, message, flags, TRUE))
+  {
+    mqtt_message_free(message);
+    return MQTT_OK;
+  }
+  #endif
+  message_deliver(cli, message, routes, matches, flags, TRUE);
+  mqtt_message_free(message);
+  return MQTT_OK;
 }
 
 /******************************************************************************
@@ -205,7 +725,26 @@ socket_connected_cb(void *arg)
 {
   struct espconn *conn = (struct espconn *) arg;
   struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
-  mqtt_connect(&cli->mqtt_conn);
+  cli->host_reached = TRUE;
+
+  // SUBACKs from previous connection never come
+  cli->registry_pending = 0;
+  os_memset(cli->pending_subacks, 0, sizeof(cli->pending_subacks));
+
+  if(mqtt_connect(&cli->mqtt_conn) != MQTT_OK || !cli->mqtt_conn.pipelined)
+    return;
+
+  // Pipelined: registered subscriptions (unless broker should keep our
+  // session) and app messages follow CONNECT on the first flight (rolled
+  // back if CONNACK fails)
+  cli->online = TRUE;
+  if(!cli->session)
+  {
+    cli->registry_granted = 0;
+    registry_send(cli);
+  }
+  if (*cli->user_pipeline_cb)
+    cli->user_pipeline_cb(&cli->mqtt_conn);
 }
 
 /******************************************************************************
@@ -216,7 +755,7 @@ static void ICACHE_FLASH_ATTR
 socket_recv_cb(void *arg, char *pdata, unsigned short len)
 {
   #if MQTT_DEBUG_PACKET
-  print_packet(pdata, (int) len);
+  print_packet((uint8_t *) pdata, (int) len);
   #endif
 
   struct espconn *conn = (struct espconn *) arg;
@@ -224,6 +763,20 @@ socket_recv_cb(void *arg, char *pdata, unsigned short len)
   mqtt_parse_packet(&cli->mqtt_conn, (uint8_t *) pdata, (int) len);
 }
 
+/******************************************************************************
+ * Callback called when socket sent packets
+ *
+ * Drains the transmit queue (one send in flight at time)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+socket_sent_cb(void *arg)
+{
+  struct espconn *conn = (struct espconn *) arg;
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  mqtt_sent(&cli->mqtt_conn);
+}
+
 /******************************************************************************
  * Callback called when socket disconnects
  *
@@ -236,6 +789,9 @@ socket_disconnected_cb(void *arg)
   #endif
   struct espconn *conn = (struct espconn *) arg;
   struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  cli->online = FALSE;
+  os_timer_disarm(&cli->ping_timer);
+  mqtt_disconnected(&cli->mqtt_conn);
   // Call user callback
   if (*cli->user_disconnet_cb)
     cli->user_disconnet_cb(&cli->mqtt_conn);
@@ -253,42 +809,99 @@ socket_error_cb(void *arg, int8_t err)
   #if MQTT_DEBUG
     LOGGER("MQTT: Connection error %d\n", err);
   #endif
+  struct espconn *conn = (struct espconn *) arg;
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  cli->online = FALSE;
+  os_timer_disarm(&cli->ping_timer);
+  mqtt_disconnected(&cli->mqtt_conn);
+  // Host never reached, address may be outdated
+  if(!cli->host_reached)
+    cli->host_cached = FALSE;
+}
+
+/******************************************************************************
+ * Timer callback dropping cached broker address (MQTT_DNS_TTL elapsed)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+host_timer_cb(void *arg)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) arg;
+  cli->host_cached = FALSE;
+}
+
+/******************************************************************************
+ * Keeps resolved broker address for MQTT_DNS_TTL seconds
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+host_cache(struct mqtt_client *cli)
+{
+  cli->host_cached = TRUE;
+  #if MQTT_DNS_TTL
+  os_timer_disarm(&cli->host_timer);
+  os_timer_setfn(&cli->host_timer, host_timer_cb, cli);
+  os_timer_arm(&cli->host_timer, MQTT_DNS_TTL * 1000UL, 0);
+  #endif
 }
 
 /******************************************************************************
  * Callback called after MQTT broker host resolution
  *
+ * Socket objects are allocated on first connection and reused on the next
+ * ones (callbacks and TLS buffer size set once).
+ *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
 find_host_cb(const char *name, ip_addr_t *ip, void *arg)
 {
   struct mqtt_client *cli = (struct mqtt_client *) arg;
+  (void) name;
   if (ip == NULL) {
     #if MQTT_DEBUG
     LOGGER("MQTT: DNS resolve failed!\n");
     #endif
-    mqtt_client_connect(cli);
-    return;
+    // Last known address better than none
+    if(cli->host_ip.addr == 0)
+    {
+      mqtt_client_connect(cli);
+      return;
+    }
+    ip = &cli->host_ip;
+  }
+  else if(ip != &cli->host_ip)
+  {
+    cli->host_ip.addr = ip->addr;
+    host_cache(cli);
   }
 
   // Register internal callbacks
   cli->mqtt_conn.connect_cb = mqtt_connected_handler;
   cli->mqtt_conn.subscribe_cb = mqtt_subscribe_handler;
   cli->mqtt_conn.send_cb = mqtt_send_handler;
+  cli->mqtt_conn.tx_ready_cb = mqtt_tx_ready_handler;
   cli->mqtt_conn.message_cb = mqtt_message_handler;
+  #if MQTT_V5
+  cli->mqtt_conn.reason_cb = mqtt_reason_handler;
+  #endif
 
   // TCP socket setup
-  cli->tcp_conn = NULL;
-  cli->tcp_conn = (struct espconn *) os_zalloc(sizeof(struct espconn));
-  cli->tcp_conn->type = ESPCONN_TCP;
+  if(cli->tcp_conn == NULL)
+  {
+    cli->tcp_conn = (struct espconn *) os_zalloc(sizeof(struct espconn));
+    cli->tcp_conn->type = ESPCONN_TCP;
+    cli->tcp_conn->proto.tcp = (esp_tcp *) os_zalloc(sizeof(esp_tcp));
+    espconn_regist_connectcb(cli->tcp_conn, socket_connected_cb);
+    espconn_regist_recvcb(cli->tcp_conn, socket_recv_cb);
+    espconn_regist_sentcb(cli->tcp_conn, socket_sent_cb);
+    espconn_regist_disconcb(cli->tcp_conn, socket_disconnected_cb);
+    espconn_regist_reconcb(cli->tcp_conn, socket_error_cb);
+    if(cli->secure)
+      espconn_secure_set_size(ESPCONN_CLIENT, MQTT_SSL_SIZE);
+  }
   cli->tcp_conn->state = ESPCONN_NONE;
-  cli->tcp_conn->proto.tcp = (esp_tcp *) os_zalloc(sizeof(esp_tcp));
   cli->tcp_conn->proto.tcp->local_port = espconn_port();
   cli->tcp_conn->proto.tcp->remote_port = cli->host_port;
-  espconn_regist_connectcb(cli->tcp_conn, socket_connected_cb);
-  espconn_regist_recvcb(cli->tcp_conn, socket_recv_cb);
-  espconn_regist_disconcb(cli->tcp_conn, socket_disconnected_cb);
-  espconn_regist_reconcb(cli->tcp_conn, socket_error_cb);
 
   // Reversables
   cli->mqtt_conn.reverse = cli;
@@ -298,12 +911,10 @@ find_host_cb(const char *name, ip_addr_t *ip, void *arg)
   #if MQTT_DEBUG
   LOGGER("MQTT: Connecting to "IPSTR"...\n", IP2STR(ip));
   #endif
+  cli->host_reached = FALSE;
   os_memcpy(cli->tcp_conn->proto.tcp->remote_ip, &ip->addr, 4);
   if(cli->secure)
-  {
-    espconn_secure_set_size(ESPCONN_CLIENT, MQTT_SSL_SIZE);
     espconn_secure_connect(cli->tcp_conn);
-  }
   else
     espconn_connect(cli->tcp_conn);
 }
@@ -311,45 +922,351 @@ find_host_cb(const char *name, ip_addr_t *ip, void *arg)
 /******************************************************************************
  * Connect client to MQTT broker
  *
+ * Broker address resolved on a previous connection is reused for
+ * MQTT_DNS_TTL seconds (dropped when the host can't be reached).
+ * Subscriptions of the static route table ("router.table") are registered
+ * along with "subs" (packed on as few SUBSCRIBE packets as possible).
+ *
  *******************************************************************************/
 void ICACHE_FLASH_ATTR
 mqtt_client_connect(struct mqtt_client *cli)
 {
+  uint8_t i;
+
+  #if MQTT_DISPATCH_QUEUE
+  // Single task for all clients (event carries the client)
+  static bool dispatch_ready = FALSE;
+  if(!dispatch_ready)
+    dispatch_ready = system_os_task(dispatch_task, MQTT_DISPATCH_PRIO, dispatch_events, MQTT_DISPATCH_CLIENTS);
+  #endif
+
+  // Configured subscriptions (restored on every connection)
+  cli->mqtt_conn.reverse = cli;
+  for(i = 0; i < cli->subs_cnt; i++)
+    registry_add(cli, &cli->subs[i]);
+  if(cli->router.table != NULL)
+    for(i = 0; i < cli->router.table->subs_cnt; i++)
+      registry_add(cli, &cli->router.table->subs[i]);
+
+  #if MQTT_DNS_TTL
+  if(cli->host_cached)
+  {
+    find_host_cb(cli->host_name, &cli->host_ip, cli);
+    return;
+  }
+  #endif
+
   #if MQTT_DEBUG
   LOGGER("MQTT: Resolving host\n");
   #endif
-  espconn_gethostbyname((struct espconn *)cli, cli->host_name, &cli->host_ip, find_host_cb);
+  // Already known by resolver (or IP address), no callback
+  if(espconn_gethostbyname((struct espconn *)cli, cli->host_name, &cli->host_ip, find_host_cb) == ESPCONN_OK)
+  {
+    host_cache(cli);
+    find_host_cb(cli->host_name, &cli->host_ip, cli);
+  }
 }
 
 /******************************************************************************
  * Publish to MQTT topic
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
+enum mqtt_status ICACHE_FLASH_ATTR
 mqtt_client_publish(struct mqtt_connection *conn, char *topic, uint8_t *message, enum mqtt_qos qos, bool retain)
 {
-  mqtt_publish(conn, topic, message, qos, retain);
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  struct mqtt_fragment frag = { message, os_strlen(message) };
+
+  if(cli->delivery == MQTT_DELIVER_REMOTE)
+    return mqtt_publish(conn, topic, message, qos, retain);
+  return mqtt_client_publish_to(conn, topic, &frag, 1, qos, retain, cli->delivery, NULL);
+}
+
+/******************************************************************************
+ * Publish binary payload to MQTT topic
+ *
+ * Payload is made of fragments (e.g. header, struct, trailer) with explicit
+ * lengths, a single fragment publishes a buffer of known length.
+ * For QoS 1 "cb" (optional) is called once the broker acknowledges it.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_client_publishv(struct mqtt_connection *conn, char *topic, const struct mqtt_fragment *frags,
+                     uint8_t frags_cnt, enum mqtt_qos qos, bool retain,
+                     void (*cb)(struct mqtt_connection *, uint16_t))
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  return mqtt_client_publish_to(conn, topic, frags, frags_cnt, qos, retain, cli->delivery, cb);
+}
+
+/******************************************************************************
+ * Publish binary payload choosing delivery
+ *
+ * MQTT_DELIVER_LOCAL calls own subscription handlers only (no packet sent,
+ * QoS and retain ignored), MQTT_DELIVER_BOTH calls them once the broker
+ * publish is queued.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_client_publish_to(struct mqtt_connection *conn, char *topic, const struct mqtt_fragment *frags,
+                       uint8_t frags_cnt, enum mqtt_qos qos, bool retain, enum mqtt_delivery delivery,
+                       void (*cb)(struct mqtt_connection *, uint16_t))
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  enum mqtt_status status;
+
+  if(delivery != MQTT_DELIVER_LOCAL && (status = mqtt_publishv(conn, topic, frags, frags_cnt, qos, retain, cb)) != MQTT_OK)
+    return status;
+  if(delivery == MQTT_DELIVER_REMOTE)
+    return MQTT_OK;
+  return publish_local(cli, (const uint8_t *) topic, os_strlen(topic), frags, frags_cnt, delivery == MQTT_DELIVER_BOTH);
+}
+
+/******************************************************************************
+ * Publish binary payload to registered MQTT topic
+ *
+ * Topic handle comes from "mqtt_topic_register" (pre-encoded topic, QoS and
+ * retain flags), nothing is scanned nor encoded on each publish.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_client_publish_topic(struct mqtt_connection *conn, const struct mqtt_topic *topic,
+                          const struct mqtt_fragment *frags, uint8_t frags_cnt,
+                          void (*cb)(struct mqtt_connection *, uint16_t))
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  enum mqtt_status status;
+
+  if(cli->delivery != MQTT_DELIVER_LOCAL && (status = mqtt_publish_topic(conn, topic, frags, frags_cnt, cb)) != MQTT_OK)
+    return status;
+  if(cli->delivery == MQTT_DELIVER_REMOTE)
+    return MQTT_OK;
+  return publish_local(cli, topic->data + 2, topic->len - 2, frags, frags_cnt, cli->delivery == MQTT_DELIVER_BOTH);
+}
+
+/******************************************************************************
+ * Publish streamed payload to MQTT topic
+ *
+ * Total length is declared up front, then "cb" is called every time the
+ * transmit queue can take more data and must supply chunks with
+ * "mqtt_client_publish_chunk" (RAM usage bounded by the transmit queue).
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_client_publish_stream(struct mqtt_connection *conn, char *topic, uint32_t message_len, enum mqtt_qos qos,
+                           bool retain, void (*cb)(struct mqtt_connection *, uint32_t))
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  cli->stream_cb = cb;
+  return mqtt_publish_begin(conn, topic, message_len, qos, retain);
+}
+
+/******************************************************************************
+ * Supply streamed payload chunk
+ *
+ * Returns the amount of bytes accepted (0 when transmit queue is full)
+ *
+ *******************************************************************************/
+uint16_t ICACHE_FLASH_ATTR
+mqtt_client_publish_chunk(struct mqtt_connection *conn, const uint8_t *data, uint16_t data_len)
+{
+  return mqtt_publish_chunk(conn, data, data_len);
 }
 
 /******************************************************************************
  * Subscribe to MQTT topic
  *
+ * Subscription is registered (restored on reconnections) and sent right
+ * away when connected. "topic" must stay valid while subscribed.
+ *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
+enum mqtt_status ICACHE_FLASH_ATTR
 mqtt_client_subscribe(struct mqtt_connection *conn, char *topic, enum mqtt_qos qos,
                           void (*cb)(struct mqtt_connection *, struct mqtt_message *))
 {
-  add_subscription_callback(topic, cb);
-  mqtt_subscribe(conn, topic, qos);
+  struct mqtt_subscription sub = { .topic = topic, .qos = qos, .cb = cb };
+  return mqtt_client_subscribev(conn, &sub, 1);
+}
+
+/******************************************************************************
+ * Subscribe to many MQTT topics
+ *
+ * Subscriptions are registered (restored on reconnections) and, when
+ * connected, packed on as few SUBSCRIBE packets as possible, all sent back
+ * to back (one round-trip). Topics must stay valid while subscribed, "subs"
+ * itself is copied.
+ * All or nothing: MQTT_ERROR (nothing registered) if the registry can't
+ * take every new filter or one of them is invalid.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_client_subscribev(struct mqtt_connection *conn, const struct mqtt_subscription *subs, uint8_t subs_cnt)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  const struct mqtt_subscription *sub;
+  uint32_t added = 0;
+  uint16_t i;
+  int8_t n;
+
+  if(registry_needed(cli, subs, subs_cnt) > registry_available(cli))
+    return MQTT_ERROR;
+
+  // New filters first (rolled back if one can't be registered), then the
+  // ones replacing registered filters
+  for(i = 0; i < subs_cnt * 2; i++)
+  {
+    sub = &subs[i % subs_cnt];
+    n = registry_find(cli, sub->topic);
+    if(i < subs_cnt && n >= 0)
+      continue;
+    if(registry_add(cli, sub))
+    {
+      if(n < 0)
+        added |= 1UL << registry_find(cli, sub->topic);
+      continue;
+    }
+
+    for(n = 0; n < MQTT_MAX_SUBSCRIPTIONS; n++)
+      if(added & (1UL << n))
+        registry_remove(cli, cli->registry[n].topic);
+    return MQTT_ERROR;
+  }
+
+  // Restored once connected
+  if(!cli->online)
+    return MQTT_OK;
+  return registry_send(cli);
 }
 
 /******************************************************************************
  * Unsubscribe to MQTT topic
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
+enum mqtt_status ICACHE_FLASH_ATTR
 mqtt_client_unsubscribe(struct mqtt_connection *conn, char *topic)
 {
-  remove_subscription_callback(topic);
-  mqtt_unsubscribe(conn, topic);
+  return mqtt_client_unsubscribev(conn, &topic, 1);
+}
+
+/******************************************************************************
+ * Unsubscribe to many MQTT topics
+ *
+ * Topic filters are packed on as few UNSUBSCRIBE packets as possible.
+ * Handlers are removed once their UNSUBSCRIBE is queued, on error the ones
+ * not queued are kept (still subscribed on broker).
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_client_unsubscribev(struct mqtt_connection *conn, char **topics, uint8_t topics_cnt)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  enum mqtt_status status;
+  uint8_t i, n, packed;
+
+  // Broker session dropped them already
+  if(!cli->online)
+  {
+    for(i = 0; i < topics_cnt; i++)
+      registry_remove(cli, topics[i]);
+    return MQTT_OK;
+  }
+
+  for(i = 0; i < topics_cnt; i += packed)
+  {
+    status = mqtt_unsubscribev(conn, topics + i, topics_cnt - i, &packed);
+    if(status != MQTT_OK)
+      return status;
+    for(n = i; n < i + packed; n++)
+      registry_remove(cli, topics[n]);
+  }
+  return MQTT_OK;
+}
+
+/******************************************************************************
+ * Inbound topic id
+ *
+ * Messages received on topic carry it as "topic_id" (handlers can switch
+ * on it instead of comparing topics), 0 if topics are not interned.
+ *
+ *******************************************************************************/
+uint16_t ICACHE_FLASH_ATTR
+mqtt_client_topic_id(struct mqtt_connection *conn, char *topic)
+{
+  return mqtt_topic_id(conn, topic);
+}
+
+/******************************************************************************
+ * Topic interning counters
+ *
+ * Many evictions on steady traffic mean MQTT_TOPIC_INTERN is too small for
+ * the topics in use (each one is allocated again).
+ *
+ *******************************************************************************/
+const struct mqtt_intern_stats * ICACHE_FLASH_ATTR
+mqtt_client_intern_stats(struct mqtt_connection *conn)
+{
+  return &conn->intern_stats;
+}
+
+/******************************************************************************
+ * Message routing counters
+ *
+ * Cache hits vs misses (trie matches), a low hit rate on steady traffic
+ * means MQTT_ROUTER_CACHE_SIZE is too small for the topics in use.
+ *
+ *******************************************************************************/
+const struct mqtt_router_stats * ICACHE_FLASH_ATTR
+mqtt_client_router_stats(struct mqtt_connection *conn)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  return &cli->router.stats;
+}
+
+/******************************************************************************
+ * Subscription routing counters (NULL if topic has no handler)
+ *
+ * Overlapping subscriptions, messages handled, skipped in favour of a more
+ * specific "once" subscription and broker copies suppressed.
+ *
+ *******************************************************************************/
+const struct mqtt_route_stats * ICACHE_FLASH_ATTR
+mqtt_client_route_stats(struct mqtt_connection *conn, char *topic)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  const struct mqtt_route_node *route = mqtt_router_find(&cli->router, topic);
+  return (route != NULL) ? &route->stats : NULL;
+}
+
+/******************************************************************************
+ * Duplicate suppression counters
+ *
+ * Broker copies of messages matching overlapping subscriptions (wasted
+ * downlink bytes).
+ *
+ *******************************************************************************/
+const struct mqtt_dedup_stats * ICACHE_FLASH_ATTR
+mqtt_client_dedup_stats(struct mqtt_connection *conn)
+{
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  return &cli->dedup_stats;
+}
+
+/******************************************************************************
+ * Deferred dispatch counters of lane
+ *
+ * Queue depth (current and max) and time spent queued by messages
+ * (MQTT_DISPATCH_QUEUE), NULL when handlers run inline.
+ *
+ *******************************************************************************/
+const struct mqtt_dispatch_stats * ICACHE_FLASH_ATTR
+mqtt_client_dispatch_stats(struct mqtt_connection *conn, enum mqtt_dispatch_lane lane)
+{
+  #if MQTT_DISPATCH_QUEUE
+  struct mqtt_client *cli = (struct mqtt_client *) conn->reverse;
+  return &cli->dispatch[lane].stats;
+  #else
+  (void) conn;
+  (void) lane;
+  return NULL;
+  #endif
 }
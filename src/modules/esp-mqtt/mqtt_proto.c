@@ -2,11 +2,10 @@
 #include <osapi.h>
 #include <mem.h>
 
+#include "modules/utils/pool.h"
+#include "modules/utils/hashtable.h"
 #include "modules/esp-mqtt/mqtt_proto.h"
 
-// IO buffers
-static struct mqtt_buffer w_buffer = {};
-
 #define mqtt_header(type, flag_3, flag_2, flag_1, flag_0) \
   (((type) << 4) | ((flag_3) << 3) | ((flag_2) << 2) | ((flag_1) << 1) | (flag_0))
 
@@ -26,59 +25,32 @@ reset_buffer(struct mqtt_buffer *buffer)
   if (buffer->data == NULL)
     buffer->data = (uint8_t*) os_malloc(MQTT_BUFFER_SIZE);
   buffer->offset = 0;
+  buffer->size = MQTT_BUFFER_SIZE;
+  buffer->overflow = FALSE;
 }
 
 /******************************************************************************
  * Write into MQTT buffer
  *
+ * Writes past buffer size are refused and flag the buffer as overflow
+ *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
 write_buffer(struct mqtt_buffer *buffer, uint8_t *data, int data_len)
 {
+  if(buffer->overflow || buffer->offset + data_len > buffer->size)
+  {
+    buffer->overflow = TRUE;
+    return;
+  }
   os_memcpy(buffer->data + buffer->offset, data, data_len);
   buffer->offset += data_len;
 }
 
-/******************************************************************************
- * Send MQTT buffer
- *
- *******************************************************************************/
-static void ICACHE_FLASH_ATTR
-send_buffer(struct mqtt_buffer *buffer, struct mqtt_connection *conn)
-{
-  conn->send_cb(conn, buffer->data, buffer->offset);
-}
-
 //
 // MQTT STANDARD FORMATS
 //
 
-/******************************************************************************
- * Decodes MQTT Multi-Byte Integer
- *
- *******************************************************************************/
-static int ICACHE_FLASH_ATTR
-decode_mbi(uint8_t *data, uint8_t *offset)
-{
-  uint8_t numBytes = 0;
-  int multiplier = 1;
-  int number = 0;
-  int digit;
-
-  do
-  {
-    digit = data[numBytes++];
-    number += ((digit & 0x7f) * multiplier);
-    multiplier *= 128;
-  }
-  while ((digit & 0x80) != 0);
-
-  // Update data offset
-  *offset = numBytes;
-
-  return number;
-}
-
 /******************************************************************************
  * Encodes MQTT Multi-Byte Integer
  *
@@ -124,16 +96,6 @@ encode_uint16(uint16_t number, uint8_t *buff, uint16_t offset)
     return offset;
 }
 
-/******************************************************************************
- * Encodes MQTT Packet ID
- *
- *******************************************************************************/
-static void ICACHE_FLASH_ATTR
-encode_packet_id(struct mqtt_connection *conn, uint8_t *data)
-{
-  encode_uint16(conn->packet_id++, data, 0);
-}
-
 /******************************************************************************
  * Encodes MQTT String
  *
@@ -150,326 +112,2075 @@ encode_str(struct mqtt_buffer *buffer, uint8_t *str, int str_len)
   write_buffer(buffer, str, str_len);
 }
 
-//
-// MQTT PACKETS DECODERS
-//
-
+#if MQTT_V5
 /******************************************************************************
- * Decodes MQTT PUBLISH
+ * Decodes MQTT Variable Byte Integer
+ *
+ * Returns bytes used (0 when malformed or truncated)
  *
  *******************************************************************************/
-static uint16_t ICACHE_FLASH_ATTR
-mqtt_publish_decode(struct mqtt_buffer *buffer, struct mqtt_message *message, enum mqtt_qos qos)
+static uint8_t ICACHE_FLASH_ATTR
+decode_varint(uint8_t *data, uint32_t data_len, uint32_t *value)
 {
-  uint16_t packet_id = 0;
-  uint16_t buffer_len = buffer->offset;
-
-  // Topic length
-  buffer->offset = 0;
-  uint16_t topic_len = decode_uint16(buffer->data, 0);
-  buffer->offset += 2;
-
-  // Message Topic
-  message->topic = (uint8_t*)os_zalloc(sizeof(uint8_t) * topic_len + 1);
-  os_memcpy(message->topic, (buffer->data + buffer->offset), topic_len);
-  buffer->offset += topic_len;
+  uint8_t i;
 
-  // Check packet id
-  if(qos != MQTT_QOS_0)
+  *value = 0;
+  for(i = 0; i < 4 && i < data_len; ++i)
   {
-    packet_id = decode_uint16(buffer->data, buffer->offset);
-    buffer->offset += 2;
+    *value |= (uint32_t) (data[i] & 0x7F) << (7 * i);
+    if((data[i] & 0x80) == 0)
+      return i + 1;
   }
-
-  // Message payload
-  message->data_len = (buffer_len - buffer->offset);
-  message->data = (uint8_t*)os_zalloc(sizeof(uint8_t) * message->data_len + 1);
-  os_memcpy(message->data, (buffer->data + buffer->offset), message->data_len);
-
-  return packet_id;
+  return 0;
 }
+#endif
 
 //
-// MQTT PACKETS ENCODERS
+// MQTT TRANSMIT QUEUE
 //
 
 /******************************************************************************
- * Encodes MQTT PUBACK
+ * Hand queued packets to transport (if transport is idle)
+ *
+ * With MQTT_TX_COALESCE consecutive packets (contiguous on the ring) go on a
+ * single transport write, the write waits until MQTT_TX_COALESCE_BYTES or
+ * MQTT_TX_COALESCE_PACKETS are queued or MQTT_TX_COALESCE_DELAY elapses,
+ * unless "flush" is set. Writes rejected by transport are retried from a
+ * timer.
  *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
-mqtt_puback(struct mqtt_connection *conn, uint16_t packet_id)
+tx_transmit(struct mqtt_connection *conn, bool flush)
 {
-  reset_buffer(&w_buffer);
+  struct mqtt_tx_queue *tx = &conn->tx;
+  if(tx->stopped || tx->inflight > 0 || tx->count == 0)
+    return;
 
-  // Packet headers
-  uint8_t fixed_hd;
-  uint8_t remlen_len, remlen[4];
-  uint8_t variable_hd[2];
+  struct mqtt_tx_slot *slot = &tx->slots[tx->first];
+  uint16_t len = slot->len;
+  uint8_t packets = 1;
 
-  // Fixed header
-  fixed_hd = mqtt_header(MQTT_PUBACK, 0, 0, 0, 0);
-  remlen_len = encode_mbi(sizeof(variable_hd), remlen);
-  // Variable header
-  encode_uint16(packet_id, variable_hd, 0);
+  #if MQTT_TX_COALESCE
+  // Wait for more packets (deadline)
+  if(!flush && tx->queued < MQTT_TX_COALESCE_BYTES && tx->count < MQTT_TX_COALESCE_PACKETS)
+  {
+    if(!tx->timer_armed)
+    {
+      tx->timer_armed = TRUE;
+      os_timer_arm(&tx->timer, MQTT_TX_COALESCE_DELAY, 0);
+    }
+    return;
+  }
+  #else
+  (void) flush;
+  #endif
+  os_timer_disarm(&tx->timer);
+  tx->timer_armed = FALSE;
+
+  #if MQTT_TX_COALESCE
+  // Join packets while contiguous
+  while(packets < tx->count)
+  {
+    struct mqtt_tx_slot *next = &tx->slots[(tx->first + packets) % MQTT_TX_SLOTS];
+    if(slot->offset + len != next->offset)
+      break;
+    len += next->len;
+    ++packets;
+  }
+  #endif
 
-  // Write fixed header
-  write_buffer(&w_buffer, &fixed_hd, 1);
-  write_buffer(&w_buffer, remlen, remlen_len);
-  // Write variable header
-  write_buffer(&w_buffer, variable_hd, sizeof(variable_hd));
+  tx->inflight = packets;
+  // Rejected by transport (e.g. out of buffers), no sent callback will
+  // follow: retried after MQTT_TX_RETRY_DELAY
+  if(!conn->send_cb(conn, tx->data + slot->offset, len))
+  {
+    tx->inflight = 0;
+    tx->timer_armed = TRUE;
+    os_timer_arm(&tx->timer, MQTT_TX_RETRY_DELAY, 0);
+    return;
+  }
 
-  // Send (no payload)
-  send_buffer(&w_buffer, conn);
+  ++tx->stats.writes;
+  tx->stats.packets += packets;
+  tx->stats.bytes += len;
 }
 
 /******************************************************************************
- * Encodes MQTT CONNECT
+ * Timer callback for coalescing deadline and transport retry
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
-mqtt_connect(struct mqtt_connection *conn)
+static void ICACHE_FLASH_ATTR
+tx_timer_cb(void *arg)
 {
-  reset_buffer(&w_buffer);
+  struct mqtt_connection *conn = (struct mqtt_connection *) arg;
+  conn->tx.timer_armed = FALSE;
+  tx_transmit(conn, TRUE);
+}
 
-  // Packet headers
-  uint8_t fixed_hd;
-  uint8_t remlen_len, remlen[4];
+/******************************************************************************
+ * Reset transmit queue
+ *
+ * Drops every queued packet (e.g. left from a previous connection)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+tx_reset(struct mqtt_connection *conn)
+{
+  struct mqtt_tx_queue *tx = &conn->tx;
+  if(tx->data == NULL)
+  {
+    tx->data = (uint8_t*) os_malloc(MQTT_TX_BUFFER_SIZE);
+    os_timer_setfn(&tx->timer, tx_timer_cb, conn);
+  }
+  tx->first = 0;
+  tx->count = 0;
+  tx->inflight = 0;
+  tx->tail = 0;
+  tx->queued = 0;
+  tx->blocked = FALSE;
+  tx->stopped = FALSE;
+  os_timer_disarm(&tx->timer);
+  tx->timer_armed = FALSE;
+}
 
-  // Flags (user and password always set)
-  /*
-      7   |     6    |     5      |   4    3   |    2    |     1     |    0
-     user |    pwd   |   wretain  |    wqos    |  wflag  |  session  | reserved
-  */
-  uint8_t flags = 0b11000000;
-  if(conn->clean_session)
-    flags |= 0x02;
-  if(conn->last_will.topic != NULL)
+/******************************************************************************
+ * Drop queued packets not handed to transport yet
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+tx_discard(struct mqtt_connection *conn)
+{
+  struct mqtt_tx_queue *tx = &conn->tx;
+  struct mqtt_tx_slot *slot;
+  uint8_t i;
+
+  // Packets on transport stay (released by "mqtt_sent")
+  tx->count = tx->inflight;
+  tx->queued = 0;
+  tx->tail = 0;
+  for(i = 0; i < tx->inflight; ++i)
   {
-    flags |= 0x04;
-    flags |= (conn->last_will.qos << 3) | (conn->last_will.retain << 5);
+    slot = &tx->slots[(tx->first + i) % MQTT_TX_SLOTS];
+    tx->queued += slot->len;
+    tx->tail = slot->offset + slot->len;
   }
+  tx->blocked = FALSE;
+  os_timer_disarm(&tx->timer);
+  tx->timer_armed = FALSE;
+}
 
-  uint8_t variable_hd[10] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 4, flags, 0x00, 0x00};
+/******************************************************************************
+ * Reserve contiguous space on transmit queue
+ *
+ * Packets never wrap: when the space left at the end is not enough the
+ * packet starts over at the beginning of the ring (if free).
+ *
+ *******************************************************************************/
+static enum mqtt_status ICACHE_FLASH_ATTR
+tx_reserve(struct mqtt_connection *conn, struct mqtt_buffer *buffer, uint32_t size)
+{
+  struct mqtt_tx_queue *tx = &conn->tx;
+  uint16_t head, offset;
 
-  // Reset packet ids
-  conn->packet_id = 1;
+  if(tx->data == NULL)
+    tx_reset(conn);
 
-  // String lengths
-  uint8_t strs_cnt = 3;
-  const int8_t cli_len = os_strlen(conn->client_id);
-  const int8_t user_len = os_strlen(conn->username);
-  const int8_t pwd_len = os_strlen(conn->password);
-  int8_t lw_topic_len = 0;
-  int8_t lw_data_len = 0;
-  if(conn->last_will.topic != NULL)
-  {
-    lw_topic_len = os_strlen(conn->last_will.topic);
-    ++strs_cnt;
-  }
-  if(conn->last_will.data != NULL)
+  // Never fits
+  if(size > MQTT_TX_BUFFER_SIZE)
+    return MQTT_ERROR;
+
+  if(tx->count == 0)
+    offset = 0;
+  else if(tx->count == MQTT_TX_SLOTS)
+    goto blocked;
+  else
   {
-    lw_data_len = os_strlen(conn->last_will.data);
-    ++strs_cnt;
+    head = tx->slots[tx->first].offset;
+    if(tx->tail > head)
+    {
+      // Free: [tail, end) and [0, head)
+      if(size <= (uint32_t) (MQTT_TX_BUFFER_SIZE - tx->tail))
+        offset = tx->tail;
+      else if(size <= head)
+        offset = 0;
+      else
+        goto blocked;
+    }
+    else
+    {
+      // Wrapped, free: [tail, head)
+      if(size <= (uint32_t) (head - tx->tail))
+        offset = tx->tail;
+      else
+        goto blocked;
+    }
   }
 
-  // Extra bytes (2 for each string encoded using "encode_str")
-  const int8_t strs_len_bytes = strs_cnt * 2;
-
-  // Fixed header
-  fixed_hd = mqtt_header(MQTT_CONNECT, 0, 0, 0, 0);
-  remlen_len = encode_mbi(sizeof(variable_hd) + cli_len + user_len + pwd_len + lw_topic_len + lw_data_len + strs_len_bytes, remlen);
-  // Variable header
-  encode_uint16(conn->kalive, variable_hd, 8);
-
-  // Write fixed header
-  write_buffer(&w_buffer, &fixed_hd, 1);
-  write_buffer(&w_buffer, remlen, remlen_len);
-  // Write variable header
-  write_buffer(&w_buffer, variable_hd, sizeof(variable_hd));
-  // Write payload (must use this order)
-  encode_str(&w_buffer, conn->client_id, cli_len);
-  if(lw_topic_len > 0)
-    encode_str(&w_buffer, conn->last_will.topic, lw_topic_len);
-  if(lw_data_len > 0)
-    encode_str(&w_buffer, conn->last_will.data, lw_data_len);
-  encode_str(&w_buffer, conn->username, user_len);
-  encode_str(&w_buffer, conn->password, pwd_len);
+  buffer->data = tx->data + offset;
+  buffer->offset = 0;
+  buffer->size = size;
+  buffer->overflow = FALSE;
+  return MQTT_OK;
 
-  // Send packet
-  send_buffer(&w_buffer, conn);
+blocked:
+  tx->blocked = TRUE;
+  return MQTT_WOULD_BLOCK;
 }
 
 /******************************************************************************
- * Encodes MQTT DISCONNECT
+ * Commit reserved space as packet and transmit
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
-mqtt_disconnect(struct mqtt_connection *conn)
+static void ICACHE_FLASH_ATTR
+tx_commit(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
 {
-  reset_buffer(&w_buffer);
+  struct mqtt_tx_queue *tx = &conn->tx;
+  struct mqtt_tx_slot *slot = &tx->slots[(tx->first + tx->count) % MQTT_TX_SLOTS];
 
-  // Write full packet (no variable header, no payload)
-  uint8_t packet[] = { mqtt_header(MQTT_DISCONNECT, 0, 0, 0, 0), 0 };
-  write_buffer(&w_buffer, packet, sizeof(packet));
+  slot->offset = buffer->data - tx->data;
+  slot->len = buffer->offset;
+  ++tx->count;
+  tx->tail = slot->offset + slot->len;
+  tx->queued += slot->len;
 
-  // Send packet
-  send_buffer(&w_buffer, conn);
+  tx_transmit(conn, FALSE);
 }
 
 /******************************************************************************
- * Encodes MQTT SUBSCRIBE
+ * Begin MQTT packet on transmit queue
  *
- * This implementation apply one topic filter on each message
+ * Reserves the whole packet and writes the Fixed header, nothing is queued
+ * while a streamed PUBLISH is in progress (it would be mixed with the
+ * stream payload)
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
-mqtt_subscribe(struct mqtt_connection *conn, char *topic, enum mqtt_qos qos)
+static enum mqtt_status ICACHE_FLASH_ATTR
+begin_packet(struct mqtt_connection *conn, struct mqtt_buffer *buffer, uint8_t fixed_hd, uint32_t remlen)
 {
-  reset_buffer(&w_buffer);
+  uint8_t remlen_len, remlen_data[4];
+  enum mqtt_status status;
 
-  // Packet headers
-  uint8_t fixed_hd;
-  uint8_t remlen_len, remlen[4];
-  uint8_t variable_hd[2];
+  if(conn->stream.remaining > 0)
+  {
+    conn->tx.blocked = TRUE;
+    return MQTT_WOULD_BLOCK;
+  }
 
-  // Lengths
-  const int8_t topic_len = os_strlen(topic);
-  const int8_t qos_len = 1;
-  // Extra bytes (2 for each string encoded using "encode_str")
-  const int8_t strs_len_bytes = 2;
+  remlen_len = encode_mbi(remlen, remlen_data);
 
-  // Fixed header
-  fixed_hd = mqtt_header(MQTT_SUBSCRIBE, 0, 0, 1, 0);
-  remlen_len = encode_mbi(sizeof(variable_hd) + topic_len + qos_len + strs_len_bytes, remlen);
-  // Variable header
-  encode_packet_id(conn, variable_hd);
+  #if MQTT_V5
+  // Broker Maximum Packet Size
+  if(conn->v5.max_packet_size != 0 && 1 + remlen_len + remlen > conn->v5.max_packet_size)
+    return MQTT_ERROR;
+  #endif
 
-  // Write fixed header
-  write_buffer(&w_buffer, &fixed_hd, 1);
-  write_buffer(&w_buffer, remlen, remlen_len);
-  // Write variable header
-  write_buffer(&w_buffer, variable_hd, sizeof(variable_hd));
-  // Write payload
-  uint8_t qos_data = qos;
-  encode_str(&w_buffer, topic, topic_len);
-  write_buffer(&w_buffer, &qos_data, qos_len);
+  status = tx_reserve(conn, buffer, 1 + remlen_len + remlen);
+  if(status != MQTT_OK)
+    return status;
 
-  // Send packet
-  send_buffer(&w_buffer, conn);
+  // Write fixed header
+  write_buffer(buffer, &fixed_hd, 1);
+  write_buffer(buffer, remlen_data, remlen_len);
+  return MQTT_OK;
 }
 
 /******************************************************************************
- * Encodes MQTT UNSUBSCRIBE
+ * Send MQTT packet (queue reserved space)
  *
- * This implementation apply one topic filter on each message
+ *******************************************************************************/
+static enum mqtt_status ICACHE_FLASH_ATTR
+send_buffer(struct mqtt_buffer *buffer, struct mqtt_connection *conn)
+{
+  // Encoded size differs from reserved one (malformed)
+  if(buffer->overflow)
+    return MQTT_ERROR;
+  tx_commit(conn, buffer);
+  return MQTT_OK;
+}
+
+/******************************************************************************
+ * Encodes MQTT PUBACK, PUBREC, PUBREL and PUBCOMP
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
-mqtt_unsubscribe(struct mqtt_connection *conn, char *topic)
+static enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_ack(struct mqtt_connection *conn, enum mqtt_packet_type type, uint16_t packet_id)
 {
-  reset_buffer(&w_buffer);
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
 
   // Packet headers
   uint8_t fixed_hd;
-  uint8_t remlen_len, remlen[4];
   uint8_t variable_hd[2];
 
-  // Lengths
-  const int8_t topic_len = os_strlen(topic);
-  // Extra bytes (2 for each string encoded using "encode_str")
-  const int8_t strs_len_bytes = 2;
-
-  // Fixed header
-  fixed_hd = mqtt_header(MQTT_UNSUBSCRIBE, 0, 0, 1, 0);
-  remlen_len = encode_mbi(sizeof(variable_hd) + topic_len + strs_len_bytes, remlen);
+  // Fixed header (PUBREL has reserved flags 0010)
+  fixed_hd = mqtt_header(type, 0, 0, (type == MQTT_PUBREL ? 1 : 0), 0);
+  if((status = begin_packet(conn, &w_buffer, fixed_hd, sizeof(variable_hd))) != MQTT_OK)
+    return status;
   // Variable header
-  encode_packet_id(conn, variable_hd);
+  encode_uint16(packet_id, variable_hd, 0);
 
-  // Write fixed header
-  write_buffer(&w_buffer, &fixed_hd, 1);
-  write_buffer(&w_buffer, remlen, remlen_len);
   // Write variable header
   write_buffer(&w_buffer, variable_hd, sizeof(variable_hd));
-  // Write payload
-  encode_str(&w_buffer, topic, topic_len);
 
-  // Send packet
-  send_buffer(&w_buffer, conn);
+  // Send (no payload)
+  return send_buffer(&w_buffer, conn);
 }
 
 /******************************************************************************
- * Encodes MQTT PUBLISH
+ * Queues ack on transmit queue, or holds it until there is room
  *
- * This implementation doesn't support Qos 2 (exactly once) delivery
+ * Acks can't be queued while a streamed PUBLISH is in progress or the queue
+ * is full, held ones are queued from "mqtt_sent" in arrival order (newer
+ * acks wait behind them). With MQTT_MAX_PENDING_ACKS held the ack is
+ * dropped (broker resends the packet on reconnection).
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
-mqtt_publish(struct mqtt_connection *conn, char *topic, uint8_t *message, enum mqtt_qos qos, bool retain)
+static void ICACHE_FLASH_ATTR
+ack_send(struct mqtt_connection *conn, enum mqtt_packet_type type, uint16_t packet_id)
 {
-  if(qos == MQTT_QOS_2)
-    return;
-
-  reset_buffer(&w_buffer);
-
-  // Packet headers
-  uint8_t fixed_hd;
-  uint8_t remlen_len, remlen[4];
-
-  // Lengths
-  uint16_t topic_len = os_strlen(topic);
-  uint16_t message_len = os_strlen(message);
-  // Extra bytes (2 for each string encoded using "encode_str")
-  const int8_t strs_len_bytes = 2;
-
-  // Fixed header (dup always 0)
-  const uint8_t dup = 0;
-  fixed_hd = mqtt_header(MQTT_PUBLISH, dup, qos, qos, (retain ? 1 : 0));
-  remlen_len = encode_mbi(topic_len + message_len + strs_len_bytes, remlen);
+  struct mqtt_ack_queue *acks = &conn->acks;
+  uint8_t slot;
 
-  // Write fixed header
-  write_buffer(&w_buffer, &fixed_hd, 1);
-  write_buffer(&w_buffer, remlen, remlen_len);
-  // Write payload
-  encode_str(&w_buffer, topic, topic_len);
-  write_buffer(&w_buffer, message, message_len);
+  if(acks->count == 0 && mqtt_ack(conn, type, packet_id) != MQTT_WOULD_BLOCK)
+    return;
+  if(acks->count == MQTT_MAX_PENDING_ACKS)
+    return;
 
-  // Send packet
-  send_buffer(&w_buffer, conn);
+  slot = (acks->first + acks->count) % MQTT_MAX_PENDING_ACKS;
+  acks->types[slot] = type;
+  acks->ids[slot] = packet_id;
+  ++acks->count;
 }
 
 /******************************************************************************
- * Encodes MQTT PINGREQ
+ * Queues held acks (and PINGREQ) while the transmit queue takes them
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
-mqtt_ping(struct mqtt_connection *conn)
+static void ICACHE_FLASH_ATTR
+acks_flush(struct mqtt_connection *conn)
 {
-  reset_buffer(&w_buffer);
+  struct mqtt_ack_queue *acks = &conn->acks;
 
-  // Write full packet (no variable header, no payload)
-  uint8_t packet[] = { mqtt_header(MQTT_PINGREQ, 0, 0, 0, 0), 0 };
-  write_buffer(&w_buffer, packet, sizeof(packet));
+  while(acks->count > 0)
+  {
+    if(mqtt_ack(conn, acks->types[acks->first], acks->ids[acks->first]) == MQTT_WOULD_BLOCK)
+      return;
+    acks->first = (acks->first + 1) % MQTT_MAX_PENDING_ACKS;
+    --acks->count;
+  }
 
-  // Send packet
-  send_buffer(&w_buffer, conn);
+  if(acks->ping && mqtt_ping(conn) != MQTT_WOULD_BLOCK)
+    acks->ping = FALSE;
 }
 
-//
-// MQTT CALLBACK HANDLERS
-//
-
-
 /******************************************************************************
- * Handle MQTT CONNACK
+ * Notifies transport connection lost
+ *
+ * Stops transmit queue and retransmission timers, nothing is handed to
+ * transport until "mqtt_connect". In-flight messages are kept (resent
+ * once connected again).
  *
  *******************************************************************************/
-static void ICACHE_FLASH_ATTR
-handle_connack(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
+void ICACHE_FLASH_ATTR
+mqtt_disconnected(struct mqtt_connection *conn)
+{
+  struct mqtt_tx_queue *tx = &conn->tx;
+
+  tx->stopped = TRUE;
+  os_timer_disarm(&tx->timer);
+  tx->timer_armed = FALSE;
+  #if !MQTT_V5
+  os_timer_disarm(&conn->session.timer);
+  #endif
+}
+
+/******************************************************************************
+ * Flush transmit queue
+ *
+ * Hands queued packets to transport without waiting coalescing deadline
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_flush(struct mqtt_connection *conn)
+{
+  tx_transmit(conn, TRUE);
+}
+
+/******************************************************************************
+ * Notifies transport finished sending
+ *
+ * Releases sent packets, transmits next ones and tells producers when the
+ * queue drains below MQTT_TX_LOW_WATERMARK (after a "would block")
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_sent(struct mqtt_connection *conn)
+{
+  struct mqtt_tx_queue *tx = &conn->tx;
+
+  // Release sent packets
+  while(tx->inflight > 0)
+  {
+    tx->queued -= tx->slots[tx->first].len;
+    tx->first = (tx->first + 1) % MQTT_TX_SLOTS;
+    --tx->count;
+    --tx->inflight;
+  }
+  if(tx->count == 0)
+    tx->tail = 0;
+
+  // Held acks go ahead of producers
+  acks_flush(conn);
+
+  // Packets queued meanwhile already waited
+  tx_transmit(conn, TRUE);
+
+  // Wake producers up
+  if((tx->blocked && tx->queued <= MQTT_TX_LOW_WATERMARK) || conn->stream.remaining > 0)
+  {
+    tx->blocked = FALSE;
+    if(conn->tx_ready_cb != NULL)
+      conn->tx_ready_cb(conn);
+  }
+}
+
+//
+// MQTT QOS 1 & 2 SESSION
+//
+
+#define inflight_slot(packet_id) (((packet_id) - 1) % MQTT_MAX_INFLIGHT)
+
+/******************************************************************************
+ * Allocates and encodes MQTT Packet ID
+ *
+ * IDs are never 0 and never collide with in-flight ones (the in-flight slot
+ * of the ID must be free), returns 0 when all slots are busy (producer woken
+ * up by "inflight_wake")
+ *
+ *******************************************************************************/
+static uint16_t ICACHE_FLASH_ATTR
+encode_packet_id(struct mqtt_connection *conn, uint8_t *data)
+{
+  struct mqtt_session *session = &conn->session;
+  uint16_t packet_id;
+  uint8_t i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; ++i)
+  {
+    packet_id = conn->packet_id;
+    conn->packet_id = (packet_id == 0xFFFF) ? 1 : packet_id + 1;
+    if((session->used & (1UL << inflight_slot(packet_id))) == 0)
+    {
+      encode_uint16(packet_id, data, 0);
+      return packet_id;
+    }
+  }
+  conn->session.blocked = TRUE;
+  return 0;
+}
+
+/******************************************************************************
+ * Retransmits in-flight PUBLISH (DUP flag set) or PUBREL
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+inflight_retransmit(struct mqtt_connection *conn, struct mqtt_inflight *inflight)
+{
+  struct mqtt_buffer w_buffer;
+
+  // QoS 2 already received by broker (waiting PUBCOMP)
+  if(inflight->state == MQTT_INFLIGHT_PUBCOMP)
+  {
+    if(mqtt_ack(conn, MQTT_PUBREL, inflight->packet_id) != MQTT_OK)
+      return FALSE;
+    inflight->age = 0;
+    return TRUE;
+  }
+
+  // No copy to resend or would be mixed with streamed PUBLISH
+  if(inflight->packet == NULL || conn->stream.remaining > 0)
+    return FALSE;
+  if(tx_reserve(conn, &w_buffer, inflight->packet_len) != MQTT_OK)
+    return FALSE;
+
+  // DUP flag (bit 3 on Fixed header)
+  inflight->packet[0] |= 0x08;
+  inflight->age = 0;
+  write_buffer(&w_buffer, inflight->packet, inflight->packet_len);
+  tx_commit(conn, &w_buffer);
+  return TRUE;
+}
+
+#if !MQTT_V5
+/******************************************************************************
+ * Timer callback for in-flight retransmissions
+ *
+ * Messages not acknowledged after (at least) MQTT_RETRY_TIMEOUT are resent
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+inflight_timer_cb(void *arg)
+{
+  struct mqtt_connection *conn = (struct mqtt_connection *) arg;
+  struct mqtt_session *session = &conn->session;
+  uint8_t i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; ++i)
+  {
+    if((session->used & (1UL << i)) == 0)
+      continue;
+    if(++session->inflight[i].age >= 2)
+      inflight_retransmit(conn, &session->inflight[i]);
+  }
+}
+
+/******************************************************************************
+ * Starts retransmission timer (stopped while disconnected)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+inflight_timer_start(struct mqtt_connection *conn)
+{
+  struct mqtt_session *session = &conn->session;
+
+  os_timer_disarm(&session->timer);
+  os_timer_setfn(&session->timer, inflight_timer_cb, conn);
+  os_timer_arm(&session->timer, MQTT_RETRY_TIMEOUT, 1);
+}
+#endif
+
+/******************************************************************************
+ * Tracks in-flight PUBLISH (keeps a copy for retransmission)
+ *
+ * QoS 1 waits PUBACK, QoS 2 waits PUBREC then PUBCOMP
+ * Returns FALSE if out of memory (not tracked, it must not be sent)
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+inflight_add(struct mqtt_connection *conn, uint16_t packet_id, enum mqtt_qos qos, struct mqtt_buffer *buffer,
+             void (*cb)(struct mqtt_connection *, uint16_t))
+{
+  struct mqtt_session *session = &conn->session;
+  uint8_t slot = inflight_slot(packet_id);
+  struct mqtt_inflight *inflight = &session->inflight[slot];
+
+  inflight->packet = (uint8_t *) pool_alloc(buffer->offset);
+  if(inflight->packet == NULL)
+    return FALSE;
+  os_memcpy(inflight->packet, buffer->data, buffer->offset);
+  inflight->packet_len = buffer->offset;
+  inflight->packet_id = packet_id;
+  inflight->state = (qos == MQTT_QOS_1) ? MQTT_INFLIGHT_PUBACK : MQTT_INFLIGHT_PUBREC;
+  inflight->age = 0;
+  inflight->delivered_cb = cb;
+
+  // First in-flight, start retransmission timer
+  // (MQTT 5.0: resent only on reconnection, see "inflight_resume")
+  #if !MQTT_V5
+  if(session->count == 0)
+    inflight_timer_start(conn);
+  #endif
+  ++session->count;
+  session->used |= (1UL << slot);
+  return TRUE;
+}
+
+/******************************************************************************
+ * Finds in-flight PUBLISH waiting given ack (O(1) lookup by packet ID)
+ *
+ *******************************************************************************/
+static struct mqtt_inflight * ICACHE_FLASH_ATTR
+inflight_find(struct mqtt_connection *conn, uint16_t packet_id, enum mqtt_inflight_state state)
+{
+  struct mqtt_session *session = &conn->session;
+  uint8_t slot;
+
+  if(packet_id == 0)
+    return NULL;
+  slot = inflight_slot(packet_id);
+  struct mqtt_inflight *inflight = &session->inflight[slot];
+
+  if((session->used & (1UL << slot)) == 0 || inflight->packet_id != packet_id)
+    return NULL;
+  if(inflight->state != state)
+    return NULL;
+  return inflight;
+}
+
+/******************************************************************************
+ * Releases in-flight PUBLISH
+ *
+ *******************************************************************************/
+static struct mqtt_inflight * ICACHE_FLASH_ATTR
+inflight_release(struct mqtt_connection *conn, uint16_t packet_id, enum mqtt_inflight_state state)
+{
+  struct mqtt_session *session = &conn->session;
+  struct mqtt_inflight *inflight = inflight_find(conn, packet_id, state);
+
+  if(inflight == NULL)
+    return NULL;
+
+  pool_free(inflight->packet);
+  inflight->packet = NULL;
+  session->used &= ~(1UL << inflight_slot(packet_id));
+  --session->count;
+  #if !MQTT_V5
+  if(session->count == 0)
+    os_timer_disarm(&session->timer);
+  #endif
+  return inflight;
+}
+
+/******************************************************************************
+ * Wakes producers up refused a packet ID (in-flight slot released)
+ *
+ * Called once the released in-flight entry is no longer used, producers
+ * may take its slot again.
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+inflight_wake(struct mqtt_connection *conn)
+{
+  if(!conn->session.blocked)
+    return;
+  conn->session.blocked = FALSE;
+  if(conn->tx_ready_cb != NULL)
+    conn->tx_ready_cb(conn);
+}
+
+/******************************************************************************
+ * Checks/records inbound QoS 2 packet ID (received, waiting PUBREL)
+ *
+ * Returns FALSE when table is full (message can't be accepted yet)
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+inbound_add(struct mqtt_connection *conn, uint16_t packet_id, bool *duplicated)
+{
+  struct mqtt_session *session = &conn->session;
+  int8_t i, free_slot = -1;
+
+  for(i = 0; i < MQTT_MAX_INBOUND; ++i)
+  {
+    if(session->inbound[i] == packet_id)
+    {
+      *duplicated = TRUE;
+      return TRUE;
+    }
+    if(session->inbound[i] == 0 && free_slot < 0)
+      free_slot = i;
+  }
+
+  *duplicated = FALSE;
+  if(free_slot < 0)
+    return FALSE;
+  session->inbound[free_slot] = packet_id;
+  return TRUE;
+}
+
+/******************************************************************************
+ * Forgets inbound QoS 2 packet ID (PUBREL received)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+inbound_release(struct mqtt_connection *conn, uint16_t packet_id)
+{
+  struct mqtt_session *session = &conn->session;
+  uint8_t i;
+
+  for(i = 0; i < MQTT_MAX_INBOUND; ++i)
+  {
+    if(session->inbound[i] == packet_id)
+      session->inbound[i] = 0;
+  }
+}
+
+/******************************************************************************
+ * Retransmits every in-flight PUBLISH (on reconnection)
+ *
+ * Retransmission timer restarts for the ones still waiting ack (MQTT 3.1.1,
+ * MQTT 5.0 forbids resending on the same connection)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+inflight_resume(struct mqtt_connection *conn)
+{
+  struct mqtt_session *session = &conn->session;
+  uint8_t i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; ++i)
+  {
+    if((session->used & (1UL << i)) != 0)
+      inflight_retransmit(conn, &session->inflight[i]);
+  }
+  #if !MQTT_V5
+  if(session->count > 0)
+    inflight_timer_start(conn);
+  #endif
+}
+
+#if MQTT_V5
+//
+// MQTT 5.0 PROPERTIES & TOPIC ALIASES
+//
+
+/******************************************************************************
+ * Decodes MQTT 5.0 string/binary (length prefixed)
+ *
+ * Returns bytes used (0 when truncated)
+ *
+ *******************************************************************************/
+static uint32_t ICACHE_FLASH_ATTR
+decode_property_str(uint8_t *data, uint32_t data_len, uint8_t **str, uint16_t *str_len)
+{
+  if(data_len < 2)
+    return 0;
+  *str_len = decode_uint16(data, 0);
+  if(*str_len > data_len - 2)
+    return 0;
+  *str = data + 2;
+  return 2 + *str_len;
+}
+
+/******************************************************************************
+ * Decodes next MQTT 5.0 property
+ *
+ * "props" and "props_len" move past it, returns FALSE at the end of the list
+ * or when the property is malformed/unknown (then "props_len" is not 0)
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+mqtt_property_next(uint8_t **props, uint16_t *props_len, struct mqtt_property *prop)
+{
+  uint8_t *data = *props + 1;
+  uint32_t data_len = *props_len, used;
+
+  if(data_len == 0)
+    return FALSE;
+  os_memset(prop, 0, sizeof(struct mqtt_property));
+  prop->id = (*props)[0];
+  --data_len;
+
+  switch(prop->id)
+  {
+    // Byte
+    case MQTT_PROP_PAYLOAD_FORMAT:
+    case MQTT_PROP_REQUEST_PROBLEM_INFO:
+    case MQTT_PROP_REQUEST_RESPONSE_INFO:
+    case MQTT_PROP_MAXIMUM_QOS:
+    case MQTT_PROP_RETAIN_AVAILABLE:
+    case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+    case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+    case MQTT_PROP_SHARED_SUB_AVAILABLE:
+      used = (data_len >= 1) ? 1 : 0;
+      if(used)
+        prop->value = data[0];
+      break;
+
+    // Two Byte Integer
+    case MQTT_PROP_SERVER_KEEP_ALIVE:
+    case MQTT_PROP_RECEIVE_MAXIMUM:
+    case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+    case MQTT_PROP_TOPIC_ALIAS:
+      used = (data_len >= 2) ? 2 : 0;
+      if(used)
+        prop->value = decode_uint16(data, 0);
+      break;
+
+    // Four Byte Integer
+    case MQTT_PROP_MESSAGE_EXPIRY:
+    case MQTT_PROP_SESSION_EXPIRY:
+    case MQTT_PROP_WILL_DELAY:
+    case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+      used = (data_len >= 4) ? 4 : 0;
+      if(used)
+        prop->value = ((uint32_t) decode_uint16(data, 0) << 16) | decode_uint16(data, 2);
+      break;
+
+    // Variable Byte Integer
+    case MQTT_PROP_SUBSCRIPTION_ID:
+      used = decode_varint(data, data_len, &prop->value);
+      break;
+
+    // UTF-8 string / Binary data
+    case MQTT_PROP_CONTENT_TYPE:
+    case MQTT_PROP_RESPONSE_TOPIC:
+    case MQTT_PROP_CORRELATION_DATA:
+    case MQTT_PROP_ASSIGNED_CLIENT_ID:
+    case MQTT_PROP_AUTH_METHOD:
+    case MQTT_PROP_AUTH_DATA:
+    case MQTT_PROP_RESPONSE_INFO:
+    case MQTT_PROP_SERVER_REFERENCE:
+    case MQTT_PROP_REASON_STRING:
+      used = decode_property_str(data, data_len, &prop->data, &prop->len);
+      break;
+
+    // UTF-8 string pair
+    case MQTT_PROP_USER_PROPERTY:
+      used = decode_property_str(data, data_len, &prop->data, &prop->len);
+      if(used)
+      {
+        uint32_t used2 = decode_property_str(data + used, data_len - used, &prop->data2, &prop->len2);
+        used = (used2 != 0) ? used + used2 : 0;
+      }
+      break;
+
+    // Unknown (can't be skipped)
+    default:
+      used = 0;
+      break;
+  }
+
+  if(used == 0)
+    return FALSE;
+  *props += 1 + used;
+  *props_len -= 1 + used;
+  return TRUE;
+}
+
+/******************************************************************************
+ * Decodes MQTT 5.0 property list (Variable Byte Integer length prefixed)
+ *
+ * "offset" moves past the list, returns FALSE when malformed
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+decode_properties(uint8_t *data, uint16_t data_len, uint16_t *offset, uint8_t **props, uint16_t *props_len)
+{
+  uint32_t len;
+  uint8_t len_bytes;
+
+  if(*offset >= data_len)
+    return FALSE;
+  len_bytes = decode_varint(data + *offset, data_len - *offset, &len);
+  if(len_bytes == 0 || len > (uint32_t) (data_len - *offset - len_bytes))
+    return FALSE;
+
+  *props = data + *offset + len_bytes;
+  *props_len = len;
+  *offset += len_bytes + len;
+  return TRUE;
+}
+
+/******************************************************************************
+ * Encodes MQTT 5.0 Two/Four Byte Integer properties
+ *
+ *******************************************************************************/
+static uint8_t ICACHE_FLASH_ATTR
+encode_property_uint16(uint8_t id, uint16_t value, uint8_t *data)
+{
+  data[0] = id;
+  encode_uint16(value, data, 1);
+  return 3;
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+encode_property_uint32(uint8_t id, uint32_t value, uint8_t *data)
+{
+  data[0] = id;
+  encode_uint16(value >> 16, data, 1);
+  encode_uint16(value & 0xFFFF, data, 3);
+  return 5;
+}
+
+/******************************************************************************
+ * Resets MQTT 5.0 limits and topic aliases (new connection)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+v5_reset(struct mqtt_connection *conn)
+{
+  struct mqtt_v5_session *v5 = &conn->v5;
+  uint8_t i;
+
+  for(i = 0; i < MQTT_V5_ALIASES_OUT; ++i)
+  {
+    pool_free(v5->alias_out[i].topic);
+    v5->alias_out[i].topic = NULL;
+  }
+  for(i = 0; i < MQTT_V5_ALIASES_IN; ++i)
+  {
+    pool_free(v5->alias_in[i].topic);
+    v5->alias_in[i].topic = NULL;
+  }
+
+  // Protocol defaults until CONNACK says otherwise
+  v5->receive_max = 0xFFFF;
+  v5->alias_max = 0;
+  v5->max_packet_size = 0;
+  v5->alias_next = 0;
+}
+
+/******************************************************************************
+ * Finds outbound topic alias
+ *
+ * Returns the alias already sent for "topic" ("known" set) or the one to be
+ * assigned (see "alias_out_assign"), 0 when broker accepts no aliases
+ *
+ *******************************************************************************/
+static uint16_t ICACHE_FLASH_ATTR
+alias_out_lookup(struct mqtt_connection *conn, const uint8_t *topic, uint16_t topic_len, bool *known)
+{
+  struct mqtt_v5_session *v5 = &conn->v5;
+  uint16_t i, max = (v5->alias_max < MQTT_V5_ALIASES_OUT) ? v5->alias_max : MQTT_V5_ALIASES_OUT;
+  struct mqtt_alias *alias;
+
+  *known = FALSE;
+  if(max == 0)
+    return 0;
+
+  for(i = 0; i < max; ++i)
+  {
+    alias = &v5->alias_out[i];
+    if(alias->topic != NULL && alias->topic_len == topic_len && os_memcmp(alias->topic, topic, topic_len) == 0)
+    {
+      *known = TRUE;
+      return i + 1;
+    }
+  }
+
+  // Free ones first, then replaced round robin
+  return (v5->alias_next % max) + 1;
+}
+
+/******************************************************************************
+ * Records outbound topic alias (PUBLISH with topic + alias queued)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+alias_out_assign(struct mqtt_connection *conn, uint16_t alias_id, const uint8_t *topic, uint16_t topic_len)
+{
+  struct mqtt_v5_session *v5 = &conn->v5;
+  struct mqtt_alias *alias = &v5->alias_out[alias_id - 1];
+
+  pool_free(alias->topic);
+  alias->topic = (uint8_t *) pool_alloc(topic_len);
+  if(alias->topic == NULL)
+    return;
+  os_memcpy(alias->topic, topic, topic_len);
+  alias->topic_len = topic_len;
+  v5->alias_next = alias_id;
+}
+
+/******************************************************************************
+ * Applies inbound topic alias
+ *
+ * Empty topic takes the one mapped to the alias, otherwise the mapping is
+ * (re)defined. Returns FALSE for invalid aliases.
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+alias_in_apply(struct mqtt_connection *conn, uint32_t alias_id, uint8_t **topic, uint16_t *topic_len)
+{
+  struct mqtt_alias *alias;
+
+  if(alias_id == 0 || alias_id > MQTT_V5_ALIASES_IN)
+    return FALSE;
+  alias = &conn->v5.alias_in[alias_id - 1];
+
+  // Use mapping
+  if(*topic_len == 0)
+  {
+    if(alias->topic == NULL)
+      return FALSE;
+    *topic = alias->topic;
+    *topic_len = alias->topic_len;
+    return TRUE;
+  }
+
+  // New mapping
+  pool_free(alias->topic);
+  alias->topic = (uint8_t *) pool_alloc(*topic_len);
+  if(alias->topic != NULL)
+  {
+    os_memcpy(alias->topic, *topic, *topic_len);
+    alias->topic_len = *topic_len;
+  }
+  return TRUE;
+}
+#endif
+
+#if MQTT_TOPIC_INTERN
+//
+// MQTT TOPIC INTERNING
+//
+
+/******************************************************************************
+ * Gets interned topic (interned now if missing)
+ *
+ * Found through the topic index (hash map), a missing topic takes a free
+ * entry or the least recently used one (never pinned ones nor the last
+ * used, a message may still point to it).
+ * Returns NULL if topic can't be interned.
+ *
+ *******************************************************************************/
+static struct mqtt_interned_topic * ICACHE_FLASH_ATTR
+topic_intern(struct mqtt_connection *conn, const uint8_t *topic, uint16_t topic_len, bool pin)
+{
+  struct mqtt_topic_intern *intern = &conn->intern;
+  struct mqtt_interned_topic *entry, *victim = NULL;
+  uint8_t *copy;
+  uint8_t i;
+
+  if(topic_len == 0 || topic_len > MQTT_TOPIC_INTERN_LEN)
+  {
+    ++conn->intern_stats.skipped;
+    return NULL;
+  }
+
+  // Index sized for every entry (never grows)
+  if(intern->index == NULL)
+    intern->index = hash_create(MQTT_TOPIC_INTERN);
+  if(intern->index == NULL)
+  {
+    ++conn->intern_stats.skipped;
+    return NULL;
+  }
+
+  entry = (struct mqtt_interned_topic *) hash_lookup(intern->index, (const char *) topic, topic_len);
+  if(entry != NULL)
+  {
+    entry->used = ++intern->clock;
+    entry->pinned |= pin;
+    ++conn->intern_stats.hits;
+    return entry;
+  }
+
+  // Free entries go first
+  for(i = 0; i < MQTT_TOPIC_INTERN; i++)
+  {
+    entry = &intern->topics[i];
+    if(entry->topic == NULL)
+    {
+      victim = entry;
+      break;
+    }
+    if(!entry->pinned && entry->used != intern->clock && (victim == NULL || entry->used < victim->used))
+      victim = entry;
+  }
+
+  copy = (victim != NULL) ? (uint8_t *) pool_alloc(topic_len + 1) : NULL;
+  if(copy == NULL)
+  {
+    ++conn->intern_stats.skipped;
+    return NULL;
+  }
+  os_memcpy(copy, topic, topic_len);
+  copy[topic_len] = '\0';
+
+  if(victim->topic != NULL)
+  {
+    ++conn->intern_stats.evictions;
+    hash_delete(intern->index, (const char *) victim->topic, victim->len);
+    pool_free(victim->topic);
+    victim->topic = NULL;
+  }
+  if(!hash_insert(intern->index, (const char *) copy, topic_len, victim))
+  {
+    pool_free(copy);
+    ++conn->intern_stats.skipped;
+    return NULL;
+  }
+  ++conn->intern_stats.misses;
+
+  // Ids are not reused until wrapping (0 = not interned)
+  if(++intern->next_id == 0)
+    ++intern->next_id;
+  victim->topic = copy;
+  victim->len = topic_len;
+  victim->id = intern->next_id;
+  victim->used = ++intern->clock;
+  victim->pinned = pin;
+  return victim;
+}
+#endif
+
+//
+// MQTT PACKETS DECODERS
+//
+
+/******************************************************************************
+ * Decodes MQTT reason code (MQTT 5.0 acks)
+ *
+ * Missing reason code (always on MQTT 3.1.1) means success
+ *
+ *******************************************************************************/
+static enum mqtt_reason_code ICACHE_FLASH_ATTR
+decode_reason(struct mqtt_buffer *buffer, uint16_t offset)
+{
+  return (offset < buffer->offset) ? buffer->data[offset] : MQTT_REASON_SUCCESS;
+}
+
+/******************************************************************************
+ * Reports MQTT reason code (MQTT 5.0 only)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+report_reason(struct mqtt_connection *conn, enum mqtt_packet_type type, uint16_t packet_id,
+              enum mqtt_reason_code reason)
+{
+  #if MQTT_V5
+  if(conn->reason_cb != NULL)
+    conn->reason_cb(conn, type, packet_id, reason);
+  #else
+  (void) conn;
+  (void) type;
+  (void) packet_id;
+  (void) reason;
+  #endif
+}
+
+/******************************************************************************
+ * Decodes MQTT PUBLISH
+ *
+ * With MQTT_ZERO_COPY topic and payload are views into the buffer, otherwise
+ * they are NULL terminated copies (must be released). Copies that can't be
+ * allocated fail the decoding, the message is neither handled nor acked (the
+ * broker resends QoS 1/2 messages).
+ * With MQTT_TOPIC_INTERN topics are interned (message "topic_id" set, not
+ * released), only topics that can't be interned are copied or viewed.
+ * Interned topics may be evicted once the message is handled, the topic
+ * pointer is valid during "message_cb" only (ids of pinned topics are kept).
+ *
+ * On MQTT 5.0 properties are skipped (kept as a view) and topic aliases are
+ * resolved.
+ *
+ *******************************************************************************/
+static enum mqtt_reason_code ICACHE_FLASH_ATTR
+mqtt_publish_decode(struct mqtt_connection *conn, struct mqtt_buffer *buffer, struct mqtt_message *message,
+                    enum mqtt_qos qos, uint16_t *packet_id)
+{
+  uint16_t buffer_len = buffer->offset;
+  uint16_t id_len = (qos != MQTT_QOS_0) ? 2 : 0;
+  uint8_t *topic;
+
+  // Topic length
+  buffer->offset = 0;
+  if(buffer_len < 2)
+    return MQTT_REASON_MALFORMED_PACKET;
+  uint16_t topic_len = decode_uint16(buffer->data, 0);
+  buffer->offset += 2;
+
+  // Malformed packet?
+  if(topic_len + id_len > buffer_len - buffer->offset)
+    return MQTT_REASON_MALFORMED_PACKET;
+
+  // Message Topic
+  topic = buffer->data + buffer->offset;
+  buffer->offset += topic_len;
+
+  // Check packet id
+  *packet_id = 0;
+  if(qos != MQTT_QOS_0)
+  {
+    *packet_id = decode_uint16(buffer->data, buffer->offset);
+    buffer->offset += id_len;
+  }
+
+  #if MQTT_V5
+  // Properties
+  struct mqtt_property prop;
+  uint8_t *props;
+  uint16_t props_len;
+  if(!decode_properties(buffer->data, buffer_len, &buffer->offset, &message->props, &message->props_len))
+    return MQTT_REASON_MALFORMED_PACKET;
+
+  props = message->props;
+  props_len = message->props_len;
+  while(mqtt_property_next(&props, &props_len, &prop))
+  {
+    if(prop.id == MQTT_PROP_TOPIC_ALIAS && !alias_in_apply(conn, prop.value, &topic, &topic_len))
+      return MQTT_REASON_TOPIC_ALIAS_INVALID;
+  }
+  if(props_len != 0)
+    return MQTT_REASON_MALFORMED_PACKET;
+  if(topic_len == 0)
+    return MQTT_REASON_TOPIC_ALIAS_INVALID;
+  #endif
+
+  message->topic_len = topic_len;
+  #if MQTT_TOPIC_INTERN
+  struct mqtt_interned_topic *interned = topic_intern(conn, topic, topic_len, FALSE);
+  if(interned != NULL)
+  {
+    message->topic = interned->topic;
+    message->topic_id = interned->id;
+  }
+  #elif !MQTT_V5
+  (void) conn;
+  #endif
+  if(message->topic_id == 0)
+  {
+    #if MQTT_ZERO_COPY
+    message->topic = topic;
+    #else
+    message->topic = (uint8_t*)pool_zalloc(sizeof(uint8_t) * topic_len + 1);
+    if(message->topic == NULL)
+      return MQTT_REASON_UNSPECIFIED_ERROR;
+    os_memcpy(message->topic, topic, topic_len);
+    #endif
+  }
+
+  // Message payload
+  message->data_len = (buffer_len - buffer->offset);
+  #if MQTT_ZERO_COPY
+  message->data = buffer->data + buffer->offset;
+  #else
+  message->data = (uint8_t*)pool_zalloc(sizeof(uint8_t) * message->data_len + 1);
+  if(message->data == NULL)
+  {
+    if(message->topic_id == 0)
+      pool_free(message->topic);
+    return MQTT_REASON_UNSPECIFIED_ERROR;
+  }
+  os_memcpy(message->data, (buffer->data + buffer->offset), message->data_len);
+  #endif
+
+  return MQTT_REASON_SUCCESS;
+}
+
+//
+// MQTT PACKETS ENCODERS
+//
+
+#if MQTT_CONNECT_CACHE
+/******************************************************************************
+ * Checks cached CONNECT was encoded from current fields
+ *
+ * Fields are compared by reference, strings changed in place need
+ * "mqtt_connect_invalidate"
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+connect_cached(struct mqtt_connection *conn, uint8_t flags)
+{
+  struct mqtt_connect_cache *cache = &conn->connect;
+
+  return cache->data != NULL && cache->flags == flags && cache->kalive == conn->kalive &&
+         cache->client_id == conn->client_id && cache->username == conn->username &&
+         cache->password == conn->password && cache->will_topic == conn->last_will.topic &&
+         cache->will_data == conn->last_will.data;
+}
+
+/******************************************************************************
+ * Keeps encoded CONNECT for next connections
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+connect_cache_store(struct mqtt_connection *conn, uint8_t flags, struct mqtt_buffer *buffer)
+{
+  struct mqtt_connect_cache *cache = &conn->connect;
+
+  mqtt_connect_invalidate(conn);
+  cache->data = (uint8_t *) pool_alloc(buffer->offset);
+  if(cache->data == NULL)
+    return;
+  os_memcpy(cache->data, buffer->data, buffer->offset);
+  cache->len = buffer->offset;
+  cache->client_id = conn->client_id;
+  cache->username = conn->username;
+  cache->password = conn->password;
+  cache->will_topic = conn->last_will.topic;
+  cache->will_data = conn->last_will.data;
+  cache->kalive = conn->kalive;
+  cache->flags = flags;
+}
+#endif
+
+/******************************************************************************
+ * Encodes MQTT CONNECT packet on transmit queue
+ *
+ *******************************************************************************/
+static enum mqtt_status ICACHE_FLASH_ATTR
+connect_encode(struct mqtt_connection *conn, struct mqtt_buffer *w_buffer, uint8_t flags)
+{
+  enum mqtt_status status;
+
+  // Packet headers
+  uint8_t fixed_hd;
+
+  #if MQTT_V5
+  const uint8_t protocol_level = 5;
+  #else
+  const uint8_t protocol_level = 4;
+  #endif
+  uint8_t variable_hd[10] = {0x00, 0x04, 'M', 'Q', 'T', 'T', protocol_level, flags, 0x00, 0x00};
+
+  #if MQTT_V5
+  // Properties (our limits, broker ones come on CONNACK)
+  uint8_t props[1 + 5 + 3 + 3 + 5];
+  uint8_t props_len = 1;
+  if(!conn->clean_session)
+    props_len += encode_property_uint32(MQTT_PROP_SESSION_EXPIRY, MQTT_V5_SESSION_EXPIRY, props + props_len);
+  props_len += encode_property_uint16(MQTT_PROP_RECEIVE_MAXIMUM, MQTT_MAX_INBOUND, props + props_len);
+  props_len += encode_property_uint16(MQTT_PROP_TOPIC_ALIAS_MAXIMUM, MQTT_V5_ALIASES_IN, props + props_len);
+  props_len += encode_property_uint32(MQTT_PROP_MAXIMUM_PACKET_SIZE, MQTT_BUFFER_SIZE, props + props_len);
+  props[0] = props_len - 1;
+
+  // Will properties (none)
+  const uint8_t will_props = 0;
+  const uint8_t will_props_len = (conn->last_will.topic != NULL) ? 1 : 0;
+  #else
+  const uint8_t props_len = 0;
+  const uint8_t will_props_len = 0;
+  #endif
+
+  // String lengths
+  uint8_t strs_cnt = 3;
+  const uint16_t cli_len = os_strlen(conn->client_id);
+  const uint16_t user_len = os_strlen(conn->username);
+  const uint16_t pwd_len = os_strlen(conn->password);
+  uint16_t lw_topic_len = 0;
+  uint16_t lw_data_len = 0;
+  if(conn->last_will.topic != NULL)
+  {
+    lw_topic_len = os_strlen(conn->last_will.topic);
+    ++strs_cnt;
+  }
+  if(conn->last_will.data != NULL)
+  {
+    lw_data_len = os_strlen(conn->last_will.data);
+    ++strs_cnt;
+  }
+
+  // Extra bytes (2 for each string encoded using "encode_str")
+  const int8_t strs_len_bytes = strs_cnt * 2;
+
+  // Fixed header
+  fixed_hd = mqtt_header(MQTT_CONNECT, 0, 0, 0, 0);
+  status = begin_packet(conn, w_buffer, fixed_hd,
+                        sizeof(variable_hd) + props_len + cli_len + user_len + pwd_len + will_props_len + lw_topic_len +
+                        lw_data_len + strs_len_bytes);
+  if(status != MQTT_OK)
+    return status;
+  // Variable header
+  encode_uint16(conn->kalive, variable_hd, 8);
+
+  // Write variable header
+  write_buffer(w_buffer, variable_hd, sizeof(variable_hd));
+  #if MQTT_V5
+  write_buffer(w_buffer, props, props_len);
+  write_buffer(w_buffer, (uint8_t *) &will_props, will_props_len);
+  #endif
+  // Write payload (must use this order)
+  encode_str(w_buffer, (uint8_t *) conn->client_id, cli_len);
+  if(lw_topic_len > 0)
+    encode_str(w_buffer, conn->last_will.topic, lw_topic_len);
+  if(lw_data_len > 0)
+    encode_str(w_buffer, conn->last_will.data, lw_data_len);
+  encode_str(w_buffer, (uint8_t *) conn->username, user_len);
+  encode_str(w_buffer, (uint8_t *) conn->password, pwd_len);
+
+  #if MQTT_CONNECT_CACHE
+  if(!w_buffer->overflow)
+    connect_cache_store(conn, flags, w_buffer);
+  #endif
+  return MQTT_OK;
+}
+
+/******************************************************************************
+ * Encodes MQTT CONNECT
+ *
+ * Packets may be queued right after it (before CONNACK), with "pipelined"
+ * set in-flight messages are resent here too so all of them share the
+ * first flight.
+ * On reconnections with the same fields the packet encoded last time is
+ * queued as is (MQTT_CONNECT_CACHE).
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_connect(struct mqtt_connection *conn)
+{
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
+
+  // Flags (user and password always set)
+  /*
+      7   |     6    |     5      |   4    3   |    2    |     1     |    0
+     user |    pwd   |   wretain  |    wqos    |  wflag  |  session  | reserved
+  */
+  uint8_t flags = 0b11000000;
+  if(conn->clean_session)
+    flags |= 0x02;
+  if(conn->last_will.topic != NULL)
+  {
+    flags |= 0x04;
+    flags |= (conn->last_will.qos << 3) | (conn->last_will.retain << 5);
+  }
+
+  // Packet ids continue across connections (in-flight ones are resent)
+  if(conn->packet_id == 0)
+    conn->packet_id = 1;
+
+  // Reset stream parser, transmit queue, held acks and streamed PUBLISH (new connection)
+  mqtt_parser_reset(conn);
+  tx_reset(conn);
+  conn->stream.remaining = 0;
+  conn->acks.count = 0;
+  conn->acks.ping = FALSE;
+  // Clean session: broker forgets QoS 2 messages waiting PUBREL
+  if(conn->clean_session)
+    os_memset(conn->session.inbound, 0, sizeof(conn->session.inbound));
+  #if MQTT_V5
+  v5_reset(conn);
+  #endif
+
+  #if MQTT_CONNECT_CACHE
+  if(connect_cached(conn, flags))
+  {
+    status = tx_reserve(conn, &w_buffer, conn->connect.len);
+    if(status != MQTT_OK)
+      return status;
+    write_buffer(&w_buffer, conn->connect.data, conn->connect.len);
+  }
+  else
+  #endif
+  {
+    status = connect_encode(conn, &w_buffer, flags);
+    if(status != MQTT_OK)
+      return status;
+  }
+
+  // Send packet
+  status = send_buffer(&w_buffer, conn);
+
+  // Pipelined: in-flight messages go on the first flight too (not after CONNACK)
+  if(status == MQTT_OK && conn->pipelined)
+    inflight_resume(conn);
+  return status;
+}
+
+/******************************************************************************
+ * Drops cached CONNECT
+ *
+ * Needed only when credentials or last will strings are changed in place,
+ * pointing fields to other strings is noticed on next "mqtt_connect"
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_connect_invalidate(struct mqtt_connection *conn)
+{
+  #if MQTT_CONNECT_CACHE
+  pool_free(conn->connect.data);
+  conn->connect.data = NULL;
+  conn->connect.len = 0;
+  #endif
+}
+
+/******************************************************************************
+ * Encodes MQTT DISCONNECT
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_disconnect(struct mqtt_connection *conn)
+{
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
+
+  // Write full packet (no variable header, no payload)
+  if((status = begin_packet(conn, &w_buffer, mqtt_header(MQTT_DISCONNECT, 0, 0, 0, 0), 0)) != MQTT_OK)
+    return status;
+
+  // Send packet
+  return send_buffer(&w_buffer, conn);
+}
+
+/******************************************************************************
+ * Encodes MQTT SUBSCRIBE
+ *
+ * Packs as many topic filters as fit in MQTT_BUFFER_SIZE (at least one) on a
+ * single packet, "packed" returns how many were taken from "subs" and
+ * "packet_id" the id acknowledged by the matching SUBACK.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_subscribev(struct mqtt_connection *conn, const struct mqtt_subscription *subs, uint8_t subs_cnt,
+                uint8_t *packed, uint16_t *packet_id)
+{
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
+  uint8_t i, count;
+
+  // Packet headers
+  uint8_t fixed_hd;
+  uint8_t variable_hd[2];
+
+  // Lengths (MQTT 5.0 adds empty properties)
+  uint32_t remlen = sizeof(variable_hd) + MQTT_V5;
+  uint32_t filter_len;
+  const int8_t qos_len = 1;
+  // Extra bytes (2 for each string encoded using "encode_str")
+  const int8_t strs_len_bytes = 2;
+
+  *packed = 0;
+  if(subs_cnt == 0)
+    return MQTT_ERROR;
+
+  // Payload length (stop on 1st filter exceeding the buffer)
+  for(count = 0; count < subs_cnt; count++)
+  {
+    filter_len = os_strlen(subs[count].topic) + strs_len_bytes + qos_len;
+    if(count > 0 && remlen + filter_len > MQTT_BUFFER_SIZE)
+      break;
+    remlen += filter_len;
+  }
+
+  // Variable header
+  if(encode_packet_id(conn, variable_hd) == 0)
+    return MQTT_WOULD_BLOCK;
+
+  // Fixed header
+  fixed_hd = mqtt_header(MQTT_SUBSCRIBE, 0, 0, 1, 0);
+  status = begin_packet(conn, &w_buffer, fixed_hd, remlen);
+  if(status != MQTT_OK)
+    return status;
+
+  // Write variable header
+  write_buffer(&w_buffer, variable_hd, sizeof(variable_hd));
+  #if MQTT_V5
+  write_buffer(&w_buffer, (uint8_t *) "\0", 1);
+  #endif
+  // Write payload
+  for(i = 0; i < count; i++)
+  {
+    uint8_t qos_data = subs[i].qos;
+    encode_str(&w_buffer, (uint8_t *) subs[i].topic, os_strlen(subs[i].topic));
+    write_buffer(&w_buffer, &qos_data, qos_len);
+  }
+
+  // Send packet
+  status = send_buffer(&w_buffer, conn);
+  if(status == MQTT_OK)
+  {
+    *packed = count;
+    *packet_id = decode_uint16(variable_hd, 0);
+  }
+  return status;
+}
+
+/******************************************************************************
+ * Encodes MQTT SUBSCRIBE (single topic filter)
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_subscribe(struct mqtt_connection *conn, char *topic, enum mqtt_qos qos)
+{
+  struct mqtt_subscription sub = { .topic = topic, .qos = qos };
+  uint8_t packed;
+  uint16_t packet_id;
+
+  return mqtt_subscribev(conn, &sub, 1, &packed, &packet_id);
+}
+
+/******************************************************************************
+ * Encodes MQTT UNSUBSCRIBE
+ *
+ * Packs as many topic filters as fit in MQTT_BUFFER_SIZE (at least one) on a
+ * single packet, "packed" returns how many were taken from "topics".
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_unsubscribev(struct mqtt_connection *conn, char **topics, uint8_t topics_cnt, uint8_t *packed)
+{
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
+  uint8_t i, count;
+
+  // Packet headers
+  uint8_t fixed_hd;
+  uint8_t variable_hd[2];
+
+  // Lengths (MQTT 5.0 adds empty properties)
+  uint32_t remlen = sizeof(variable_hd) + MQTT_V5;
+  uint32_t filter_len;
+  // Extra bytes (2 for each string encoded using "encode_str")
+  const int8_t strs_len_bytes = 2;
+
+  *packed = 0;
+  if(topics_cnt == 0)
+    return MQTT_ERROR;
+
+  // Payload length (stop on 1st filter exceeding the buffer)
+  for(count = 0; count < topics_cnt; count++)
+  {
+    filter_len = os_strlen(topics[count]) + strs_len_bytes;
+    if(count > 0 && remlen + filter_len > MQTT_BUFFER_SIZE)
+      break;
+    remlen += filter_len;
+  }
+
+  // Variable header
+  if(encode_packet_id(conn, variable_hd) == 0)
+    return MQTT_WOULD_BLOCK;
+
+  // Fixed header
+  fixed_hd = mqtt_header(MQTT_UNSUBSCRIBE, 0, 0, 1, 0);
+  status = begin_packet(conn, &w_buffer, fixed_hd, remlen);
+  if(status != MQTT_OK)
+    return status;
+
+  // Write variable header
+  write_buffer(&w_buffer, variable_hd, sizeof(variable_hd));
+  #if MQTT_V5
+  write_buffer(&w_buffer, (uint8_t *) "\0", 1);
+  #endif
+  // Write payload
+  for(i = 0; i < count; i++)
+    encode_str(&w_buffer, (uint8_t *) topics[i], os_strlen(topics[i]));
+
+  // Send packet
+  status = send_buffer(&w_buffer, conn);
+  if(status == MQTT_OK)
+    *packed = count;
+  return status;
+}
+
+/******************************************************************************
+ * Encodes MQTT UNSUBSCRIBE (single topic filter)
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_unsubscribe(struct mqtt_connection *conn, char *topic)
+{
+  uint8_t packed;
+
+  return mqtt_unsubscribev(conn, &topic, 1, &packed);
+}
+
+/******************************************************************************
+ * Encodes MQTT PUBLISH
+ *
+ * QoS and retain come from the precomputed "fixed_hd" flags, "len_data" is
+ * the encoded topic length (see "mqtt_topic_register").
+ *
+ * On MQTT 5.0 QoS 0 topics go as aliases once the broker knows them (QoS 1/2
+ * ones don't, they may be resent on a new connection). QoS 1/2 are also
+ * bounded by the broker Receive Maximum.
+ *
+ *******************************************************************************/
+static enum mqtt_status ICACHE_FLASH_ATTR
+publish_packet(struct mqtt_connection *conn, uint8_t fixed_hd, const uint8_t *len_data, const uint8_t *topic,
+               uint16_t topic_len, const struct mqtt_fragment *frags, uint8_t frags_cnt,
+               void (*cb)(struct mqtt_connection *, uint16_t))
+{
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
+  const enum mqtt_qos qos = (fixed_hd >> 1) & 0x03;
+
+  // Packet headers
+  uint8_t variable_hd[2];
+  uint16_t packet_id = 0;
+  uint8_t i;
+
+  // Lengths
+  uint16_t id_len = 0;
+  uint32_t message_len = 0;
+  for(i = 0; i < frags_cnt; ++i)
+    message_len += frags[i].len;
+  // Extra bytes (2 for the encoded topic length)
+  const int8_t strs_len_bytes = 2;
+
+  #if MQTT_V5
+  uint8_t props[4] = {0};
+  uint8_t props_len = 1;
+  uint16_t alias = 0;
+  bool alias_known = FALSE;
+
+  if(qos != MQTT_QOS_0 && conn->session.count >= conn->v5.receive_max)
+  {
+    conn->session.blocked = TRUE;
+    return MQTT_WOULD_BLOCK;
+  }
+
+  // Topic alias (empty topic once known by broker)
+  if(qos == MQTT_QOS_0)
+    alias = alias_out_lookup(conn, topic, topic_len, &alias_known);
+  if(alias != 0)
+  {
+    props[0] = encode_property_uint16(MQTT_PROP_TOPIC_ALIAS, alias, props + 1);
+    props_len += props[0];
+  }
+  if(alias_known)
+  {
+    static const uint8_t no_topic[2] = {0x00, 0x00};
+    len_data = no_topic;
+    topic_len = 0;
+  }
+  #else
+  const uint8_t props_len = 0;
+  #endif
+
+  // Variable header (QoS > 0 only, in-flight window full?)
+  if(qos != MQTT_QOS_0)
+  {
+    if((packet_id = encode_packet_id(conn, variable_hd)) == 0)
+      return MQTT_WOULD_BLOCK;
+    id_len = sizeof(variable_hd);
+  }
+
+  // Fixed header
+  status = begin_packet(conn, &w_buffer, fixed_hd, strs_len_bytes + topic_len + id_len + props_len + message_len);
+  if(status != MQTT_OK)
+    return status;
+
+  // Write variable header
+  write_buffer(&w_buffer, (uint8_t *) len_data, strs_len_bytes);
+  write_buffer(&w_buffer, (uint8_t *) topic, topic_len);
+  write_buffer(&w_buffer, variable_hd, id_len);
+  #if MQTT_V5
+  write_buffer(&w_buffer, props, props_len);
+  #endif
+  // Write payload
+  for(i = 0; i < frags_cnt; ++i)
+    write_buffer(&w_buffer, (uint8_t *) frags[i].data, frags[i].len);
+
+  if(w_buffer.overflow)
+    return MQTT_ERROR;
+
+  #if MQTT_V5
+  // Broker learns the alias with this packet
+  if(alias != 0 && !alias_known)
+    alias_out_assign(conn, alias, topic, topic_len);
+  #endif
+
+  // Track until PUBACK/PUBCOMP (reserved space left unused)
+  if(qos != MQTT_QOS_0 && !inflight_add(conn, packet_id, qos, &w_buffer, cb))
+    return MQTT_NO_MEMORY;
+
+  // Send packet
+  return send_buffer(&w_buffer, conn);
+}
+
+/******************************************************************************
+ * Encodes MQTT PUBLISH (scatter-gather)
+ *
+ * Payload is given as fragments with explicit lengths (binary safe), they
+ * are gathered once, right after the topic, on the transmit queue.
+ *
+ * QoS 1/2 messages are kept in-flight (up to MQTT_MAX_INFLIGHT, pipelined)
+ * until PUBACK/PUBCOMP, then "cb" is called with their packet id.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_publishv(struct mqtt_connection *conn, char *topic, const struct mqtt_fragment *frags, uint8_t frags_cnt,
+              enum mqtt_qos qos, bool retain, void (*cb)(struct mqtt_connection *, uint16_t))
+{
+  // Topic length
+  uint8_t len_data[2];
+  uint16_t topic_len = os_strlen(topic);
+  encode_uint16(topic_len, len_data, 0);
+
+  // Fixed header (dup set only on retransmissions)
+  const uint8_t dup = 0;
+  uint8_t fixed_hd = mqtt_header(MQTT_PUBLISH, dup, (qos >> 1), (qos & 0x01), (retain ? 1 : 0));
+
+  return publish_packet(conn, fixed_hd, len_data, (uint8_t *) topic, topic_len, frags, frags_cnt, cb);
+}
+
+/******************************************************************************
+ * Encodes MQTT PUBLISH to registered topic
+ *
+ * No topic scanning nor encoding, see "mqtt_topic_register".
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_publish_topic(struct mqtt_connection *conn, const struct mqtt_topic *topic, const struct mqtt_fragment *frags,
+                   uint8_t frags_cnt, void (*cb)(struct mqtt_connection *, uint16_t))
+{
+  return publish_packet(conn, topic->fixed_hd, topic->data, topic->data + 2, topic->len - 2, frags, frags_cnt, cb);
+}
+
+/******************************************************************************
+ * Encodes MQTT PUBLISH
+ *
+ * Payload is a NULL terminated string (see "mqtt_publishv" for binary data)
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_publish(struct mqtt_connection *conn, char *topic, uint8_t *message, enum mqtt_qos qos, bool retain)
+{
+  struct mqtt_fragment frag = { message, os_strlen(message) };
+  return mqtt_publishv(conn, topic, &frag, 1, qos, retain, NULL);
+}
+
+/******************************************************************************
+ * Starts streamed MQTT PUBLISH
+ *
+ * For payloads bigger than the transmit queue: total length is declared up
+ * front and only the Fixed header + topic are queued here, payload follows
+ * with "mqtt_publish_chunk" calls (paced by "tx_ready_cb"). QoS 0 only.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_publish_begin(struct mqtt_connection *conn, char *topic, uint32_t message_len, enum mqtt_qos qos, bool retain)
+{
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
+
+  // QoS 0 only (payload is not kept for retransmission)
+  if(qos != MQTT_QOS_0)
+    return MQTT_ERROR;
+
+  // Packet headers
+  uint8_t fixed_hd;
+  uint8_t remlen_len, remlen[4];
+
+  // Lengths
+  uint16_t topic_len = os_strlen(topic);
+  // Extra bytes (2 for each string encoded using "encode_str")
+  const int8_t strs_len_bytes = 2;
+
+  // Properties (MQTT 5.0, empty)
+  const uint8_t props_len = MQTT_V5;
+
+  // Remaining length limit (4 bytes Multi-Byte Integer)
+  if(message_len > (uint32_t) (MQTT_MAX_REMLEN - topic_len - strs_len_bytes - props_len))
+    return MQTT_ERROR;
+
+  if(conn->stream.remaining > 0)
+    return MQTT_WOULD_BLOCK;
+
+  // Fixed header (dup always 0)
+  const uint8_t dup = 0;
+  fixed_hd = mqtt_header(MQTT_PUBLISH, dup, (qos >> 1), (qos & 0x01), (retain ? 1 : 0));
+  remlen_len = encode_mbi(topic_len + props_len + message_len + strs_len_bytes, remlen);
+
+  #if MQTT_V5
+  // Broker Maximum Packet Size
+  if(conn->v5.max_packet_size != 0 &&
+     1 + remlen_len + topic_len + props_len + message_len + strs_len_bytes > conn->v5.max_packet_size)
+    return MQTT_ERROR;
+  #endif
+
+  // Reserve just the head (payload is streamed)
+  status = tx_reserve(conn, &w_buffer, 1 + remlen_len + topic_len + props_len + strs_len_bytes);
+  if(status != MQTT_OK)
+    return status;
+
+  // Write fixed header
+  write_buffer(&w_buffer, &fixed_hd, 1);
+  write_buffer(&w_buffer, remlen, remlen_len);
+  // Write topic
+  encode_str(&w_buffer, (uint8_t *) topic, topic_len);
+  #if MQTT_V5
+  write_buffer(&w_buffer, (uint8_t *) "\0", props_len);
+  #endif
+
+  // Send packet head
+  conn->stream.remaining = message_len;
+  return send_buffer(&w_buffer, conn);
+}
+
+/******************************************************************************
+ * Streams MQTT PUBLISH payload chunk
+ *
+ * Returns the amount of bytes accepted (0 when transmit queue is full or
+ * there is nothing to send)
+ *
+ *******************************************************************************/
+uint16_t ICACHE_FLASH_ATTR
+mqtt_publish_chunk(struct mqtt_connection *conn, const uint8_t *data, uint16_t data_len)
+{
+  struct mqtt_buffer w_buffer;
+
+  // Empty chunks would take a transmit slot
+  if(conn->stream.remaining == 0 || data_len == 0)
+    return 0;
+
+  // Clamp to declared length and buffer size
+  if(data_len > conn->stream.remaining)
+    data_len = conn->stream.remaining;
+  if(data_len > MQTT_BUFFER_SIZE)
+    data_len = MQTT_BUFFER_SIZE;
+
+  if(tx_reserve(conn, &w_buffer, data_len) != MQTT_OK)
+    return 0;
+  write_buffer(&w_buffer, (uint8_t *) data, data_len);
+
+  conn->stream.remaining -= data_len;
+  send_buffer(&w_buffer, conn);
+  return data_len;
+}
+
+/******************************************************************************
+ * Encodes MQTT PINGREQ
+ *
+ * When the transmit queue can't take it (streamed PUBLISH in progress or
+ * queue full) it is sent from "mqtt_sent" once there is room.
+ *
+ *******************************************************************************/
+enum mqtt_status ICACHE_FLASH_ATTR
+mqtt_ping(struct mqtt_connection *conn)
+{
+  struct mqtt_buffer w_buffer;
+  enum mqtt_status status;
+
+  // Write full packet (no variable header, no payload)
+  if((status = begin_packet(conn, &w_buffer, mqtt_header(MQTT_PINGREQ, 0, 0, 0, 0), 0)) != MQTT_OK)
+  {
+    if(status == MQTT_WOULD_BLOCK)
+      conn->acks.ping = TRUE;
+    return status;
+  }
+
+  // Send packet
+  return send_buffer(&w_buffer, conn);
+}
+
+//
+// MQTT CALLBACK HANDLERS
+//
+
+
+/******************************************************************************
+ * Handle MQTT CONNACK
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+handle_connack(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
 {
-    // Return code (2nd byte Variable header)
+    // Session Present (bit 0 on 1st byte Variable header)
+    bool session_present = (buffer->data[0] & 0x01) != 0;
+    // Return code (2nd byte Variable header, MQTT 5.0 reason code)
     enum mqtt_connack_status status = buffer->data[1];
-    conn->connect_cb(conn, status);
+
+    #if MQTT_V5
+    // Broker limits
+    struct mqtt_property prop;
+    uint8_t *props;
+    uint16_t props_len, offset = 2;
+    if(status == MQTT_CONNACK_SUCCESS && decode_properties(buffer->data, buffer->offset, &offset, &props, &props_len))
+    {
+      while(mqtt_property_next(&props, &props_len, &prop))
+      {
+        if(prop.id == MQTT_PROP_RECEIVE_MAXIMUM && prop.value != 0)
+          conn->v5.receive_max = prop.value;
+        else if(prop.id == MQTT_PROP_TOPIC_ALIAS_MAXIMUM)
+          conn->v5.alias_max = prop.value;
+        else if(prop.id == MQTT_PROP_MAXIMUM_PACKET_SIZE)
+          conn->v5.max_packet_size = prop.value;
+      }
+    }
+    #endif
+
+    // New session: inbound packet ids waiting PUBREL are not duplicates anymore
+    if(status == MQTT_CONNACK_SUCCESS && !session_present)
+      os_memset(conn->session.inbound, 0, sizeof(conn->session.inbound));
+
+    // Resend messages left in-flight by previous connection
+    if(status == MQTT_CONNACK_SUCCESS && !conn->pipelined)
+      inflight_resume(conn);
+
+    // Rejected: drop whatever was queued behind CONNECT and not sent yet
+    // (QoS 1/2 messages stay in-flight for the next connection)
+    if(status != MQTT_CONNACK_SUCCESS)
+    {
+      tx_discard(conn);
+      conn->stream.remaining = 0;
+    }
+
+    conn->connect_cb(conn, status, session_present);
+}
+
+/******************************************************************************
+ * Handle MQTT PUBACK
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+handle_puback(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
+{
+  // Read packet id
+  uint16_t packet_id = decode_uint16(buffer->data, 0);
+  enum mqtt_reason_code reason = decode_reason(buffer, 2);
+
+  // Unknown (or duplicated) acks are ignored
+  struct mqtt_inflight *inflight = inflight_release(conn, packet_id, MQTT_INFLIGHT_PUBACK);
+  if(inflight == NULL)
+    return;
+
+  // Rejected by broker (not retried)
+  if(reason >= MQTT_REASON_UNSPECIFIED_ERROR)
+    report_reason(conn, MQTT_PUBACK, packet_id, reason);
+  else if(inflight->delivered_cb != NULL)
+    inflight->delivered_cb(conn, packet_id);
+  inflight_wake(conn);
+}
+
+/******************************************************************************
+ * Handle MQTT PUBREC (QoS 2 outbound, 1st step)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+handle_pubrec(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
+{
+  // Read packet id
+  uint16_t packet_id = decode_uint16(buffer->data, 0);
+  enum mqtt_reason_code reason = decode_reason(buffer, 2);
+
+  // Rejected by broker, flow ends here (no PUBREL)
+  if(reason >= MQTT_REASON_UNSPECIFIED_ERROR)
+  {
+    if(inflight_release(conn, packet_id, MQTT_INFLIGHT_PUBREC) != NULL)
+    {
+      report_reason(conn, MQTT_PUBREC, packet_id, reason);
+      inflight_wake(conn);
+    }
+    return;
+  }
+
+  // Broker owns message now, PUBLISH copy no longer needed
+  struct mqtt_inflight *inflight = inflight_find(conn, packet_id, MQTT_INFLIGHT_PUBREC);
+  if(inflight != NULL)
+  {
+    pool_free(inflight->packet);
+    inflight->packet = NULL;
+    inflight->state = MQTT_INFLIGHT_PUBCOMP;
+    inflight->age = 0;
+  }
+
+  // Duplicated PUBREC are answered too
+  ack_send(conn, MQTT_PUBREL, packet_id);
+}
+
+/******************************************************************************
+ * Handle MQTT PUBREL (QoS 2 inbound, 2nd step)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+handle_pubrel(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
+{
+  // Read packet id
+  uint16_t packet_id = decode_uint16(buffer->data, 0);
+  enum mqtt_reason_code reason = decode_reason(buffer, 2);
+
+  if(reason >= MQTT_REASON_UNSPECIFIED_ERROR)
+    report_reason(conn, MQTT_PUBREL, packet_id, reason);
+
+  inbound_release(conn, packet_id);
+  ack_send(conn, MQTT_PUBCOMP, packet_id);
+}
+
+/******************************************************************************
+ * Handle MQTT PUBCOMP (QoS 2 outbound, 2nd step)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+handle_pubcomp(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
+{
+  // Read packet id
+  uint16_t packet_id = decode_uint16(buffer->data, 0);
+  enum mqtt_reason_code reason = decode_reason(buffer, 2);
+
+  // Unknown (or duplicated) acks are ignored
+  struct mqtt_inflight *inflight = inflight_release(conn, packet_id, MQTT_INFLIGHT_PUBCOMP);
+  if(inflight == NULL)
+    return;
+
+  if(reason >= MQTT_REASON_UNSPECIFIED_ERROR)
+    report_reason(conn, MQTT_PUBCOMP, packet_id, reason);
+  else if(inflight->delivered_cb != NULL)
+    inflight->delivered_cb(conn, packet_id);
+  inflight_wake(conn);
 }
 
 /******************************************************************************
@@ -477,21 +2188,44 @@ handle_connack(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
  *
  *******************************************************************************/
 static void ICACHE_FLASH_ATTR
-handle_publish(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
+handle_publish(struct mqtt_connection *conn, uint8_t header, struct mqtt_buffer *buffer)
 {
-    // QoS (2nd bit on 1st byte Variable header)
-    enum mqtt_qos qos = (buffer->data[0] & 0x06);
+    // QoS (bits 1 and 2 on Fixed header)
+    enum mqtt_qos qos = (header & 0x06) >> 1;
     struct mqtt_message message = {};
     uint16_t packet_id = 0;
 
-    packet_id = mqtt_publish_decode(buffer, &message, qos);
-    conn->message_cb(conn, &message);
-    os_free(message.topic);
-    os_free(message.data);
-
-    // Reply with PUBACK
-    if(packet_id > 0 && qos == MQTT_QOS_1)
-      mqtt_puback(conn, packet_id);
+    bool duplicated = FALSE;
+    enum mqtt_reason_code reason;
+
+    reason = mqtt_publish_decode(conn, buffer, &message, qos, &packet_id);
+    if(reason != MQTT_REASON_SUCCESS)
+    {
+      report_reason(conn, MQTT_PUBLISH, packet_id, reason);
+      return;
+    }
+
+    // QoS 2: deliver once, until PUBREL the packet id is a duplicate
+    // (table full: no PUBREC, broker will resend it)
+    if(qos == MQTT_QOS_2 && !inbound_add(conn, packet_id, &duplicated))
+      report_reason(conn, MQTT_PUBLISH, packet_id, MQTT_REASON_RECEIVE_MAXIMUM_EXCEEDED);
+    else
+    {
+      if(!duplicated)
+        conn->message_cb(conn, &message);
+
+      // Reply with PUBACK/PUBREC
+      if(qos == MQTT_QOS_1)
+        ack_send(conn, MQTT_PUBACK, packet_id);
+      else if(qos == MQTT_QOS_2)
+        ack_send(conn, MQTT_PUBREC, packet_id);
+    }
+
+    #if !MQTT_ZERO_COPY
+    if(message.topic_id == 0)
+      pool_free(message.topic);
+    pool_free(message.data);
+    #endif
 }
 
 /******************************************************************************
@@ -504,57 +2238,457 @@ handle_suback(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
   // Read packet id
   uint16_t packet_id = decode_uint16(buffer->data, 0);
 
-  // Read return code
-  buffer->offset += 2;
-  enum mqtt_suback_status status = buffer->data[buffer->offset];
+  uint16_t offset = 2;
+
+  #if MQTT_V5
+  // Properties (ignored)
+  uint8_t *props;
+  uint16_t props_len;
+  if(!decode_properties(buffer->data, buffer->offset, &offset, &props, &props_len))
+    return;
+  #endif
+
+  // Return codes (one per topic filter, same order as SUBSCRIBE)
+  if(buffer->offset <= offset)
+    return;
 
   // Callback
-  conn->subscribe_cb(conn, status, packet_id);
+  conn->subscribe_cb(conn, packet_id, buffer->data + offset, buffer->offset - offset);
 }
 
 /******************************************************************************
- * Parses MQTT packets
+ * Handle MQTT UNSUBACK
  *
- * This implementation ignores packets used on QoS 2 (exactly once)
+ * Only MQTT 5.0 has reason codes (one per topic filter), failures reported
  *
  *******************************************************************************/
-void ICACHE_FLASH_ATTR
-mqtt_parse_packet(struct mqtt_connection *conn, uint8_t *data, int data_len)
+static void ICACHE_FLASH_ATTR
+handle_unsuback(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
+{
+  #if MQTT_V5
+  // Read packet id
+  uint16_t packet_id = decode_uint16(buffer->data, 0);
+  uint16_t offset = 2;
+
+  // Properties (ignored)
+  uint8_t *props;
+  uint16_t props_len;
+  if(!decode_properties(buffer->data, buffer->offset, &offset, &props, &props_len))
+    return;
+
+  for(; offset < buffer->offset; ++offset)
+  {
+    if(buffer->data[offset] >= MQTT_REASON_UNSPECIFIED_ERROR)
+      report_reason(conn, MQTT_UNSUBACK, packet_id, buffer->data[offset]);
+  }
+  #else
+  (void) conn;
+  (void) buffer;
+  #endif
+}
+
+/******************************************************************************
+ * Handle MQTT DISCONNECT (MQTT 5.0, sent by broker)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+handle_disconnect(struct mqtt_connection *conn, struct mqtt_buffer *buffer)
 {
-  struct mqtt_buffer r_buffer = {};
-  r_buffer.data = (uint8_t*) os_malloc(MQTT_BUFFER_SIZE);
+  report_reason(conn, MQTT_DISCONNECT, 0, decode_reason(buffer, 0));
+}
 
-  // Packet type (upper nibble on 1st byte)
-  enum mqtt_packet_type packet_type = data[0] >> 4;
+/******************************************************************************
+ * Gets shortest valid Variable header + Payload of packet type
+ *
+ * Fields read by handlers before any length check of their own
+ *
+ *******************************************************************************/
+static uint16_t ICACHE_FLASH_ATTR
+packet_min_length(enum mqtt_packet_type packet_type)
+{
+  switch (packet_type)
+  {
+    case MQTT_CONNACK:
+      // Flags + return code
+      return 2;
+
+    case MQTT_PUBLISH:
+      // Topic length
+      return 2;
+
+    case MQTT_PUBACK:
+    case MQTT_PUBREC:
+    case MQTT_PUBREL:
+    case MQTT_PUBCOMP:
+    case MQTT_UNSUBACK:
+      // Packet id
+      return 2;
+
+    case MQTT_SUBACK:
+      // Packet id + one return code
+      return 3;
+
+    default:
+      return 0;
+  }
+}
 
-  // Remaining lenght (2nd to 5th byte)
-  uint8_t *remlen_offset = os_malloc(sizeof(uint8_t));
-  int remlen_len = decode_mbi(&data[1], remlen_offset);
+/******************************************************************************
+ * Handle MQTT packet too big to be received
+ *
+ * Buffer holds the packet head. QoS 1/2 PUBLISH are acknowledged anyway, the
+ * broker would resend them forever otherwise; the message is lost and
+ * reported as too large.
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+discard_packet(struct mqtt_connection *conn, uint8_t header, struct mqtt_buffer *buffer)
+{
+  enum mqtt_packet_type packet_type = header >> 4;
+  enum mqtt_qos qos = (header & 0x06) >> 1;
+  uint16_t packet_id = 0;
+  uint32_t id_offset;
+
+  if(packet_type == MQTT_PUBLISH && qos != MQTT_QOS_0 && buffer->offset >= 2)
+  {
+    // Packet id after topic
+    id_offset = 2 + decode_uint16(buffer->data, 0);
+    if(id_offset + 2 <= buffer->offset)
+    {
+      packet_id = decode_uint16(buffer->data, id_offset);
+      ack_send(conn, (qos == MQTT_QOS_1) ? MQTT_PUBACK : MQTT_PUBREC, packet_id);
+    }
+  }
+
+  report_reason(conn, packet_type, packet_id, MQTT_REASON_PACKET_TOO_LARGE);
+}
+
+/******************************************************************************
+ * Dispatch complete MQTT packet
+ *
+ * Buffer holds Variable header + Payload (offset == remaining length)
+ * Packets too short for their type are dropped (reported as malformed).
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+dispatch_packet(struct mqtt_connection *conn, uint8_t header, struct mqtt_buffer *buffer)
+{
+  // Packet type (upper nibble on 1st byte)
+  enum mqtt_packet_type packet_type = header >> 4;
 
-  // Buffer Variable header + Payload
-  write_buffer(&r_buffer, data + 1 + *remlen_offset, remlen_len);
+  if(buffer->offset < packet_min_length(packet_type))
+  {
+    report_reason(conn, packet_type, 0, MQTT_REASON_MALFORMED_PACKET);
+    return;
+  }
 
   // Callback
   switch (packet_type)
   {
     case MQTT_CONNACK:
-      handle_connack(conn, &r_buffer);
+      handle_connack(conn, buffer);
       break;
 
     case MQTT_PUBLISH:
-      handle_publish(conn, &r_buffer);
+      handle_publish(conn, header, buffer);
+      break;
+
+    case MQTT_PUBACK:
+      handle_puback(conn, buffer);
+      break;
+
+    case MQTT_PUBREC:
+      handle_pubrec(conn, buffer);
+      break;
+
+    case MQTT_PUBREL:
+      handle_pubrel(conn, buffer);
+      break;
+
+    case MQTT_PUBCOMP:
+      handle_pubcomp(conn, buffer);
       break;
 
     case MQTT_SUBACK:
-      handle_suback(conn, &r_buffer);
+      handle_suback(conn, buffer);
       break;
 
     case MQTT_UNSUBACK:
+      handle_unsuback(conn, buffer);
+      break;
+
+    case MQTT_DISCONNECT:
+      handle_disconnect(conn, buffer);
+      break;
+
     case MQTT_PINGRESP:
       // No action required
       break;
+
+    default:
+      break;
+  }
+}
+
+//
+// MQTT TOPIC HANDLES
+//
+
+/******************************************************************************
+ * Register topic for repeated publishes
+ *
+ * Topic is encoded once (length prefixed) together with the PUBLISH fixed
+ * header flags for "qos"/"retain". The 1st "%s" on "topic" (if any) is
+ * replaced by "arg" (e.g. "devices/%s/temperature" with the device id).
+ * Returns NULL if out of memory.
+ *
+ *******************************************************************************/
+struct mqtt_topic * ICACHE_FLASH_ATTR
+mqtt_topic_register(const char *topic, const char *arg, enum mqtt_qos qos, bool retain)
+{
+  struct mqtt_topic *handle;
+  const char *mark = (arg != NULL) ? (const char *) os_strstr(topic, "%s") : NULL;
+  uint16_t head_len, arg_len = 0;
+  uint16_t topic_len = os_strlen(topic);
+  uint8_t *data;
+
+  // Template expansion
+  head_len = topic_len;
+  if(mark != NULL)
+  {
+    head_len = mark - topic;
+    arg_len = os_strlen(arg);
+    topic_len = topic_len - 2 + arg_len;
+  }
+
+  // Single allocation (handle + encoded topic)
+  handle = (struct mqtt_topic *) os_malloc(sizeof(struct mqtt_topic) + 2 + topic_len);
+  if(handle == NULL)
+    return NULL;
+  handle->data = (uint8_t *) (handle + 1);
+  handle->len = 2 + topic_len;
+
+  // Encode topic
+  data = handle->data;
+  encode_uint16(topic_len, data, 0);
+  data += 2;
+  os_memcpy(data, topic, head_len);
+  if(mark != NULL)
+  {
+    os_memcpy(data + head_len, arg, arg_len);
+    os_memcpy(data + head_len + arg_len, mark + 2, topic_len - head_len - arg_len);
   }
 
-  os_free(remlen_offset);
-  os_free(r_buffer.data);
+  // Fixed header (dup set only on retransmissions)
+  const uint8_t dup = 0;
+  handle->fixed_hd = mqtt_header(MQTT_PUBLISH, dup, (qos >> 1), (qos & 0x01), (retain ? 1 : 0));
+
+  return handle;
+}
+
+/******************************************************************************
+ * Release registered topic
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_topic_unregister(struct mqtt_topic *topic)
+{
+  os_free(topic);
+}
+
+/******************************************************************************
+ * Gets id of inbound topic
+ *
+ * Topic is pinned on the intern table (never evicted), messages on it
+ * carry the returned "topic_id" so handlers can switch on it.
+ * Returns 0 if topic can't be interned (see MQTT_TOPIC_INTERN).
+ *
+ *******************************************************************************/
+uint16_t ICACHE_FLASH_ATTR
+mqtt_topic_id(struct mqtt_connection *conn, const char *topic)
+{
+  #if MQTT_TOPIC_INTERN
+  struct mqtt_interned_topic *interned = topic_intern(conn, (const uint8_t *) topic, os_strlen(topic), TRUE);
+  return (interned != NULL) ? interned->id : 0;
+  #else
+  (void) conn;
+  (void) topic;
+  return 0;
+  #endif
+}
+
+//
+// MQTT MESSAGES
+//
+
+/******************************************************************************
+ * Copy MQTT message
+ *
+ * Messages are only valid during the callback (see MQTT_ZERO_COPY and
+ * MQTT_TOPIC_INTERN), this makes a NULL terminated copy (single allocation,
+ * interned topics copied too) for retaining it.
+ *
+ *******************************************************************************/
+struct mqtt_message * ICACHE_FLASH_ATTR
+mqtt_message_copy(struct mqtt_message *message)
+{
+  uint32_t size = sizeof(struct mqtt_message) + message->topic_len + message->data_len + 2;
+  struct mqtt_message *copy = (struct mqtt_message *) pool_zalloc(size);
+  if(copy == NULL)
+    return NULL;
+
+  // Layout: struct | topic | '\0' | data | '\0'
+  copy->topic = (uint8_t *)(copy + 1);
+  copy->topic_len = message->topic_len;
+  os_memcpy(copy->topic, message->topic, message->topic_len);
+  copy->topic_id = message->topic_id;
+  copy->data = copy->topic + copy->topic_len + 1;
+  copy->data_len = message->data_len;
+  os_memcpy(copy->data, message->data, message->data_len);
+
+  return copy;
+}
+
+/******************************************************************************
+ * Release MQTT message copy
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_message_free(struct mqtt_message *message)
+{
+  pool_free(message);
+}
+
+//
+// MQTT STREAM PARSER
+//
+
+/******************************************************************************
+ * Reset MQTT stream parser
+ *
+ * Drops any partial packet (e.g. left from a previous connection)
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_parser_reset(struct mqtt_connection *conn)
+{
+  struct mqtt_parser *parser = &conn->parser;
+  parser->state = MQTT_PARSER_HEADER;
+  parser->header = 0;
+  parser->remlen_bytes = 0;
+  parser->remlen = 0;
+  parser->pending = 0;
+  reset_buffer(&parser->buffer);
+}
+
+/******************************************************************************
+ * Parses MQTT packets
+ *
+ * Incremental parser (fixed header -> remaining length -> body), it can be
+ * fed with any TCP segment: a packet split across several calls is resumed
+ * where it stopped and every complete packet on the segment is dispatched.
+ * Packets fully contained on the segment are dispatched without copy, only
+ * fragmented ones are gathered on the parser buffer (those bigger than
+ * MQTT_BUFFER_SIZE are discarded).
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_parse_packet(struct mqtt_connection *conn, uint8_t *data, int data_len)
+{
+  struct mqtt_parser *parser = &conn->parser;
+  struct mqtt_buffer view;
+  int offset = 0;
+  uint32_t chunk, room;
+  uint8_t digit;
+
+  if(parser->buffer.data == NULL)
+    mqtt_parser_reset(conn);
+
+  while(offset < data_len)
+  {
+    switch(parser->state)
+    {
+      case MQTT_PARSER_HEADER:
+        parser->header = data[offset++];
+        parser->remlen = 0;
+        parser->remlen_bytes = 0;
+        parser->state = MQTT_PARSER_REMLEN;
+        break;
+
+      case MQTT_PARSER_REMLEN:
+        // Multi-Byte Integer, one digit at time
+        digit = data[offset++];
+        parser->remlen |= (uint32_t)(digit & 0x7f) << (7 * parser->remlen_bytes);
+        ++parser->remlen_bytes;
+        if((digit & 0x80) != 0)
+        {
+          // Malformed (more than 4 bytes), resync on next byte
+          if(parser->remlen_bytes == 4)
+            parser->state = MQTT_PARSER_HEADER;
+          break;
+        }
+
+        reset_buffer(&parser->buffer);
+        parser->pending = parser->remlen;
+        parser->state = MQTT_PARSER_BODY;
+        // No Variable header/Payload (PINGRESP)
+        if(parser->pending == 0)
+        {
+          parser->state = MQTT_PARSER_HEADER;
+          dispatch_packet(conn, parser->header, &parser->buffer);
+        }
+        break;
+
+      case MQTT_PARSER_BODY:
+        chunk = data_len - offset;
+        if(chunk > parser->pending)
+          chunk = parser->pending;
+
+        // Whole body on this segment, dispatch in place (no copy, view
+        // length limited as buffer offsets)
+        if(parser->buffer.offset == 0 && chunk == parser->remlen && chunk <= 0xFFFF)
+        {
+          view.data = data + offset;
+          view.offset = chunk;
+          offset += chunk;
+          parser->pending = 0;
+          parser->state = MQTT_PARSER_HEADER;
+          dispatch_packet(conn, parser->header, &view);
+          break;
+        }
+
+        // Too big to be buffered (head kept while discarding)
+        if(parser->remlen > MQTT_BUFFER_SIZE)
+        {
+          parser->state = MQTT_PARSER_DISCARD;
+          break;
+        }
+
+        write_buffer(&parser->buffer, data + offset, chunk);
+        offset += chunk;
+        parser->pending -= chunk;
+        if(parser->pending == 0)
+        {
+          parser->state = MQTT_PARSER_HEADER;
+          dispatch_packet(conn, parser->header, &parser->buffer);
+        }
+        break;
+
+      case MQTT_PARSER_DISCARD:
+        chunk = data_len - offset;
+        if(chunk > parser->pending)
+          chunk = parser->pending;
+        // Packet head kept (as much as fits)
+        room = parser->buffer.size - parser->buffer.offset;
+        write_buffer(&parser->buffer, data + offset, (chunk < room) ? chunk : room);
+        offset += chunk;
+        parser->pending -= chunk;
+        if(parser->pending == 0)
+        {
+          parser->state = MQTT_PARSER_HEADER;
+          discard_packet(conn, parser->header, &parser->buffer);
+        }
+        break;
+    }
+  }
 }
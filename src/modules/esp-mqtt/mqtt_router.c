@@ -0,0 +1,805 @@
+#include <osapi.h>
+#include <mem.h>
+
+#include "modules/utils/hashtable.h"
+#include "modules/esp-mqtt/mqtt_router.h"
+
+//
+// FILTER LEVELS
+//
+
+/******************************************************************************
+ * Gets level length (up to next '/' or end)
+ *
+ *******************************************************************************/
+static uint16_t ICACHE_FLASH_ATTR
+level_length(const char *level, const char *end)
+{
+  const char *c = level;
+  while(c < end && *c != '/')
+    ++c;
+  return c - level;
+}
+
+/******************************************************************************
+ * Gets level length and hash (FNV-1a folded to 16 bits)
+ *
+ * Hash is compared before level names while looking up children.
+ *
+ *******************************************************************************/
+static uint16_t ICACHE_FLASH_ATTR
+level_scan(const char *level, const char *end, uint16_t *hash)
+{
+  const char *c = level;
+  uint32_t h = 2166136261u;
+  while(c < end && *c != '/')
+  {
+    h = (h ^ (uint8_t) *c) * 16777619u;
+    ++c;
+  }
+  *hash = (uint16_t) (h ^ (h >> 16));
+  return c - level;
+}
+
+/******************************************************************************
+ * Checks topic filter
+ *
+ * "+" and "#" must take a whole level, "#" only the last one
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+filter_valid(const char *filter, const char *end)
+{
+  const char *level = filter;
+  uint16_t len;
+
+  if(filter == end)
+    return FALSE;
+
+  while(TRUE)
+  {
+    len = level_length(level, end);
+    if(len > 1)
+    {
+      // Wildcards mixed with level name
+      const char *c;
+      for(c = level; c < level + len; c++)
+        if(*c == '+' || *c == '#')
+          return FALSE;
+    }
+    else if(len == 1 && *level == '#' && level + len != end)
+      return FALSE;
+
+    if(level + len == end)
+      return TRUE;
+    level += len + 1;
+  }
+}
+
+//
+// TRIE NODES
+//
+
+/******************************************************************************
+ * Finds exact level child (binary search on level hash)
+ *
+ * Returns child or NULL, "pos" gets the insertion position
+ *
+ *******************************************************************************/
+static struct mqtt_route_node * ICACHE_FLASH_ATTR
+child_find(const struct mqtt_route_node *node, const char *level, uint16_t len, uint16_t hash, uint16_t *pos)
+{
+  struct mqtt_route_node *child;
+  uint16_t low = 0;
+  uint16_t high = node->children_cnt;
+  uint16_t mid;
+
+  while(low < high)
+  {
+    mid = (low + high) / 2;
+    if(node->children[mid]->level_hash < hash)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  *pos = low;
+
+  // Same hash levels are adjacent
+  for(; low < node->children_cnt && node->children[low]->level_hash == hash; low++)
+  {
+    child = node->children[low];
+    if(child->level_len == len && os_memcmp(child->level, level, len) == 0)
+      return child;
+  }
+  return NULL;
+}
+
+/******************************************************************************
+ * Gets child node for level (created if "create" set)
+ *
+ *******************************************************************************/
+static struct mqtt_route_node * ICACHE_FLASH_ATTR
+node_child(struct mqtt_route_node *node, const char *level, const char *end, bool create)
+{
+  struct mqtt_route_node **slot = NULL;
+  struct mqtt_route_node *child;
+  uint16_t hash, pos;
+  const uint16_t len = level_scan(level, end, &hash);
+
+  if(len == 1 && *level == '+')
+    slot = &node->plus;
+  else if(len == 1 && *level == '#')
+    slot = &node->hash;
+
+  if(slot != NULL)
+    child = *slot;
+  else
+    child = child_find(node, level, len, hash, &pos);
+  if(child != NULL || !create)
+    return child;
+
+  // Room for exact level
+  if(slot == NULL && node->children_cnt == node->children_size)
+  {
+    const uint16_t size = (node->children_size == 0) ? 2 : node->children_size * 2;
+    struct mqtt_route_node **children = (struct mqtt_route_node **) os_malloc(size * sizeof(*children));
+    if(children == NULL)
+      return NULL;
+    if(node->children != NULL)
+    {
+      os_memcpy(children, node->children, node->children_cnt * sizeof(*children));
+      os_free(node->children);
+    }
+    node->children = children;
+    node->children_size = size;
+  }
+
+  // Single allocation (node + level name)
+  child = (struct mqtt_route_node *) os_zalloc(sizeof(struct mqtt_route_node) + len);
+  if(child == NULL)
+    return NULL;
+  child->level = (char *) (child + 1);
+  child->level_len = len;
+  child->level_hash = hash;
+  os_memcpy(child->level, level, len);
+
+  if(slot != NULL)
+    *slot = child;
+  else
+  {
+    os_memmove(&node->children[pos + 1], &node->children[pos], (node->children_cnt - pos) * sizeof(*node->children));
+    node->children[pos] = child;
+    ++node->children_cnt;
+  }
+  return child;
+}
+
+/******************************************************************************
+ * Checks node is useless (no handler, no children)
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+node_empty(const struct mqtt_route_node *node)
+{
+  return node->cb == NULL && node->children_cnt == 0 && node->plus == NULL && node->hash == NULL;
+}
+
+/******************************************************************************
+ * Releases all nodes below node
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+node_free_children(struct mqtt_route_node *node)
+{
+  uint16_t i;
+
+  for(i = 0; i < node->children_cnt; i++)
+  {
+    node_free_children(node->children[i]);
+    os_free(node->children[i]);
+  }
+  if(node->children != NULL)
+    os_free(node->children);
+  if(node->plus != NULL)
+  {
+    node_free_children(node->plus);
+    os_free(node->plus);
+  }
+  if(node->hash != NULL)
+  {
+    node_free_children(node->hash);
+    os_free(node->hash);
+  }
+  node->children = NULL;
+  node->children_cnt = 0;
+  node->children_size = 0;
+  node->plus = NULL;
+  node->hash = NULL;
+}
+
+/******************************************************************************
+ * Removes filter handler below node, prunes emptied nodes
+ *
+ * Returns TRUE if filter was found
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+node_remove(struct mqtt_route_node *node, const char *level, const char *end)
+{
+  struct mqtt_route_node *child;
+  const uint16_t len = level_length(level, end);
+  uint16_t i;
+  bool found;
+
+  child = node_child(node, level, end, FALSE);
+  if(child == NULL)
+    return FALSE;
+
+  if(level + len == end)
+  {
+    found = (child->cb != NULL);
+    child->cb = NULL;
+  }
+  else
+    found = node_remove(child, level + len + 1, end);
+
+  if(!node_empty(child))
+    return found;
+
+  // Unlink
+  if(child == node->plus)
+    node->plus = NULL;
+  else if(child == node->hash)
+    node->hash = NULL;
+  else
+  {
+    for(i = 0; node->children[i] != child; i++);
+    os_memmove(&node->children[i], &node->children[i + 1], (node->children_cnt - i - 1) * sizeof(*node->children));
+    if(--node->children_cnt == 0)
+    {
+      os_free(node->children);
+      node->children = NULL;
+      node->children_size = 0;
+    }
+  }
+  node_free_children(child);
+  os_free(child);
+  return found;
+}
+
+//
+// MATCHING
+//
+
+/******************************************************************************
+ * Collects matching filter
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+matches_add(struct mqtt_route_matches *matches, struct mqtt_route_node *node)
+{
+  if(node->cb != NULL && matches->count < matches->max)
+  {
+    matches->routes[matches->count++] = node;
+    matches->flags |= node->flags;
+  }
+}
+
+/******************************************************************************
+ * Matches topic levels below node
+ *
+ * "level" is NULL once all topic levels are consumed, recursion depth is
+ * bounded by the deepest filter (not by the topic).
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+node_match(struct mqtt_route_node *node, const char *level, const char *end, bool first,
+           struct mqtt_route_matches *matches)
+{
+  struct mqtt_route_node *child;
+  const char *next;
+  uint16_t len, hash, pos;
+
+  if(level == NULL)
+  {
+    matches_add(matches, node);
+    // "a/#" matches "a" too (parent level)
+    if(node->hash != NULL)
+      matches_add(matches, node->hash);
+    return;
+  }
+
+  // Wildcards on 1st level never match "$" topics (e.g. "$SYS")
+  const bool wildcards = !(first && *level == '$');
+
+  if(wildcards && node->hash != NULL)
+    matches_add(matches, node->hash);
+
+  len = level_scan(level, end, &hash);
+  next = (level + len < end) ? level + len + 1 : NULL;
+
+  child = child_find(node, level, len, hash, &pos);
+  if(child != NULL)
+    node_match(child, next, end, FALSE, matches);
+
+  if(wildcards && node->plus != NULL)
+    node_match(node->plus, next, end, FALSE, matches);
+}
+
+//
+// OVERLAPS
+//
+
+/******************************************************************************
+ * Counts filter ending on node as overlapping one (unless it is "self")
+ *
+ *******************************************************************************/
+static uint8_t ICACHE_FLASH_ATTR
+route_overlap(struct mqtt_route_node *node, const struct mqtt_route_node *self, int8_t delta)
+{
+  if(node->cb == NULL || node == self)
+    return 0;
+  node->stats.overlaps += delta;
+  return 1;
+}
+
+/******************************************************************************
+ * Counts filters ending on node or below
+ *
+ *******************************************************************************/
+static uint8_t ICACHE_FLASH_ATTR
+subtree_overlap(struct mqtt_route_node *node, const struct mqtt_route_node *self, int8_t delta)
+{
+  uint8_t count = route_overlap(node, self, delta);
+  uint16_t i;
+
+  for(i = 0; i < node->children_cnt; i++)
+    count += subtree_overlap(node->children[i], self, delta);
+  if(node->plus != NULL)
+    count += subtree_overlap(node->plus, self, delta);
+  if(node->hash != NULL)
+    count += subtree_overlap(node->hash, self, delta);
+  return count;
+}
+
+/******************************************************************************
+ * Checks node level starts with "$" (1st level wildcards don't match it)
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+node_dollar(const struct mqtt_route_node *node)
+{
+  return node->level_len > 0 && *node->level == '$';
+}
+
+/******************************************************************************
+ * Counts filters below node matching some topic in common with filter
+ * levels, "delta" is applied to their overlap counters.
+ *
+ * "level" is NULL once all filter levels are consumed
+ *
+ *******************************************************************************/
+static uint8_t ICACHE_FLASH_ATTR
+node_overlap(struct mqtt_route_node *node, const char *level, const char *end, bool first,
+             const struct mqtt_route_node *self, int8_t delta)
+{
+  struct mqtt_route_node *child;
+  const char *next;
+  uint16_t len, hash, pos, i;
+  uint8_t count = 0;
+  bool dollar;
+
+  if(level == NULL)
+  {
+    count += route_overlap(node, self, delta);
+    // "a/#" matches "a" too
+    if(node->hash != NULL)
+      count += route_overlap(node->hash, self, delta);
+    return count;
+  }
+
+  len = level_scan(level, end, &hash);
+  next = (level + len < end) ? level + len + 1 : NULL;
+
+  // Filter "#": node level and all below ("$" levels excluded on 1st level)
+  if(len == 1 && *level == '#')
+  {
+    if(!first)
+      return subtree_overlap(node, self, delta);
+    for(i = 0; i < node->children_cnt; i++)
+      if(!node_dollar(node->children[i]))
+        count += subtree_overlap(node->children[i], self, delta);
+    if(node->plus != NULL)
+      count += subtree_overlap(node->plus, self, delta);
+    if(node->hash != NULL)
+      count += subtree_overlap(node->hash, self, delta);
+    return count;
+  }
+
+  // Wildcards on 1st level never match "$" topics
+  dollar = (first && len > 0 && *level == '$');
+  if(node->hash != NULL && !dollar)
+    count += route_overlap(node->hash, self, delta);
+  if(len == 1 && *level == '+')
+  {
+    for(i = 0; i < node->children_cnt; i++)
+      if(!first || !node_dollar(node->children[i]))
+        count += node_overlap(node->children[i], next, end, FALSE, self, delta);
+  }
+  else
+  {
+    child = child_find(node, level, len, hash, &pos);
+    if(child != NULL)
+      count += node_overlap(child, next, end, FALSE, self, delta);
+  }
+  if(node->plus != NULL && !dollar)
+    count += node_overlap(node->plus, next, end, FALSE, self, delta);
+  return count;
+}
+
+#if MQTT_ROUTER_CACHE_SIZE
+//
+// MATCH CACHE
+//
+
+/******************************************************************************
+ * Gets cached match result of topic (NULL if not cached)
+ *
+ *******************************************************************************/
+static struct mqtt_route_cache * ICACHE_FLASH_ATTR
+cache_lookup(struct mqtt_router *router, const char *topic, uint16_t topic_len, uint32_t hash)
+{
+  struct mqtt_route_cache *entry = &router->cache[hash % MQTT_ROUTER_CACHE_SIZE];
+
+  if(entry->hash == hash && entry->topic_len == topic_len && os_memcmp(entry->topic, topic, topic_len) == 0)
+    return entry;
+  return NULL;
+}
+
+/******************************************************************************
+ * Caches match result of topic (replaces older topic on same entry)
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+cache_store(struct mqtt_router *router, const char *topic, uint16_t topic_len, uint32_t hash,
+            struct mqtt_route_node *routes[], uint8_t routes_cnt, uint8_t flags)
+{
+  struct mqtt_route_cache *entry = &router->cache[hash % MQTT_ROUTER_CACHE_SIZE];
+
+  entry->hash = hash;
+  entry->topic_len = topic_len;
+  entry->routes_cnt = routes_cnt;
+  entry->flags = flags;
+  os_memcpy(entry->topic, topic, topic_len);
+  os_memcpy(entry->routes, routes, routes_cnt * sizeof(*routes));
+}
+#endif
+
+//
+// STATIC ROUTES
+//
+
+/******************************************************************************
+ * Gets static route of filter (NULL if not on table)
+ *
+ *******************************************************************************/
+static struct mqtt_route_node * ICACHE_FLASH_ATTR
+table_route(struct mqtt_router *router, const char *filter)
+{
+  const struct mqtt_route_table *table = router->table;
+  uint8_t i;
+
+  if(table == NULL)
+    return NULL;
+  for(i = 0; i < table->subs_cnt; i++)
+    if(os_strcmp(table->subs[i].topic, filter) == 0)
+      return &table->routes[i];
+  return NULL;
+}
+
+/******************************************************************************
+ * Gets topic level length and hash (as trie levels)
+ *
+ *******************************************************************************/
+uint16_t ICACHE_FLASH_ATTR
+mqtt_router_level(const char *level, const char *end, uint16_t *hash)
+{
+  return level_scan(level, end, hash);
+}
+
+/******************************************************************************
+ * Compares topic level with level name kept in flash
+ *
+ * Flash is read as aligned words only (byte reads fault), "name" packs
+ * level characters little endian.
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+mqtt_router_level_is(const char *level, uint16_t len, const uint32_t *name, uint16_t name_len)
+{
+  uint32_t word = 0;
+  uint16_t i;
+
+  if(len != name_len)
+    return FALSE;
+  for(i = 0; i < len; i++)
+  {
+    if((i & 3) == 0)
+      word = name[i >> 2];
+    if((uint8_t) level[i] != ((word >> ((i & 3) * 8)) & 0xFF))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/******************************************************************************
+ * Collects matching static route (skipped while it has no handler)
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_router_collect(struct mqtt_route_matches *matches, struct mqtt_route_node *route)
+{
+  matches_add(matches, route);
+}
+
+//
+// ROUTER
+//
+
+/******************************************************************************
+ * Adds topic filter handler
+ *
+ * Filter is compiled into trie levels (copied), an existing handler for the
+ * same filter is replaced. "flags" (MQTT_ROUTE_*) are reported by matches.
+ * Overlap counters of new filter and the ones it overlaps are updated.
+ * Filters of the static table just get handler and flags.
+ * Returns FALSE for invalid filters or out of memory.
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+mqtt_router_add(struct mqtt_router *router, const char *filter,
+                void (*cb)(struct mqtt_connection *, struct mqtt_message *), uint8_t flags)
+{
+  struct mqtt_route_node *node = table_route(router, filter);
+  const char *end = filter + os_strlen(filter);
+  const char *level = filter;
+  uint32_t plus_levels = 0;
+  uint8_t specificity = 0;
+  uint8_t levels = 0;
+  uint16_t len;
+
+  if(cb == NULL || !filter_valid(filter, end))
+    return FALSE;
+
+  if(node != NULL)
+  {
+    node->cb = cb;
+    node->flags = flags;
+    mqtt_router_invalidate(router);
+    return TRUE;
+  }
+
+  node = &router->root;
+  while(TRUE)
+  {
+    len = level_length(level, end);
+    node = node_child(node, level, end, TRUE);
+    if(node == NULL)
+      return FALSE;
+    if(len != 1 || (*level != '+' && *level != '#'))
+      specificity += 2;
+    else if(*level == '+')
+    {
+      ++specificity;
+      if(levels < 32)
+        plus_levels |= (uint32_t) 1 << levels;
+    }
+    ++levels;
+    if(level + len == end)
+      break;
+    level += len + 1;
+  }
+
+  // New filter
+  if(node->cb == NULL)
+  {
+    os_memset(&node->stats, 0, sizeof(node->stats));
+    node->stats.overlaps = node_overlap(&router->root, filter, end, TRUE, node, 1);
+  }
+  node->cb = cb;
+  node->flags = flags;
+  node->specificity = specificity;
+  node->levels = levels;
+  node->plus_levels = plus_levels;
+  mqtt_router_invalidate(router);
+  return TRUE;
+}
+
+/******************************************************************************
+ * Removes topic filter handler
+ *
+ * Returns FALSE if filter had no handler
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+mqtt_router_remove(struct mqtt_router *router, const char *filter)
+{
+  const char *end = filter + os_strlen(filter);
+  struct mqtt_route_node *node = mqtt_router_find(router, filter);
+
+  if(node == NULL)
+    return FALSE;
+  if(node == table_route(router, filter))
+  {
+    node->cb = NULL;
+    mqtt_router_invalidate(router);
+    return TRUE;
+  }
+  node_overlap(&router->root, filter, end, TRUE, node, -1);
+  mqtt_router_invalidate(router);
+  return node_remove(&router->root, filter, end);
+}
+
+/******************************************************************************
+ * Gets filter route (handler, flags and counters), NULL if not added
+ *
+ *******************************************************************************/
+struct mqtt_route_node * ICACHE_FLASH_ATTR
+mqtt_router_find(struct mqtt_router *router, const char *filter)
+{
+  struct mqtt_route_node *node = table_route(router, filter);
+  const char *end = filter + os_strlen(filter);
+  const char *level = filter;
+  uint16_t len;
+
+  if(node != NULL)
+    return (node->cb != NULL) ? node : NULL;
+  if(filter == end)
+    return NULL;
+
+  node = &router->root;
+  while(TRUE)
+  {
+    len = level_length(level, end);
+    node = node_child(node, level, end, FALSE);
+    if(node == NULL)
+      return NULL;
+    if(level + len == end)
+      return (node->cb != NULL) ? node : NULL;
+    level += len + 1;
+  }
+}
+
+/******************************************************************************
+ * Matches topic against all filters
+ *
+ * Routes of matching filters are written to "routes" (up to "max") and
+ * their flags merged on "flags". Returns routes written.
+ * Topics up to MQTT_ROUTER_CACHE_TOPIC long are resolved from cache when
+ * seen since last filter change. With static routes only, nothing is
+ * cached (generated matching takes about the same time for any topic).
+ *
+ *******************************************************************************/
+uint8_t ICACHE_FLASH_ATTR
+mqtt_router_match(struct mqtt_router *router, const char *topic, uint16_t topic_len,
+                  struct mqtt_route_node *routes[], uint8_t max, uint8_t *flags)
+{
+  struct mqtt_route_matches matches = {routes, max, 0, 0};
+
+  // Topic names have at least one character
+  *flags = 0;
+  if(topic_len == 0)
+    return 0;
+
+  if(router->table != NULL && node_empty(&router->root))
+  {
+    router->table->match(topic, topic + topic_len, &matches);
+    *flags = matches.flags;
+    return matches.count;
+  }
+
+  #if MQTT_ROUTER_CACHE_SIZE
+  const bool cacheable = (topic_len <= MQTT_ROUTER_CACHE_TOPIC && max >= MQTT_ROUTER_MAX_MATCHES);
+  const uint32_t hash = cacheable ? hash_string(topic, topic_len) : 0;
+  struct mqtt_route_cache *entry = cacheable ? cache_lookup(router, topic, topic_len, hash) : NULL;
+  if(entry != NULL)
+  {
+    ++router->stats.hits;
+    os_memcpy(routes, entry->routes, entry->routes_cnt * sizeof(*routes));
+    *flags = entry->flags;
+    return entry->routes_cnt;
+  }
+  #endif
+
+  ++router->stats.misses;
+  if(router->table != NULL)
+    router->table->match(topic, topic + topic_len, &matches);
+  node_match(&router->root, topic, topic + topic_len, TRUE, &matches);
+
+  #if MQTT_ROUTER_CACHE_SIZE
+  if(cacheable)
+    cache_store(router, topic, topic_len, hash, routes, matches.count, matches.flags);
+  #endif
+  *flags = matches.flags;
+  return matches.count;
+}
+
+/******************************************************************************
+ * Gets topic parts taken by route wildcards
+ *
+ * One capture per "+" level and one for the "#" tail (empty when "a/#"
+ * matches "a"), in filter order, offsets relative to "topic". The topic
+ * is scanned up to the last wildcard level only. Returns captures written
+ * (up to "max").
+ *
+ *******************************************************************************/
+uint8_t ICACHE_FLASH_ATTR
+mqtt_router_captures(const struct mqtt_route_node *route, const char *topic, uint16_t topic_len,
+                     struct mqtt_capture captures[], uint8_t max)
+{
+  const char *end = topic + topic_len;
+  const char *level = topic;
+  const bool tail = (route->level_len == 1 && *route->level == '#');
+  uint32_t plus = route->plus_levels;
+  uint8_t count = 0;
+  uint8_t i = 0;
+  uint16_t len;
+
+  while(count < max && (plus != 0 || tail))
+  {
+    if(tail && i == route->levels - 1)
+    {
+      captures[count].offset = level - topic;
+      captures[count++].len = end - level;
+      break;
+    }
+
+    len = level_length(level, end);
+    if(plus & 1)
+    {
+      captures[count].offset = level - topic;
+      captures[count++].len = len;
+    }
+    plus >>= 1;
+    ++i;
+
+    if(level + len < end)
+      level += len + 1;
+    else
+    {
+      // Topic ends here, only a "#" tail can follow
+      level = end;
+      if(!tail || i != route->levels - 1)
+        break;
+    }
+  }
+  return count;
+}
+
+/******************************************************************************
+ * Drops cached match results
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_router_invalidate(struct mqtt_router *router)
+{
+  #if MQTT_ROUTER_CACHE_SIZE
+  uint8_t i;
+  for(i = 0; i < MQTT_ROUTER_CACHE_SIZE; i++)
+    router->cache[i].hash = 0;
+  #else
+  (void) router;
+  #endif
+}
+
+/******************************************************************************
+ * Removes all filters (static routes are kept)
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+mqtt_router_clear(struct mqtt_router *router)
+{
+  node_free_children(&router->root);
+  router->root.cb = NULL;
+  mqtt_router_invalidate(router);
+}
@@ -1,66 +1,265 @@
+#include <osapi.h>
 #include <mem.h>
 
+#include "modules/utils/pool.h"
 #include "modules/utils/hashtable.h"
 
-/**
- *  Adapted from:
+#define hash_slot(h, hash)          ((hash) & ((h)->size - 1))
+#define hash_distance(h, hash, i)   (((i) + (h)->size - hash_slot(h, hash)) & ((h)->size - 1))
+
+/******************************************************************************
+ * Hash key (FNV-1a, never 0 as it marks free slots).
  *
- *  https://rosettacode.org/wiki/Associative_arrays/Creation/C
- */
+ *******************************************************************************/
+uint32_t ICACHE_FLASH_ATTR
+hash_string(const char *key, uint16_t key_len)
+{
+    uint32_t hash = 2166136261u;
+    uint16_t i;
 
-hash_t * ICACHE_FLASH_ATTR
-hash_create(int size) {
-    hash_t *h = os_calloc(1, sizeof (hash_t));
-    h->keys = os_calloc(size, sizeof (void *));
-    h->values = os_calloc(size, sizeof (void *));
-    h->size = size;
-    return h;
+    for(i = 0; i < key_len; ++i)
+        hash = (hash ^ (uint8_t) key[i]) * 16777619u;
+    return (hash != 0) ? hash : 1;
 }
 
-int ICACHE_FLASH_ATTR
-hash_index(hash_t *h, void *key)
+/******************************************************************************
+ * Allocate slot arrays.
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+hash_alloc(hash_t *h, uint16_t size)
 {
-    int i = (int) key % h->size;
-    while (h->keys[i] && h->keys[i] != key)
-        i = (i + 1) % h->size;
-    return i;
+    h->hashes = (uint32_t *) os_zalloc(size * sizeof(uint32_t));
+    h->keys = (char **) os_malloc(size * sizeof(char *));
+    h->key_lens = (uint16_t *) os_malloc(size * sizeof(uint16_t));
+    h->values = (void **) os_malloc(size * sizeof(void *));
+    if(h->hashes == NULL || h->keys == NULL || h->key_lens == NULL || h->values == NULL)
+    {
+        if(h->hashes != NULL)
+            os_free(h->hashes);
+        if(h->keys != NULL)
+            os_free(h->keys);
+        if(h->key_lens != NULL)
+            os_free(h->key_lens);
+        if(h->values != NULL)
+            os_free(h->values);
+        return FALSE;
+    }
+    h->size = size;
+    h->count = 0;
+    return TRUE;
 }
 
-void ICACHE_FLASH_ATTR
-hash_insert(hash_t *h, void *key, void *value)
+/******************************************************************************
+ * Place entry (Robin Hood: entries closer to their home slot give way).
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+hash_place(hash_t *h, uint32_t hash, char *key, uint16_t key_len, void *value)
 {
-    int i = hash_index(h, key);
+    uint16_t i = hash_slot(h, hash);
+    uint16_t dist = 0;
+
+    while(h->hashes[i] != 0)
+    {
+        uint16_t other = hash_distance(h, h->hashes[i], i);
+        if(other < dist)
+        {
+            // Swap and keep placing the evicted entry
+            uint32_t t_hash = h->hashes[i];
+            char *t_key = h->keys[i];
+            uint16_t t_len = h->key_lens[i];
+            void *t_value = h->values[i];
+            h->hashes[i] = hash;
+            h->keys[i] = key;
+            h->key_lens[i] = key_len;
+            h->values[i] = value;
+            hash = t_hash;
+            key = t_key;
+            key_len = t_len;
+            value = t_value;
+            dist = other;
+        }
+        i = (i + 1) & (h->size - 1);
+        ++dist;
+    }
+
+    h->hashes[i] = hash;
     h->keys[i] = key;
+    h->key_lens[i] = key_len;
     h->values[i] = value;
+    ++h->count;
 }
 
-void* ICACHE_FLASH_ATTR
-hash_lookup(hash_t *h, void *key)
+/******************************************************************************
+ * Find key slot (-1 if missing).
+ *
+ *******************************************************************************/
+static int32_t ICACHE_FLASH_ATTR
+hash_find(hash_t *h, const char *key, uint16_t key_len, uint32_t hash)
 {
-    int i = hash_index(h, key);
-    return h->values[i];
+    uint16_t i = hash_slot(h, hash);
+    uint16_t dist = 0;
+
+    // Stops on free slot or once entries are closer to home than key would be
+    while(h->hashes[i] != 0 && hash_distance(h, h->hashes[i], i) >= dist)
+    {
+        if(h->hashes[i] == hash && h->key_lens[i] == key_len && os_memcmp(h->keys[i], key, key_len) == 0)
+            return i;
+        i = (i + 1) & (h->size - 1);
+        ++dist;
+    }
+    return -1;
 }
 
-void ICACHE_FLASH_ATTR
-hash_delete(hash_t *h, void *key)
+/******************************************************************************
+ * Double slots and re-place entries (cached hashes, keys not rehashed).
+ *
+ *******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+hash_grow(hash_t *h)
 {
-    int i = hash_index(h, key);
-    if(h->values[i] != NULL)
+    hash_t old = *h;
+    uint16_t i;
+
+    if(old.size >= 0x8000 || !hash_alloc(h, old.size * 2))
     {
-      h->keys[i] = NULL;
-      h->values[i] = NULL;
+        *h = old;
+        return FALSE;
     }
+
+    for(i = 0; i < old.size; ++i)
+        if(old.hashes[i] != 0)
+            hash_place(h, old.hashes[i], old.keys[i], old.key_lens[i], old.values[i]);
+
+    os_free(old.hashes);
+    os_free(old.keys);
+    os_free(old.key_lens);
+    os_free(old.values);
+    return TRUE;
 }
 
-bool ICACHE_FLASH_ATTR
-hash_is_empty(hash_t *h)
+/******************************************************************************
+ * Create table for about "size" entries.
+ *
+ *******************************************************************************/
+hash_t * ICACHE_FLASH_ATTR
+hash_create(int size)
+{
+    uint16_t slots = HASH_MIN_SIZE;
+    hash_t *h = (hash_t *) os_zalloc(sizeof(hash_t));
+
+    if(h == NULL)
+        return NULL;
+    while(slots < 0x8000 && slots * HASH_LOAD_FACTOR < size * 100)
+        slots *= 2;
+    if(!hash_alloc(h, slots))
+    {
+        os_free(h);
+        return NULL;
+    }
+    return h;
+}
+
+/******************************************************************************
+ * Release table and key copies.
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+hash_destroy(hash_t *h)
 {
-    uint8_t i = 0;
+    uint16_t i;
 
+    if(h == NULL)
+        return;
     for(i = 0; i < h->size; ++i)
+        if(h->hashes[i] != 0)
+            pool_free(h->keys[i]);
+    os_free(h->hashes);
+    os_free(h->keys);
+    os_free(h->key_lens);
+    os_free(h->values);
+    os_free(h);
+}
+
+/******************************************************************************
+ * Insert or replace key value.
+ *
+ * Returns FALSE when out of memory.
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+hash_insert(hash_t *h, const char *key, uint16_t key_len, void *value)
+{
+    const uint32_t hash = hash_string(key, key_len);
+    int32_t i = hash_find(h, key, key_len, hash);
+    char *copy;
+
+    if(i >= 0)
     {
-      if(h->values[i] != NULL)
+        h->values[i] = value;
+        return TRUE;
+    }
+
+    if((h->count + 1) * 100 > h->size * HASH_LOAD_FACTOR && !hash_grow(h))
+        return FALSE;
+
+    copy = (char *) pool_alloc(key_len > 0 ? key_len : 1);
+    if(copy == NULL)
+        return FALSE;
+    os_memcpy(copy, key, key_len);
+    hash_place(h, hash, copy, key_len, value);
+    return TRUE;
+}
+
+/******************************************************************************
+ * Get key value (NULL if missing).
+ *
+ *******************************************************************************/
+void* ICACHE_FLASH_ATTR
+hash_lookup(hash_t *h, const char *key, uint16_t key_len)
+{
+    int32_t i = hash_find(h, key, key_len, hash_string(key, key_len));
+    return (i >= 0) ? h->values[i] : NULL;
+}
+
+/******************************************************************************
+ * Remove key, following entries shift back one slot.
+ *
+ * Returns FALSE if key was missing.
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+hash_delete(hash_t *h, const char *key, uint16_t key_len)
+{
+    int32_t i = hash_find(h, key, key_len, hash_string(key, key_len));
+    uint16_t next;
+
+    if(i < 0)
         return FALSE;
+    pool_free(h->keys[i]);
+
+    next = (i + 1) & (h->size - 1);
+    while(h->hashes[next] != 0 && hash_distance(h, h->hashes[next], next) > 0)
+    {
+        h->hashes[i] = h->hashes[next];
+        h->keys[i] = h->keys[next];
+        h->key_lens[i] = h->key_lens[next];
+        h->values[i] = h->values[next];
+        i = next;
+        next = (next + 1) & (h->size - 1);
     }
+    h->hashes[i] = 0;
+    --h->count;
     return TRUE;
-}
\ No newline at end of file
+}
+
+/******************************************************************************
+ * Check table has no entries.
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+hash_is_empty(hash_t *h)
+{
+    return h->count == 0;
+}
@@ -0,0 +1,149 @@
+#include <osapi.h>
+#include <mem.h>
+
+#include "modules/utils/pool.h"
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+struct pool_class {
+    uint8_t *start;
+    uint8_t *end;
+    struct pool_block *free;
+    pool_stats_t stats;
+};
+
+// Blocks storage (word aligned)
+static uint32_t arena[POOL_ARENA_SIZE / sizeof(uint32_t)];
+
+static struct pool_class classes[POOL_CLASSES] = {
+    { .stats = { POOL_CLASS_0_SIZE, POOL_CLASS_0_COUNT } },
+    { .stats = { POOL_CLASS_1_SIZE, POOL_CLASS_1_COUNT } },
+    { .stats = { POOL_CLASS_2_SIZE, POOL_CLASS_2_COUNT } },
+    { .stats = { POOL_CLASS_3_SIZE, POOL_CLASS_3_COUNT } }
+};
+
+static bool ready = FALSE;
+
+/******************************************************************************
+ * Carve arena into class free lists.
+ *
+ *******************************************************************************/
+static void ICACHE_FLASH_ATTR
+pool_init(void)
+{
+    uint8_t *block = (uint8_t *) arena;
+    uint8_t i;
+    uint16_t j;
+
+    for(i = 0; i < POOL_CLASSES; ++i)
+    {
+        struct pool_class *cls = &classes[i];
+        cls->start = block;
+        cls->free = NULL;
+        for(j = 0; j < cls->stats.count; ++j)
+        {
+            struct pool_block *b = (struct pool_block *) block;
+            b->next = cls->free;
+            cls->free = b;
+            block += cls->stats.size;
+        }
+        cls->end = block;
+    }
+    ready = TRUE;
+}
+
+/******************************************************************************
+ * Allocate block (O(1), larger classes when the fitting one is exhausted,
+ * heap when no class can serve it).
+ *
+ *******************************************************************************/
+void* ICACHE_FLASH_ATTR
+pool_alloc(uint32_t size)
+{
+    struct pool_class *fit = NULL;
+    uint8_t i;
+
+    if(!ready)
+        pool_init();
+
+    for(i = 0; i < POOL_CLASSES; ++i)
+    {
+        struct pool_class *cls = &classes[i];
+        if(size > cls->stats.size)
+            continue;
+
+        if(fit == NULL)
+            fit = cls;
+        if(cls->free == NULL)
+            continue;
+
+        struct pool_block *b = cls->free;
+        cls->free = b->next;
+        if(++cls->stats.used > cls->stats.high_water)
+            cls->stats.high_water = cls->stats.used;
+        if(cls != fit)
+            ++fit->stats.borrowed;
+        return b;
+    }
+
+    if(fit != NULL)
+        ++fit->stats.fallbacks;
+    return os_malloc(size);
+}
+
+/******************************************************************************
+ * Allocate zeroed block.
+ *
+ *******************************************************************************/
+void* ICACHE_FLASH_ATTR
+pool_zalloc(uint32_t size)
+{
+    void *ptr = pool_alloc(size);
+    if(ptr != NULL)
+        os_memset(ptr, 0, size);
+    return ptr;
+}
+
+/******************************************************************************
+ * Release block (O(1), heap pointers are released to heap).
+ *
+ *******************************************************************************/
+void ICACHE_FLASH_ATTR
+pool_free(void *ptr)
+{
+    uint8_t i;
+
+    if(ptr == NULL)
+        return;
+
+    for(i = 0; i < POOL_CLASSES && ready; ++i)
+    {
+        struct pool_class *cls = &classes[i];
+        if((uint8_t *) ptr < cls->start || (uint8_t *) ptr >= cls->end)
+            continue;
+
+        struct pool_block *b = (struct pool_block *) ptr;
+        b->next = cls->free;
+        cls->free = b;
+        --cls->stats.used;
+        return;
+    }
+
+    os_free(ptr);
+}
+
+/******************************************************************************
+ * Read class occupancy counters.
+ *
+ *******************************************************************************/
+bool ICACHE_FLASH_ATTR
+pool_stats(uint8_t cls, pool_stats_t *stats)
+{
+    if(cls >= POOL_CLASSES)
+        return FALSE;
+
+    *stats = classes[cls].stats;
+    return TRUE;
+}
@@ -0,0 +1,119 @@
+#include <string.h>
+#include <time.h>
+#include <mem.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/utils/hashtable.h"
+
+// Lookups per run
+#define BENCH_LOOKUPS   1000000
+
+//
+// BASELINE
+//
+
+// Previous table (pointer keys, linear probing on key % size)
+typedef struct {
+  int size;
+  void **keys;
+  void **values;
+} ptr_hash_t;
+
+static int
+ptr_hash_index(ptr_hash_t *h, void *key)
+{
+  int i = (int) ((uintptr_t) key % h->size);
+  while(h->keys[i] && h->keys[i] != key)
+    i = (i + 1) % h->size;
+  return i;
+}
+
+static void
+ptr_hash_insert(ptr_hash_t *h, void *key, void *value)
+{
+  int i = ptr_hash_index(h, key);
+  h->keys[i] = key;
+  h->values[i] = value;
+}
+
+static void *
+ptr_hash_lookup(ptr_hash_t *h, void *key)
+{
+  return h->values[ptr_hash_index(h, key)];
+}
+
+//
+// RUNS
+//
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Topics as interned (keys) and as received (same text, other buffer)
+static void
+bench(uint16_t n)
+{
+  static char keys[1024][24], received[1024][24];
+  ptr_hash_t ptr = {2 * n, os_zalloc(2 * n * sizeof(void *)), os_zalloc(2 * n * sizeof(void *))};
+  hash_t *h = hash_create(n);
+  volatile uintptr_t sink = 0;
+  double start, ptr_ns, scan_ns, hash_ns;
+  uint32_t i, k;
+
+  for(i = 0; i < n; i++)
+  {
+    os_sprintf(keys[i], "home/room%d/sensor", i);
+    os_strcpy(received[i], keys[i]);
+    ptr_hash_insert(&ptr, keys[i], (void *) (uintptr_t) (i + 1));
+    hash_insert(h, keys[i], os_strlen(keys[i]), (void *) (uintptr_t) (i + 1));
+  }
+
+  // Baseline, best case: caller already holds the key pointer
+  start = now_ns();
+  for(i = 0; i < BENCH_LOOKUPS; i++)
+    sink += (uintptr_t) ptr_hash_lookup(&ptr, keys[(i * 7) % n]);
+  ptr_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+  // Received topic matched by content without an index
+  start = now_ns();
+  for(i = 0; i < BENCH_LOOKUPS; i++)
+  {
+    const char *topic = received[(i * 7) % n];
+    for(k = 0; k < n && os_strcmp(keys[k], topic) != 0; k++);
+    sink += k;
+  }
+  scan_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+  // Received topic matched by content
+  start = now_ns();
+  for(i = 0; i < BENCH_LOOKUPS; i++)
+  {
+    const char *topic = received[(i * 7) % n];
+    sink += (uintptr_t) hash_lookup(h, topic, os_strlen(topic));
+  }
+  hash_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+  printf("%5u keys: pointer table %6.1f ns, strcmp scan %7.1f ns, hash map %6.1f ns\n",
+    n, ptr_ns, scan_ns, hash_ns);
+
+  os_free(ptr.keys);
+  os_free(ptr.values);
+  hash_destroy(h);
+}
+
+int
+main(void)
+{
+  bench(16);
+  bench(64);
+  bench(256);
+  bench(1024);
+  return 0;
+}
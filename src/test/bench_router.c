@@ -0,0 +1,154 @@
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+#include "modules/esp-mqtt/mqtt_router.h"
+
+#define BENCH_FILTERS   1000
+#define BENCH_TOPICS    4096
+#define BENCH_MATCHES   200000
+
+static struct mqtt_router router;
+static char filters[BENCH_FILTERS][40];
+static char topics[BENCH_TOPICS][40];
+
+static void
+handler(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+}
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//
+// BASELINE
+//
+
+// Topic matches filter (level by level, no trie)
+static bool
+filter_matches(const char *filter, const char *topic)
+{
+  if(*topic == '$' && (*filter == '+' || *filter == '#'))
+    return FALSE;
+  while(*filter != '\0')
+  {
+    if(*filter == '#')
+      return TRUE;
+    if(*filter == '+')
+    {
+      while(*topic != '\0' && *topic != '/')
+        ++topic;
+      ++filter;
+    }
+    else
+    {
+      while(*filter != '\0' && *filter != '/' && *filter == *topic)
+        ++filter, ++topic;
+      if((*filter != '\0' && *filter != '/') || (*topic != '\0' && *topic != '/'))
+        return FALSE;
+    }
+    if(*filter == '\0')
+      return *topic == '\0';
+    if(*topic == '\0')
+      return filter[1] == '#' && filter[2] == '\0';
+    ++filter;
+    ++topic;
+  }
+  return *topic == '\0';
+}
+
+//
+// RUNS
+//
+
+// 1k filters: mostly exact, some "+" levels and "#" tails
+static void
+setup(void)
+{
+  uint16_t i;
+
+  for(i = 0; i < BENCH_FILTERS; i++)
+  {
+    if(i % 10 == 0)
+      os_sprintf(filters[i], "site%d/+/status", i / 10);
+    else if(i % 50 == 1)
+      os_sprintf(filters[i], "site%d/logs/#", i / 50);
+    else
+      os_sprintf(filters[i], "site%d/dev%d/temp", i / 10, i % 10);
+    CHECK(mqtt_router_add(&router, filters[i], handler, 0));
+  }
+  for(i = 0; i < BENCH_TOPICS; i++)
+  {
+    switch(i % 4)
+    {
+      case 0: os_sprintf(topics[i], "site%d/dev%d/temp", (i * 7) % 100, i % 10); break;
+      case 1: os_sprintf(topics[i], "site%d/dev%d/status", (i * 7) % 100, i % 10); break;
+      case 2: os_sprintf(topics[i], "site%d/logs/app/err", (i * 7) % 30); break;
+      default: os_sprintf(topics[i], "other%d/dev/temp", i); break;
+    }
+  }
+}
+
+static void
+bench(void)
+{
+  struct mqtt_route_node *routes[MQTT_ROUTER_MAX_MATCHES];
+  volatile uint32_t sink = 0;
+  double start, scan_ns, trie_ns, cached_ns;
+  uint32_t i, matched = 0, scanned = 0;
+  const char *topic;
+  uint16_t f;
+  uint8_t flags;
+
+  // Every filter checked on every topic
+  start = now_ns();
+  for(i = 0; i < BENCH_MATCHES / 20; i++)
+  {
+    topic = topics[i % BENCH_TOPICS];
+    for(f = 0; f < BENCH_FILTERS; f++)
+      scanned += filter_matches(filters[f], topic);
+  }
+  scan_ns = (now_ns() - start) / (BENCH_MATCHES / 20);
+
+  // Trie, topics rotating (cache misses mostly)
+  start = now_ns();
+  for(i = 0; i < BENCH_MATCHES; i++)
+  {
+    topic = topics[i % BENCH_TOPICS];
+    matched += mqtt_router_match(&router, topic, os_strlen(topic), routes, MQTT_ROUTER_MAX_MATCHES, &flags);
+  }
+  trie_ns = (now_ns() - start) / BENCH_MATCHES;
+
+  // Same topic again (cache hits)
+  topic = topics[0];
+  start = now_ns();
+  for(i = 0; i < BENCH_MATCHES; i++)
+    sink += mqtt_router_match(&router, topic, os_strlen(topic), routes, MQTT_ROUTER_MAX_MATCHES, &flags);
+  cached_ns = (now_ns() - start) / BENCH_MATCHES;
+
+  // Both agree on what matches
+  for(i = 0, matched = scanned = 0; i < BENCH_TOPICS; i++)
+  {
+    topic = topics[i];
+    matched += mqtt_router_match(&router, topic, os_strlen(topic), routes, MQTT_ROUTER_MAX_MATCHES, &flags);
+    for(f = 0; f < BENCH_FILTERS; f++)
+      scanned += filter_matches(filters[f], topic);
+  }
+  CHECK(matched == scanned && matched > 0);
+  printf("%d filters: linear scan %8.1f ns, trie %6.1f ns, cached %6.1f ns (per topic, %u cache hits)\n",
+    BENCH_FILTERS, scan_ns, trie_ns, cached_ns, router.stats.hits);
+}
+
+int
+main(void)
+{
+  setup();
+  bench();
+  return TEST_RESULT();
+}
@@ -0,0 +1,382 @@
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include <mem.h>
+
+#include "sdk.h"
+
+// Fake SDK: timers only fire from tests, writes complete on "sdk_sent"
+
+struct sdk_socket sdk_sockets[SDK_SOCKETS];
+struct sdk_socket *sdk_socket = &sdk_sockets[0];
+uint32_t sdk_time;
+sint8 sdk_send_result;
+uint32_t sdk_dns_queries;
+bool sdk_out_of_memory;
+os_timer_t *sdk_timer_last;
+
+static os_task_t sdk_tasks[USER_TASK_PRIO_MAX];
+static os_event_t sdk_events[16];
+static uint8_t sdk_events_prio[16];
+static uint8_t sdk_events_cnt;
+
+void
+sdk_reset(void)
+{
+  os_memset(sdk_sockets, 0, sizeof(sdk_sockets));
+  sdk_socket = &sdk_sockets[0];
+  sdk_time = 0;
+  sdk_send_result = ESPCONN_OK;
+  sdk_dns_queries = 0;
+  sdk_out_of_memory = FALSE;
+  sdk_timer_last = NULL;
+  sdk_events_cnt = 0;
+}
+
+int
+os_printf(const char *format, ...)
+{
+  va_list args;
+  int len = 0;
+
+  if(getenv("TEST_VERBOSE") == NULL)
+    return 0;
+  va_start(args, format);
+  len = vprintf(format, args);
+  va_end(args);
+  return len;
+}
+
+//
+// HEAP
+//
+
+void *
+sdk_malloc(size_t size)
+{
+  return sdk_out_of_memory ? NULL : malloc(size);
+}
+
+void *
+sdk_zalloc(size_t size)
+{
+  return sdk_out_of_memory ? NULL : calloc(1, size);
+}
+
+//
+// TIMERS
+//
+
+void
+os_timer_setfn(os_timer_t *timer, os_timer_func_t *func, void *arg)
+{
+  timer->timer_func = func;
+  timer->timer_arg = arg;
+}
+
+void
+os_timer_arm(os_timer_t *timer, uint32_t ms, bool repeat)
+{
+  timer->period = ms;
+  timer->repeat = repeat;
+  timer->armed = TRUE;
+  sdk_timer_last = timer;
+}
+
+void
+os_timer_disarm(os_timer_t *timer)
+{
+  timer->armed = FALSE;
+}
+
+// Runs timer callback if armed (one-shot timers are disarmed first)
+bool
+sdk_fire(os_timer_t *timer)
+{
+  if(!timer->armed)
+    return FALSE;
+  if(!timer->repeat)
+    timer->armed = FALSE;
+  sdk_time += timer->period * 1000;
+  timer->timer_func(timer->timer_arg);
+  return TRUE;
+}
+
+//
+// TASKS
+//
+
+uint32_t
+system_get_time(void)
+{
+  return sdk_time;
+}
+
+bool
+system_os_task(os_task_t task, uint8_t prio, os_event_t *queue, uint8_t qlen)
+{
+  sdk_tasks[prio] = task;
+  return TRUE;
+}
+
+bool
+system_os_post(uint8_t prio, os_signal_t sig, os_param_t par)
+{
+  if(sdk_tasks[prio] == NULL || sdk_events_cnt == sizeof(sdk_events) / sizeof(sdk_events[0]))
+    return FALSE;
+  sdk_events[sdk_events_cnt] = (os_event_t) {sig, par};
+  sdk_events_prio[sdk_events_cnt++] = prio;
+  return TRUE;
+}
+
+// Runs posted tasks (including ones posted meanwhile)
+void
+sdk_run_tasks(void)
+{
+  os_event_t event;
+  uint8_t prio;
+
+  while(sdk_events_cnt > 0)
+  {
+    event = sdk_events[0];
+    prio = sdk_events_prio[0];
+    --sdk_events_cnt;
+    os_memmove(&sdk_events[0], &sdk_events[1], sdk_events_cnt * sizeof(sdk_events[0]));
+    os_memmove(&sdk_events_prio[0], &sdk_events_prio[1], sdk_events_cnt);
+    sdk_tasks[prio](&event);
+  }
+}
+
+//
+// SOCKETS
+//
+
+// Gets socket of espconn (new one on first use)
+static struct sdk_socket *
+sdk_socket_of(struct espconn *espconn)
+{
+  uint8_t i;
+
+  for(i = 0; i < SDK_SOCKETS; i++)
+    if(sdk_sockets[i].conn == espconn)
+      return &sdk_sockets[i];
+  for(i = 0; i < SDK_SOCKETS && sdk_sockets[i].conn != NULL; i++);
+  if(i == SDK_SOCKETS)
+  {
+    printf("sdk: more than %d espconns\n", SDK_SOCKETS);
+    abort();
+  }
+  sdk_sockets[i].conn = espconn;
+  return &sdk_sockets[i];
+}
+
+// Selects socket of espconn (sdk_out, sdk_sent, sdk_recv... act on it)
+struct sdk_socket *
+sdk_select(struct espconn *conn)
+{
+  sdk_socket = sdk_socket_of(conn);
+  return sdk_socket;
+}
+
+sint8
+espconn_send(struct espconn *espconn, uint8_t *psent, uint16_t length)
+{
+  struct sdk_socket *socket = sdk_socket_of(espconn);
+
+  if(sdk_send_result != ESPCONN_OK)
+    return sdk_send_result;
+  if(socket->sending || socket->out_len + length > SDK_OUT_SIZE)
+    return ESPCONN_MAXNUM;
+  os_memcpy(socket->out + socket->out_len, psent, length);
+  socket->out_len += length;
+  socket->sending = TRUE;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_secure_send(struct espconn *espconn, uint8_t *psent, uint16_t length)
+{
+  return espconn_send(espconn, psent, length);
+}
+
+// Completes pending write of selected socket (sent callback), FALSE if none
+bool
+sdk_sent(void)
+{
+  if(!sdk_socket->sending)
+    return FALSE;
+  sdk_socket->sending = FALSE;
+  sdk_socket->sent_cb(sdk_socket->conn);
+  return TRUE;
+}
+
+// Completes writes until nothing is handed to transport
+void
+sdk_flush(void)
+{
+  while(sdk_sent());
+}
+
+// Delivers bytes received from broker on selected socket
+void
+sdk_recv(const uint8_t *data, uint16_t len)
+{
+  sdk_socket->recv_cb(sdk_socket->conn, (char *) data, len);
+}
+
+sint8
+espconn_connect(struct espconn *espconn)
+{
+  sdk_select(espconn);
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_secure_connect(struct espconn *espconn)
+{
+  return espconn_connect(espconn);
+}
+
+sint8
+espconn_disconnect(struct espconn *espconn)
+{
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_secure_disconnect(struct espconn *espconn)
+{
+  return ESPCONN_OK;
+}
+
+bool
+espconn_secure_set_size(uint8_t level, uint16_t size)
+{
+  return TRUE;
+}
+
+sint8
+espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb)
+{
+  sdk_socket_of(espconn)->connect_cb = connect_cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb)
+{
+  sdk_socket_of(espconn)->recv_cb = recv_cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb)
+{
+  sdk_socket_of(espconn)->sent_cb = sent_cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb)
+{
+  sdk_socket_of(espconn)->discon_cb = discon_cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb)
+{
+  sdk_socket_of(espconn)->recon_cb = recon_cb;
+  return ESPCONN_OK;
+}
+
+uint32_t
+espconn_port(void)
+{
+  return 50000;
+}
+
+sint8
+espconn_set_opt(struct espconn *espconn, uint8_t opt)
+{
+  return ESPCONN_OK;
+}
+
+// Resolves right away (127.0.0.1)
+sint8
+espconn_gethostbyname(struct espconn *pespconn, const char *name, ip_addr_t *addr, dns_found_callback found)
+{
+  ip_addr_t resolved = {0x0100007F};
+
+  ++sdk_dns_queries;
+  found(name, &resolved, pespconn);
+  return ESPCONN_INPROGRESS;
+}
+
+//
+// SENT PACKETS
+//
+
+// Gets packet length (fixed header included) at "i" on sent bytes
+static uint32_t
+sdk_out_packet(uint32_t i, uint8_t *header_len)
+{
+  uint32_t remlen = 0;
+  uint8_t len = 0;
+
+  do
+    remlen |= (uint32_t) (sdk_out[i + 1 + len] & 0x7F) << (7 * len);
+  while(sdk_out[i + 1 + len++] & 0x80);
+  *header_len = 1 + len;
+  return 1 + len + remlen;
+}
+
+// Offset of 1st sent packet of type with packet id (0 = any), -1 if none
+// "flags" (optional) gets the fixed header flags
+int
+sdk_out_find(uint8_t type, uint16_t packet_id, uint8_t *flags)
+{
+  uint32_t i = 0;
+  uint32_t len;
+  uint16_t id;
+  uint8_t header_len, *vh;
+
+  while(i < sdk_out_len)
+  {
+    len = sdk_out_packet(i, &header_len);
+    vh = sdk_out + i + header_len;
+    if((sdk_out[i] >> 4) == type)
+    {
+      // PUBLISH packet id follows topic
+      if(type == 3)
+        id = ((sdk_out[i] & 0x06) != 0) ? (vh[2 + ((vh[0] << 8) | vh[1])] << 8) | vh[3 + ((vh[0] << 8) | vh[1])] : 0;
+      else
+        id = (vh[0] << 8) | vh[1];
+      if(packet_id == 0 || id == packet_id)
+      {
+        if(flags != NULL)
+          *flags = sdk_out[i] & 0x0F;
+        return i;
+      }
+    }
+    i += len;
+  }
+  return -1;
+}
+
+// Sent packets of type
+uint16_t
+sdk_out_count(uint8_t type)
+{
+  uint32_t i = 0;
+  uint16_t count = 0;
+  uint8_t header_len;
+
+  while(i < sdk_out_len)
+  {
+    if((sdk_out[i] >> 4) == type)
+      ++count;
+    i += sdk_out_packet(i, &header_len);
+  }
+  return count;
+}
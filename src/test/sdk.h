@@ -0,0 +1,50 @@
+#ifndef TEST_SDK_H
+#define TEST_SDK_H
+
+#include <user_interface.h>
+#include <espconn.h>
+#include <osapi.h>
+
+// Fake SDK state, driven by tests (see sdk.c)
+
+#define SDK_OUT_SIZE  16384
+#define SDK_SOCKETS   4       // espconns known at once
+
+// Socket of one espconn (callbacks registered, bytes sent)
+struct sdk_socket {
+  struct espconn *conn;
+  espconn_connect_callback connect_cb;
+  espconn_connect_callback discon_cb;
+  espconn_reconnect_callback recon_cb;
+  espconn_recv_callback recv_cb;
+  espconn_sent_callback sent_cb;
+  uint8_t out[SDK_OUT_SIZE];            // bytes accepted by espconn_send
+  uint32_t out_len;
+  bool sending;                         // write accepted, sent callback pending
+};
+
+extern struct sdk_socket sdk_sockets[SDK_SOCKETS];
+extern struct sdk_socket *sdk_socket;   // selected (last connected, see sdk_select)
+
+// Selected socket state
+#define sdk_out       (sdk_socket->out)
+#define sdk_out_len   (sdk_socket->out_len)
+#define sdk_sending   (sdk_socket->sending)
+
+extern uint32_t sdk_time;               // system_get_time (us)
+extern sint8 sdk_send_result;           // espconn_send result (ESPCONN_OK accepts)
+extern uint32_t sdk_dns_queries;        // espconn_gethostbyname calls
+extern bool sdk_out_of_memory;          // os_malloc/os_zalloc fail
+extern os_timer_t *sdk_timer_last;      // last armed
+
+void sdk_reset(void);
+struct sdk_socket *sdk_select(struct espconn *conn);
+bool sdk_fire(os_timer_t *timer);
+void sdk_run_tasks(void);
+bool sdk_sent(void);
+void sdk_flush(void);
+void sdk_recv(const uint8_t *data, uint16_t len);
+int sdk_out_find(uint8_t type, uint16_t packet_id, uint8_t *flags);
+uint16_t sdk_out_count(uint8_t type);
+
+#endif
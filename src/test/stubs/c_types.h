@@ -0,0 +1,28 @@
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+
+// Host build of SDK "c_types.h" (test stub)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef int8_t int8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef int16_t int16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+typedef int32_t int32;
+
+#define TRUE   true
+#define FALSE  false
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define ICACHE_RAM_ATTR
+#define LOCAL  static
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __ESPCONN_H__
+#define __ESPCONN_H__
+
+// Host build of SDK "espconn.h" (test stub)
+
+#include "user_interface.h"
+
+#define ESPCONN_OK          0
+#define ESPCONN_MEM        -1
+#define ESPCONN_TIMEOUT    -3
+#define ESPCONN_RTE        -4
+#define ESPCONN_INPROGRESS -5
+#define ESPCONN_MAXNUM     -7
+#define ESPCONN_ABRT       -8
+#define ESPCONN_RST        -9
+#define ESPCONN_CLSD      -10
+#define ESPCONN_CONN      -11
+#define ESPCONN_ARG       -12
+#define ESPCONN_IF        -14
+#define ESPCONN_ISCONN    -15
+
+#define ESPCONN_CLIENT      1
+
+enum espconn_type {
+  ESPCONN_INVALID = 0,
+  ESPCONN_TCP = 0x10,
+  ESPCONN_UDP = 0x20
+};
+
+enum espconn_state {
+  ESPCONN_NONE,
+  ESPCONN_WAIT,
+  ESPCONN_LISTEN,
+  ESPCONN_CONNECT,
+  ESPCONN_WRITE,
+  ESPCONN_READ,
+  ESPCONN_CLOSE
+};
+
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata, unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+typedef void (*dns_found_callback)(const char *name, ip_addr_t *ipaddr, void *callback_arg);
+
+typedef struct _esp_tcp {
+  int remote_port;
+  int local_port;
+  uint8_t local_ip[4];
+  uint8_t remote_ip[4];
+} esp_tcp;
+
+struct espconn {
+  enum espconn_type type;
+  enum espconn_state state;
+  union {
+    esp_tcp *tcp;
+  } proto;
+  void *reverse;
+};
+
+sint8 espconn_connect(struct espconn *espconn);
+sint8 espconn_disconnect(struct espconn *espconn);
+sint8 espconn_send(struct espconn *espconn, uint8_t *psent, uint16_t length);
+sint8 espconn_secure_connect(struct espconn *espconn);
+sint8 espconn_secure_disconnect(struct espconn *espconn);
+sint8 espconn_secure_send(struct espconn *espconn, uint8_t *psent, uint16_t length);
+bool espconn_secure_set_size(uint8_t level, uint16_t size);
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb);
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb);
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb);
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb);
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb);
+uint32_t espconn_port(void);
+sint8 espconn_set_opt(struct espconn *espconn, uint8_t opt);
+sint8 espconn_gethostbyname(struct espconn *pespconn, const char *name, ip_addr_t *addr, dns_found_callback found);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+
+// Host build of SDK "ets_sys.h" (test stub)
+
+#include "c_types.h"
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+// Host build of SDK "mem.h" (test stub), allocations fail on demand (sdk.c)
+
+#include <stdlib.h>
+
+void *sdk_malloc(size_t size);
+void *sdk_zalloc(size_t size);
+
+#define os_malloc(s)      sdk_malloc(s)
+#define os_zalloc(s)      sdk_zalloc(s)
+#define os_free(p)        free(p)
+
+#endif
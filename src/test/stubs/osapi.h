@@ -0,0 +1,41 @@
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+
+// Host build of SDK "osapi.h" (test stub), timers are driven by tests
+
+#include <string.h>
+#include <stdio.h>
+#include "c_types.h"
+#include "user_config.h"
+
+#define os_memcmp           memcmp
+#define os_memcpy           memcpy
+#define os_memmove          memmove
+#define os_memset           memset
+#define os_strlen(s)        strlen((const char *) (s))
+#define os_strcmp(a, b)     strcmp((const char *) (a), (const char *) (b))
+#define os_strncmp(a, b, n) strncmp((const char *) (a), (const char *) (b), (n))
+#define os_strstr(a, b)     strstr((const char *) (a), (const char *) (b))
+#define os_strchr           strchr
+#define os_strcpy           strcpy
+#define os_strncpy          strncpy
+#define os_sprintf          sprintf
+#define os_snprintf         snprintf
+
+int os_printf(const char *format, ...);
+
+typedef void os_timer_func_t(void *timer_arg);
+
+typedef struct _os_timer_t {
+  os_timer_func_t *timer_func;
+  void *timer_arg;
+  uint32_t period;    // ms
+  bool repeat;
+  bool armed;
+} os_timer_t;
+
+void os_timer_setfn(os_timer_t *timer, os_timer_func_t *func, void *arg);
+void os_timer_arm(os_timer_t *timer, uint32_t ms, bool repeat);
+void os_timer_disarm(os_timer_t *timer);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+
+// Host build of SDK "user_interface.h" (test stub)
+
+#include "c_types.h"
+#include "osapi.h"
+
+struct ip_addr {
+  uint32_t addr;
+};
+typedef struct ip_addr ip_addr_t;
+
+#define IPSTR       "%d.%d.%d.%d"
+#define IP2STR(ip)  ((ip)->addr & 0xFF), (((ip)->addr >> 8) & 0xFF), (((ip)->addr >> 16) & 0xFF), ((ip)->addr >> 24)
+
+uint32_t system_get_time(void);
+
+typedef uint32_t os_signal_t;
+typedef uintptr_t os_param_t;
+
+typedef struct {
+  os_signal_t sig;
+  os_param_t par;
+} os_event_t;
+
+typedef void (*os_task_t)(os_event_t *e);
+
+enum {
+  USER_TASK_PRIO_0 = 0,
+  USER_TASK_PRIO_1,
+  USER_TASK_PRIO_2,
+  USER_TASK_PRIO_MAX
+};
+
+bool system_os_task(os_task_t task, uint8_t prio, os_event_t *queue, uint8_t qlen);
+bool system_os_post(uint8_t prio, os_signal_t sig, os_param_t par);
+
+#endif
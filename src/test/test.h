@@ -0,0 +1,28 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+// Minimal test runner: failed checks are reported, the run goes on
+
+static int test_failures;
+
+#define CHECK(cond) \
+  do { \
+    if(!(cond)) \
+    { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      ++test_failures; \
+    } \
+  } while(0)
+
+#define RUN(test) \
+  do { \
+    const int failures = test_failures; \
+    test(); \
+    printf("%s %s\n", (test_failures == failures) ? "PASS" : "FAIL", #test); \
+  } while(0)
+
+#define TEST_RESULT()  (test_failures == 0 ? 0 : 1)
+
+#endif
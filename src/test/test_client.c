@@ -0,0 +1,448 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_client.h"
+
+static struct mqtt_client cli;
+static uint8_t delivered;
+
+static void
+handler(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+}
+
+static void
+delivered_cb(struct mqtt_connection *conn, uint16_t packet_id)
+{
+  ++delivered;
+}
+
+static const struct mqtt_subscription subs[] = {
+  { "a/+", MQTT_QOS_1, handler },
+  { "b/#", MQTT_QOS_0, handler }
+};
+
+// Client configured, never connected
+static void
+setup(void)
+{
+  sdk_reset();
+  os_memset(&cli, 0, sizeof(cli));
+  cli.host_name = "broker";
+  cli.host_port = 1883;
+  cli.subs = subs;
+  cli.subs_cnt = sizeof(subs) / sizeof(subs[0]);
+  cli.mqtt_conn.client_id = "test";
+  cli.mqtt_conn.username = "user";
+  cli.mqtt_conn.password = "pass";
+  cli.mqtt_conn.kalive = 60;
+  delivered = 0;
+}
+
+static void
+connack(bool session_present)
+{
+  const uint8_t packet[] = {0x20, 0x02, session_present, 0x00};
+  sdk_recv(packet, sizeof(packet));
+  sdk_flush();
+}
+
+// Connects socket and gets CONNACK, sent bytes cleared before CONNACK
+static void
+client_connect(bool session_present)
+{
+  mqtt_client_connect(&cli);
+  sdk_socket->connect_cb(sdk_socket->conn);
+  sdk_flush();
+  CHECK(sdk_out_find(MQTT_CONNECT, 0, NULL) >= 0);
+  sdk_out_len = 0;
+  connack(session_present);
+}
+
+static void
+puback(uint16_t packet_id)
+{
+  const uint8_t packet[] = {0x40, 0x02, packet_id >> 8, packet_id & 0xFF};
+  sdk_recv(packet, sizeof(packet));
+}
+
+// Grants every SUBSCRIBE sent (SUBACK with requested QoS)
+static void
+suback_all(void)
+{
+  uint8_t packet[4 + MQTT_MAX_SUBSCRIPTIONS];
+  uint32_t i = 0, p, end, len;
+  uint8_t codes, header_len;
+
+  while(i < sdk_out_len)
+  {
+    // Remaining length (up to 2 bytes here)
+    len = sdk_out[i + 1] & 0x7F;
+    header_len = 2;
+    if(sdk_out[i + 1] & 0x80)
+      len |= sdk_out[i + header_len++] << 7;
+
+    if((sdk_out[i] >> 4) == MQTT_SUBSCRIBE)
+    {
+      packet[0] = 0x90;
+      packet[2] = sdk_out[i + header_len];
+      packet[3] = sdk_out[i + header_len + 1];
+      codes = 0;
+      for(p = i + header_len + 2, end = i + header_len + len; p < end; codes++)
+      {
+        p += 2 + ((sdk_out[p] << 8) | sdk_out[p + 1]);
+        packet[4 + codes] = sdk_out[p++];
+      }
+      packet[1] = 2 + codes;
+      sdk_recv(packet, 4 + codes);
+    }
+    i += header_len + len;
+  }
+}
+
+// Packet id of 1st in-flight message (0 = none)
+static uint16_t
+inflight_id(void)
+{
+  uint8_t i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++)
+    if(cli.mqtt_conn.session.used & (1UL << i))
+      return cli.mqtt_conn.session.inflight[i].packet_id;
+  return 0;
+}
+
+static void
+client_disconnect(void)
+{
+  sdk_socket->discon_cb(sdk_socket->conn);
+}
+
+//
+// CONNECTION
+//
+
+// Lost connection stops session and transmit timers, reconnection resends
+static void
+test_disconnect_timers(void)
+{
+  struct mqtt_connection *conn = &cli.mqtt_conn;
+  const struct mqtt_fragment frag = {(const uint8_t *) "v", 1};
+  uint8_t flags;
+
+  setup();
+  client_connect(FALSE);
+  CHECK(mqtt_client_publishv(conn, "a/1", &frag, 1, MQTT_QOS_1, FALSE, delivered_cb) == MQTT_OK);
+  CHECK(conn->session.timer.armed);
+
+  // Write rejected just before the connection drops: retry pending
+  sdk_flush();
+  sdk_send_result = ESPCONN_MAXNUM;
+  CHECK(mqtt_ping(conn) == MQTT_OK);
+  CHECK(conn->tx.timer.armed);
+
+  client_disconnect();
+  CHECK(!conn->session.timer.armed && !conn->tx.timer.armed && !cli.ping_timer.armed);
+
+  // Nothing handed to transport while disconnected
+  sdk_send_result = ESPCONN_OK;
+  sdk_out_len = 0;
+  mqtt_flush(conn);
+  CHECK(sdk_out_len == 0);
+
+  client_connect(FALSE);
+  CHECK(sdk_out_find(MQTT_PUBLISH, inflight_id(), &flags) >= 0 && (flags & 0x08) != 0);
+  CHECK(conn->session.timer.armed);
+
+  puback(inflight_id());
+  CHECK(delivered == 1 && conn->session.count == 0 && !conn->session.timer.armed);
+}
+
+// Broker address resolved again once MQTT_DNS_TTL elapsed
+static void
+test_dns_ttl(void)
+{
+  setup();
+  client_connect(FALSE);
+  CHECK(sdk_dns_queries == 1 && cli.host_timer.armed && cli.host_timer.period == MQTT_DNS_TTL * 1000UL);
+  client_disconnect();
+
+  client_connect(FALSE);
+  CHECK(sdk_dns_queries == 1);
+  client_disconnect();
+
+  CHECK(sdk_fire(&cli.host_timer) && !cli.host_cached);
+  client_connect(FALSE);
+  CHECK(sdk_dns_queries == 2 && cli.host_cached && cli.host_timer.armed);
+}
+
+//
+// SUBSCRIPTIONS
+//
+
+// Registered subscriptions sent again only when the broker lost them
+static void
+test_session_subscriptions(void)
+{
+  setup();
+  client_connect(FALSE);
+  CHECK(sdk_out_count(MQTT_SUBSCRIBE) == 1);
+  suback_all();
+  CHECK(cli.registry_granted == 0x03 && cli.registry_pending == 0);
+  client_disconnect();
+
+  client_connect(TRUE);
+  CHECK(sdk_out_count(MQTT_SUBSCRIBE) == 0 && cli.registry_granted == 0x03);
+  client_disconnect();
+
+  client_connect(FALSE);
+  CHECK(sdk_out_count(MQTT_SUBSCRIBE) == 1 && cli.registry_pending == 0x03);
+}
+
+// Full in-flight window resent on reconnection: subscriptions sent once
+// an ack frees a packet id
+static void
+test_subscriptions_after_resend(void)
+{
+  struct mqtt_connection *conn = &cli.mqtt_conn;
+  const struct mqtt_fragment frag = {(const uint8_t *) "v", 1};
+  uint8_t i;
+
+  setup();
+  client_connect(FALSE);
+  suback_all();
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++)
+  {
+    CHECK(mqtt_client_publishv(conn, "a/1", &frag, 1, MQTT_QOS_1, FALSE, NULL) == MQTT_OK);
+    sdk_flush();
+  }
+  client_disconnect();
+
+  // No packet id left for SUBSCRIBE until an ack frees one
+  client_connect(FALSE);
+  CHECK(sdk_out_count(MQTT_PUBLISH) == MQTT_MAX_INFLIGHT && sdk_out_count(MQTT_SUBSCRIBE) == 0);
+  puback(inflight_id());
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_SUBSCRIBE) == 1 && cli.registry_pending == 0x03);
+  suback_all();
+  CHECK(cli.registry_granted == 0x03);
+}
+
+// Registered subscriptions (entries in use)
+static uint8_t
+registered(void)
+{
+  uint8_t i, n = 0;
+
+  for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    if(cli.registry[i].topic != NULL)
+      ++n;
+  return n;
+}
+
+// Many filters at once: all registered and granted, or none
+static void
+test_subscribe_many(void)
+{
+  static char topics[MQTT_MAX_SUBSCRIPTIONS + 1][8];
+  struct mqtt_subscription many[MQTT_MAX_SUBSCRIPTIONS + 1];
+  const uint8_t configured = sizeof(subs) / sizeof(subs[0]);
+  const uint8_t fit = MQTT_MAX_SUBSCRIPTIONS - configured;
+  uint8_t i;
+
+  for(i = 0; i <= MQTT_MAX_SUBSCRIPTIONS; i++)
+  {
+    os_sprintf(topics[i], "m/%d", i);
+    many[i] = (struct mqtt_subscription) {.topic = topics[i], .qos = MQTT_QOS_0, .cb = handler};
+  }
+
+  setup();
+  client_connect(FALSE);
+  suback_all();
+  sdk_out_len = 0;
+
+  // Registry can't take them all
+  CHECK(mqtt_client_subscribev(&cli.mqtt_conn, many, fit + 1) == MQTT_ERROR);
+  CHECK(registered() == configured && sdk_out_count(MQTT_SUBSCRIBE) == 0);
+  CHECK(mqtt_client_route_stats(&cli.mqtt_conn, "m/0") == NULL);
+
+  // Invalid filter
+  many[fit - 1].topic = "m/#/x";
+  CHECK(mqtt_client_subscribev(&cli.mqtt_conn, many, fit) == MQTT_ERROR);
+  CHECK(registered() == configured && mqtt_client_route_stats(&cli.mqtt_conn, "m/0") == NULL);
+  many[fit - 1].topic = topics[fit - 1];
+
+  CHECK(fit > 16);
+  CHECK(mqtt_client_subscribev(&cli.mqtt_conn, many, fit) == MQTT_OK);
+  sdk_flush();
+  CHECK(registered() == MQTT_MAX_SUBSCRIPTIONS && sdk_out_count(MQTT_SUBSCRIBE) > 0);
+  suback_all();
+  CHECK(cli.registry_granted == 0xFFFFFFFF && cli.registry_pending == 0);
+}
+
+// Handlers kept while UNSUBSCRIBE can't be queued
+static void
+test_unsubscribe_queue_full(void)
+{
+  struct mqtt_connection *conn = &cli.mqtt_conn;
+  const struct mqtt_fragment frag = {(const uint8_t *) "v", 1};
+
+  setup();
+  client_connect(FALSE);
+  suback_all();
+  sdk_flush();
+  sdk_out_len = 0;
+  while(mqtt_client_publishv(conn, "c/1", &frag, 1, MQTT_QOS_0, FALSE, NULL) == MQTT_OK);
+
+  CHECK(mqtt_client_unsubscribe(conn, "a/+") != MQTT_OK);
+  CHECK(registered() == 2 && mqtt_client_route_stats(conn, "a/+") != NULL);
+
+  sdk_flush();
+  CHECK(mqtt_client_unsubscribe(conn, "a/+") == MQTT_OK);
+  CHECK(registered() == 1 && mqtt_client_route_stats(conn, "a/+") == NULL);
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_UNSUBSCRIBE) == 1);
+}
+
+//
+// LOOPBACK
+//
+
+static char order[8];
+static uint8_t order_len;
+
+static void
+order_handler(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+  order[order_len++] = message->data[0];
+}
+
+static void
+publish_to(char payload, enum mqtt_delivery delivery)
+{
+  const struct mqtt_fragment frag = {(const uint8_t *) &payload, 1};
+  CHECK(mqtt_client_publish_to(&cli.mqtt_conn, "l/1", &frag, 1, MQTT_QOS_0, FALSE, delivery, NULL) == MQTT_OK);
+}
+
+// Loopback handled inline, in order with broker messages
+static void
+test_loopback_order(void)
+{
+  const struct mqtt_subscription sub = {.topic = "l/+", .qos = MQTT_QOS_0, .cb = order_handler};
+  const uint8_t publish[] = {0x30, 0x06, 0x00, 0x03, 'l', '/', '1', '2'};
+
+  setup();
+  client_connect(FALSE);
+  suback_all();
+  CHECK(mqtt_client_subscribev(&cli.mqtt_conn, &sub, 1) == MQTT_OK);
+  sdk_flush();
+  suback_all();
+  sdk_out_len = 0;
+  order_len = 0;
+
+  publish_to('1', MQTT_DELIVER_LOCAL);
+  CHECK(order_len == 1);
+  sdk_recv(publish, sizeof(publish));
+  publish_to('3', MQTT_DELIVER_BOTH);
+  CHECK(order_len == 3 && os_memcmp(order, "123", 3) == 0);
+
+  // Only the last one sent to broker
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_PUBLISH) == 1);
+}
+
+//
+// SEVERAL CLIENTS
+//
+
+static struct mqtt_client cli2;
+static struct mqtt_connection *handled;
+
+static void
+record_handler(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+  (void) message;
+  handled = conn;
+}
+
+// Two clients side by side: own sockets, timers, routes and callbacks
+static void
+test_two_clients(void)
+{
+  static const struct mqtt_subscription subs2[] = {
+    { .topic = "c/+", .qos = MQTT_QOS_0, .cb = record_handler }
+  };
+  const uint8_t publish[] = {0x30, 0x05, 0x00, 0x03, 'c', '/', '1'};
+  const struct mqtt_fragment frag = {(const uint8_t *) "v", 1};
+  struct sdk_socket *socket1, *socket2;
+
+  setup();
+  client_connect(FALSE);
+  suback_all();
+  socket1 = sdk_socket;
+
+  os_memset(&cli2, 0, sizeof(cli2));
+  cli2.host_name = "broker";
+  cli2.host_port = 1883;
+  cli2.subs = subs2;
+  cli2.subs_cnt = 1;
+  cli2.mqtt_conn.client_id = "test2";
+  cli2.mqtt_conn.username = "user";
+  cli2.mqtt_conn.password = "pass";
+  cli2.mqtt_conn.kalive = 30;
+  mqtt_client_connect(&cli2);
+  socket2 = sdk_socket;
+  CHECK(socket2 != socket1 && socket2->conn == cli2.tcp_conn);
+  socket2->connect_cb(socket2->conn);
+  sdk_flush();
+  connack(FALSE);
+  CHECK(sdk_out_count(MQTT_CONNECT) == 1 && sdk_out_count(MQTT_SUBSCRIBE) == 1);
+  suback_all();
+
+  // Routes kept per client
+  CHECK(mqtt_client_route_stats(&cli.mqtt_conn, "c/+") == NULL);
+  CHECK(mqtt_client_route_stats(&cli2.mqtt_conn, "c/+") != NULL);
+  CHECK(mqtt_client_route_stats(&cli2.mqtt_conn, "a/+") == NULL);
+
+  // Message of 2nd socket handled by 2nd client only
+  handled = NULL;
+  sdk_recv(publish, sizeof(publish));
+  CHECK(handled == &cli2.mqtt_conn);
+  sdk_select(cli.tcp_conn);
+  handled = NULL;
+  sdk_recv(publish, sizeof(publish));
+  CHECK(handled == NULL);
+
+  // Each client sends on its own socket and arms its own timers
+  socket1->out_len = socket2->out_len = 0;
+  CHECK(mqtt_client_publishv(&cli.mqtt_conn, "a/1", &frag, 1, MQTT_QOS_1, FALSE, NULL) == MQTT_OK);
+  CHECK(cli.mqtt_conn.session.timer.armed && !cli2.mqtt_conn.session.timer.armed);
+  CHECK(sdk_fire(&cli2.ping_timer));
+  sdk_select(cli2.tcp_conn);
+  sdk_flush();
+  sdk_select(cli.tcp_conn);
+  sdk_flush();
+  CHECK(socket1->out_len > 0 && sdk_out_count(MQTT_PUBLISH) == 1 && sdk_out_count(MQTT_PINGREQ) == 0);
+  sdk_select(cli2.tcp_conn);
+  CHECK(sdk_out_count(MQTT_PINGREQ) == 1 && sdk_out_count(MQTT_PUBLISH) == 0);
+
+  // Lost connection of one client leaves the other one running
+  client_disconnect();
+  CHECK(!cli2.online && !cli2.ping_timer.armed);
+  CHECK(cli.online && cli.ping_timer.armed && cli.mqtt_conn.session.timer.armed);
+}
+
+int
+main(void)
+{
+  RUN(test_disconnect_timers);
+  RUN(test_dns_ttl);
+  RUN(test_session_subscriptions);
+  RUN(test_subscriptions_after_resend);
+  RUN(test_subscribe_many);
+  RUN(test_unsubscribe_queue_full);
+  RUN(test_loopback_order);
+  RUN(test_two_clients);
+  return TEST_RESULT();
+}
@@ -0,0 +1,136 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_proto.h"
+
+// Built with MQTT_TX_COALESCE (see Makefile)
+
+static struct mqtt_connection conn;
+
+static void
+connect_cb(struct mqtt_connection *c, enum mqtt_connack_status status, bool present)
+{
+}
+
+static void
+message_cb(struct mqtt_connection *c, struct mqtt_message *message)
+{
+}
+
+static void
+subscribe_cb(struct mqtt_connection *c, const uint16_t packet_id, const uint8_t *codes, uint16_t codes_len)
+{
+}
+
+static bool
+send_cb(struct mqtt_connection *c, uint8_t *buf, int len)
+{
+  return espconn_send(NULL, buf, len) == ESPCONN_OK;
+}
+
+static void
+sent_cb(void *arg)
+{
+  mqtt_sent(&conn);
+}
+
+// Connected (CONNACK received), nothing sent yet, counters cleared
+static void
+setup(void)
+{
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+
+  os_memset(&conn, 0, sizeof(conn));
+  conn.client_id = "test";
+  conn.username = "user";
+  conn.password = "pass";
+  conn.kalive = 60;
+  conn.connect_cb = connect_cb;
+  conn.message_cb = message_cb;
+  conn.subscribe_cb = subscribe_cb;
+  conn.send_cb = send_cb;
+  sdk_reset();
+  sdk_socket->sent_cb = sent_cb;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  mqtt_flush(&conn);
+  sdk_flush();
+  mqtt_parse_packet(&conn, (uint8_t *) connack, sizeof(connack));
+  sdk_out_len = 0;
+  os_memset(&conn.tx.stats, 0, sizeof(conn.tx.stats));
+}
+
+static void
+publish(uint8_t count, uint16_t len)
+{
+  static uint8_t payload[512];
+  const struct mqtt_fragment frag = {payload, len};
+
+  while(count-- > 0)
+    CHECK(mqtt_publishv(&conn, "c/t", &frag, 1, MQTT_QOS_0, FALSE, NULL) == MQTT_OK);
+}
+
+//
+// COALESCING
+//
+
+// Small packets wait for the deadline, then go on one write
+static void
+test_deadline(void)
+{
+  setup();
+  publish(MQTT_TX_COALESCE_PACKETS - 1, 1);
+  CHECK(sdk_out_len == 0 && conn.tx.timer.armed && conn.tx.timer.period == MQTT_TX_COALESCE_DELAY);
+
+  CHECK(sdk_fire(&conn.tx.timer));
+  CHECK(conn.tx.stats.writes == 1 && conn.tx.stats.packets == MQTT_TX_COALESCE_PACKETS - 1);
+  CHECK(sdk_out_count(MQTT_PUBLISH) == MQTT_TX_COALESCE_PACKETS - 1);
+  sdk_flush();
+  CHECK(conn.tx.count == 0 && !conn.tx.timer.armed);
+}
+
+// Packet or byte thresholds write right away
+static void
+test_thresholds(void)
+{
+  setup();
+  publish(MQTT_TX_COALESCE_PACKETS, 1);
+  CHECK(conn.tx.stats.writes == 1 && conn.tx.stats.packets == MQTT_TX_COALESCE_PACKETS);
+  CHECK(!conn.tx.timer.armed);
+  sdk_flush();
+
+  publish(1, MQTT_TX_COALESCE_BYTES);
+  CHECK(conn.tx.stats.writes == 2 && conn.tx.stats.packets == MQTT_TX_COALESCE_PACKETS + 1);
+  sdk_flush();
+
+  // Explicit flush
+  publish(1, 1);
+  CHECK(conn.tx.stats.writes == 2);
+  mqtt_flush(&conn);
+  CHECK(conn.tx.stats.writes == 3 && !conn.tx.timer.armed);
+}
+
+// Packets queued while transport is busy go together on the next write
+static void
+test_queued_while_sending(void)
+{
+  setup();
+  publish(MQTT_TX_COALESCE_PACKETS, 1);
+  CHECK(conn.tx.stats.writes == 1 && sdk_sending);
+  publish(2, 1);
+  CHECK(conn.tx.stats.writes == 1);
+
+  CHECK(sdk_sent());
+  CHECK(conn.tx.stats.writes == 2 && conn.tx.stats.packets == MQTT_TX_COALESCE_PACKETS + 2);
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_PUBLISH) == MQTT_TX_COALESCE_PACKETS + 2 && conn.tx.count == 0);
+}
+
+int
+main(void)
+{
+  RUN(test_deadline);
+  RUN(test_thresholds);
+  RUN(test_queued_while_sending);
+  return TEST_RESULT();
+}
@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_client.h"
+
+// Built with MQTT_DEDUP_SLOTS (see Makefile)
+
+static struct mqtt_client cli;
+static uint8_t handled_a, handled_b;
+
+static void
+handler_a(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+  ++handled_a;
+}
+
+static void
+handler_b(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+  ++handled_b;
+}
+
+// Overlapping filters: broker sends one copy per subscription
+static const struct mqtt_subscription subs[] = {
+  { "d/+", MQTT_QOS_0, handler_a },
+  { "d/#", MQTT_QOS_0, handler_b }
+};
+
+// Connected (CONNACK received), subscriptions granted
+static void
+setup(void)
+{
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+  const uint8_t suback[] = {0x90, 0x04, 0x00, 0x01, 0x00, 0x00};
+
+  sdk_reset();
+  os_memset(&cli, 0, sizeof(cli));
+  cli.host_name = "broker";
+  cli.host_port = 1883;
+  cli.subs = subs;
+  cli.subs_cnt = sizeof(subs) / sizeof(subs[0]);
+  cli.mqtt_conn.client_id = "test";
+  cli.mqtt_conn.username = "user";
+  cli.mqtt_conn.password = "pass";
+  cli.mqtt_conn.kalive = 60;
+  mqtt_client_connect(&cli);
+  sdk_socket->connect_cb(sdk_socket->conn);
+  sdk_flush();
+  sdk_recv(connack, sizeof(connack));
+  sdk_flush();
+  sdk_recv(suback, sizeof(suback));
+  sdk_flush();
+  handled_a = handled_b = 0;
+}
+
+static void
+feed_publish(char payload)
+{
+  const uint8_t publish[] = {0x30, 0x06, 0x00, 0x03, 'd', '/', '1', payload};
+  sdk_recv(publish, sizeof(publish));
+}
+
+//
+// BROKER COPIES
+//
+
+// Copies expected only for the extra matching subscriptions
+static void
+test_copies_suppressed(void)
+{
+  const struct mqtt_dedup_stats *stats;
+
+  setup();
+  stats = mqtt_client_dedup_stats(&cli.mqtt_conn);
+  feed_publish('a');
+  feed_publish('a');
+  CHECK(handled_a == 1 && handled_b == 1 && stats->suppressed == 1);
+
+  // No copies left: same message published again
+  feed_publish('a');
+  CHECK(handled_a == 2 && handled_b == 2);
+
+  // Outside the window: new message
+  sdk_time += MQTT_DEDUP_WINDOW * 1000UL;
+  feed_publish('a');
+  CHECK(handled_a == 3 && handled_b == 3 && stats->suppressed == 1);
+}
+
+// Loopback publish: every broker copy suppressed
+static void
+test_loopback_echo(void)
+{
+  const struct mqtt_fragment frag = {(const uint8_t *) "e", 1};
+
+  setup();
+  CHECK(mqtt_client_publish_to(&cli.mqtt_conn, "d/1", &frag, 1, MQTT_QOS_0, FALSE, MQTT_DELIVER_BOTH, NULL) == MQTT_OK);
+  CHECK(handled_a == 1 && handled_b == 1);
+  feed_publish('e');
+  feed_publish('e');
+  CHECK(handled_a == 1 && handled_b == 1);
+  feed_publish('e');
+  CHECK(handled_a == 2 && handled_b == 2);
+}
+
+int
+main(void)
+{
+  RUN(test_copies_suppressed);
+  RUN(test_loopback_echo);
+  return TEST_RESULT();
+}
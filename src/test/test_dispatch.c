@@ -0,0 +1,122 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_client.h"
+
+// Built with MQTT_DISPATCH_QUEUE (see Makefile)
+
+static struct mqtt_client cli;
+static char handled[16];
+static uint8_t handled_cnt;
+
+static void
+handler(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+  handled[handled_cnt++] = message->data[0];
+}
+
+static const struct mqtt_subscription subs[] = {
+  { "d/+", MQTT_QOS_0, handler }
+};
+
+// Connected (CONNACK received), subscriptions granted
+static void
+setup(void)
+{
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+  const uint8_t suback[] = {0x90, 0x03, 0x00, 0x01, 0x00};
+
+  sdk_reset();
+  os_memset(&cli, 0, sizeof(cli));
+  cli.host_name = "broker";
+  cli.host_port = 1883;
+  cli.subs = subs;
+  cli.subs_cnt = sizeof(subs) / sizeof(subs[0]);
+  cli.mqtt_conn.client_id = "test";
+  cli.mqtt_conn.username = "user";
+  cli.mqtt_conn.password = "pass";
+  cli.mqtt_conn.kalive = 60;
+  mqtt_client_connect(&cli);
+  sdk_socket->connect_cb(sdk_socket->conn);
+  sdk_flush();
+  sdk_recv(connack, sizeof(connack));
+  sdk_flush();
+  sdk_recv(suback, sizeof(suback));
+  handled_cnt = 0;
+}
+
+static void
+feed_publish(char payload)
+{
+  const uint8_t publish[] = {0x30, 0x06, 0x00, 0x03, 'd', '/', '1', payload};
+  sdk_recv(publish, sizeof(publish));
+}
+
+//
+// DISPATCH QUEUE
+//
+
+// Full lane: only the oldest message handled on the receive callback
+static void
+test_overflow_oldest(void)
+{
+  const struct mqtt_dispatch_stats *stats;
+
+  setup();
+  stats = mqtt_client_dispatch_stats(&cli.mqtt_conn, MQTT_LANE_BULK);
+  feed_publish('a');
+  feed_publish('b');
+  CHECK(handled_cnt == 0 && stats->depth == 2);
+
+  feed_publish('c');
+  CHECK(handled_cnt == 1 && handled[0] == 'a');
+  CHECK(stats->overflows == 1 && stats->depth == 2);
+
+  sdk_run_tasks();
+  CHECK(handled_cnt == 3 && handled[1] == 'b' && handled[2] == 'c');
+  CHECK(stats->depth == 0 && stats->dispatched == 3);
+}
+
+static void
+publish_local(char payload, enum mqtt_delivery delivery)
+{
+  const struct mqtt_fragment frag = {(const uint8_t *) &payload, 1};
+  CHECK(mqtt_client_publish_to(&cli.mqtt_conn, "d/1", &frag, 1, MQTT_QOS_0, FALSE, delivery, NULL) == MQTT_OK);
+}
+
+// Loopback and broker messages share the lane: handled in arrival order
+static void
+test_loopback_order(void)
+{
+  setup();
+  publish_local('1', MQTT_DELIVER_LOCAL);
+  feed_publish('2');
+  CHECK(handled_cnt == 0);
+  publish_local('3', MQTT_DELIVER_LOCAL);
+  CHECK(handled_cnt == 1 && handled[0] == '1');
+  feed_publish('4');
+  publish_local('5', MQTT_DELIVER_BOTH);
+  sdk_run_tasks();
+  CHECK(handled_cnt == 5 && os_memcmp(handled, "12345", 5) == 0);
+
+  // Broker copy of the last one comes after it
+  feed_publish('5');
+  sdk_run_tasks();
+  CHECK(handled_cnt == 6 && handled[5] == '5');
+
+  // Local only: nothing sent
+  sdk_flush();
+  sdk_out_len = 0;
+  publish_local('6', MQTT_DELIVER_LOCAL);
+  sdk_flush();
+  CHECK(sdk_out_len == 0);
+}
+
+int
+main(void)
+{
+  RUN(test_overflow_oldest);
+  RUN(test_loopback_order);
+  return TEST_RESULT();
+}
@@ -0,0 +1,100 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/utils/hashtable.h"
+
+//
+// HASH MAP
+//
+
+// Keys compared by content (not NULL terminated, any buffer)
+static void
+test_string_keys(void)
+{
+  hash_t *h = hash_create(4);
+  char key[] = "sensors/temp";
+  int value = 1;
+
+  CHECK(hash_insert(h, "sensors/temp", 12, &value));
+  CHECK(hash_lookup(h, key, 12) == &value);
+  CHECK(hash_lookup(h, key, 7) == NULL);
+  key[0] = 'S';
+  CHECK(hash_lookup(h, key, 12) == NULL);
+
+  // Replaced, not added
+  CHECK(hash_insert(h, "sensors/temp", 12, h) && h->count == 1 && hash_lookup(h, "sensors/temp", 12) == h);
+  hash_destroy(h);
+}
+
+// Grows at HASH_LOAD_FACTOR, every key still found
+static void
+test_grow(void)
+{
+  hash_t *h = hash_create(1);
+  char key[16];
+  uint16_t i, found = 0;
+
+  CHECK(h->size == HASH_MIN_SIZE);
+  for(i = 0; i < 1000; i++)
+  {
+    os_sprintf(key, "t/%d", i);
+    CHECK(hash_insert(h, key, os_strlen(key), (void *) (uintptr_t) (i + 1)));
+  }
+  CHECK(h->count == 1000 && h->count * 100 <= h->size * HASH_LOAD_FACTOR);
+
+  for(i = 0; i < 1000; i++)
+  {
+    os_sprintf(key, "t/%d", i);
+    found += hash_lookup(h, key, os_strlen(key)) == (void *) (uintptr_t) (i + 1);
+  }
+  CHECK(found == 1000);
+  hash_destroy(h);
+}
+
+// Deletes shift entries back: no tombstones, probe chains stay intact
+static void
+test_delete(void)
+{
+  hash_t *h = hash_create(64);
+  char key[16];
+  uint16_t i, found = 0, used = 0;
+
+  for(i = 0; i < 48; i++)
+  {
+    os_sprintf(key, "k%d", i);
+    hash_insert(h, key, os_strlen(key), (void *) (uintptr_t) (i + 1));
+  }
+  for(i = 0; i < 48; i += 2)
+  {
+    os_sprintf(key, "k%d", i);
+    CHECK(hash_delete(h, key, os_strlen(key)));
+  }
+  CHECK(!hash_delete(h, "k0", 2) && h->count == 24);
+
+  for(i = 0; i < 48; i++)
+  {
+    os_sprintf(key, "k%d", i);
+    found += hash_lookup(h, key, os_strlen(key)) != NULL;
+  }
+  for(i = 0; i < h->size; i++)
+    used += h->hashes[i] != 0;
+  CHECK(found == 24 && used == 24);
+
+  for(i = 1; i < 48; i += 2)
+  {
+    os_sprintf(key, "k%d", i);
+    hash_delete(h, key, os_strlen(key));
+  }
+  CHECK(hash_is_empty(h));
+  hash_destroy(h);
+}
+
+int
+main(void)
+{
+  RUN(test_string_keys);
+  RUN(test_grow);
+  RUN(test_delete);
+  return TEST_RESULT();
+}
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_proto.h"
+
+// Built with a small MQTT_TOPIC_INTERN (see Makefile)
+
+#define HOT_TOPICS  4
+
+static struct mqtt_connection conn;
+static uint16_t topic_id;
+static char topic[MQTT_TOPIC_INTERN_LEN + 8];
+
+static void
+connect_cb(struct mqtt_connection *c, enum mqtt_connack_status status, bool present)
+{
+}
+
+// Keeps id and topic of last message
+static void
+message_cb(struct mqtt_connection *c, struct mqtt_message *message)
+{
+  topic_id = message->topic_id;
+  os_memcpy(topic, message->topic, message->topic_len);
+  topic[message->topic_len] = '\0';
+}
+
+static void
+subscribe_cb(struct mqtt_connection *c, const uint16_t packet_id, const uint8_t *codes, uint16_t codes_len)
+{
+}
+
+static bool
+send_cb(struct mqtt_connection *c, uint8_t *buf, int len)
+{
+  return TRUE;
+}
+
+// Connected (CONNACK received), intern table empty
+static void
+setup(void)
+{
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+
+  os_memset(&conn, 0, sizeof(conn));
+  conn.client_id = "test";
+  conn.username = "user";
+  conn.password = "pass";
+  conn.kalive = 60;
+  conn.connect_cb = connect_cb;
+  conn.message_cb = message_cb;
+  conn.subscribe_cb = subscribe_cb;
+  conn.send_cb = send_cb;
+  sdk_reset();
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  mqtt_sent(&conn);
+  mqtt_parse_packet(&conn, (uint8_t *) connack, sizeof(connack));
+}
+
+// Receives QoS 0 PUBLISH on "name", returns its topic id
+static uint16_t
+receive(const char *name)
+{
+  uint8_t publish[4 + sizeof(topic) + 1];
+  uint16_t len = os_strlen(name);
+
+  publish[0] = 0x30;
+  publish[1] = 2 + len + 1;
+  publish[2] = 0;
+  publish[3] = len;
+  os_memcpy(publish + 4, name, len);
+  publish[4 + len] = 'x';
+  topic_id = 0xFFFF;
+  mqtt_parse_packet(&conn, publish, 5 + len);
+  CHECK(os_strcmp(topic, name) == 0);
+  return topic_id;
+}
+
+//
+// EVICTION
+//
+
+// Hot topics stay interned while a stream of one-off topics cycles through
+// the remaining entries
+static void
+test_skewed_traffic(void)
+{
+  uint16_t hot_ids[HOT_TOPICS];
+  uint16_t i, h, moved = 0;
+  char name[32];
+
+  setup();
+  for(h = 0; h < HOT_TOPICS; h++)
+  {
+    os_sprintf(name, "hot/%d", h);
+    hot_ids[h] = receive(name);
+    CHECK(hot_ids[h] != 0);
+  }
+
+  for(i = 0; i < 200; i++)
+  {
+    os_sprintf(name, "cold/%d", i);
+    CHECK(receive(name) != 0);
+    // Hot topics seen much more often than any cold one
+    if(i % 2 == 0)
+    {
+      for(h = 0; h < HOT_TOPICS; h++)
+      {
+        os_sprintf(name, "hot/%d", h);
+        moved += (receive(name) != hot_ids[h]);
+      }
+    }
+  }
+  CHECK(moved == 0);
+  CHECK(conn.intern_stats.misses == HOT_TOPICS + 200);
+  CHECK(conn.intern_stats.evictions == 200 - (MQTT_TOPIC_INTERN - HOT_TOPICS));
+  CHECK(conn.intern_stats.hits == 100 * HOT_TOPICS && conn.intern_stats.skipped == 0);
+
+  // Evicted topic interned again with a new id
+  CHECK(receive("cold/0") != 0 && conn.intern_stats.misses == HOT_TOPICS + 201);
+}
+
+// Pinned topics survive any traffic, other ones keep cycling
+static void
+test_pinned(void)
+{
+  uint16_t pinned[MQTT_TOPIC_INTERN - 2];
+  uint16_t i, kept = 0;
+  char name[32];
+
+  setup();
+  for(i = 0; i < MQTT_TOPIC_INTERN - 2; i++)
+  {
+    os_sprintf(name, "pin/%d", i);
+    pinned[i] = mqtt_topic_id(&conn, name);
+    CHECK(pinned[i] != 0);
+  }
+
+  // Two entries left: new topics replace the older one
+  for(i = 0; i < 20; i++)
+  {
+    os_sprintf(name, "flow/%d", i);
+    CHECK(receive(name) != 0);
+  }
+  CHECK(conn.intern_stats.evictions == 18);
+
+  for(i = 0; i < MQTT_TOPIC_INTERN - 2; i++)
+  {
+    os_sprintf(name, "pin/%d", i);
+    kept += (receive(name) == pinned[i]);
+  }
+  CHECK(kept == MQTT_TOPIC_INTERN - 2);
+
+  // Last used entry never evicted (message may point to it)
+  CHECK(mqtt_topic_id(&conn, "pin/last") != 0);
+  CHECK(receive("flow/20") != 0 && receive("flow/21") == 0 && conn.intern_stats.skipped == 1);
+
+  // Every entry pinned: delivered without an id
+  CHECK(mqtt_topic_id(&conn, "flow/20") != 0);
+  CHECK(receive("other") == 0 && conn.intern_stats.skipped == 2);
+}
+
+// Topics too long are delivered, not interned
+static void
+test_too_long(void)
+{
+  char name[MQTT_TOPIC_INTERN_LEN + 2];
+
+  setup();
+  os_memset(name, 'l', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  CHECK(receive(name) == 0 && conn.intern_stats.skipped == 1);
+  name[MQTT_TOPIC_INTERN_LEN] = '\0';
+  CHECK(receive(name) != 0);
+}
+
+int
+main(void)
+{
+  RUN(test_skewed_traffic);
+  RUN(test_pinned);
+  RUN(test_too_long);
+  return TEST_RESULT();
+}
@@ -0,0 +1,243 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_proto.h"
+
+static struct mqtt_connection conn;
+static uint8_t connacks;
+static bool session_present;
+static uint8_t messages;
+static char topic[64];
+static char data[64];
+static uint16_t data_len;
+static uint16_t puback_id;
+static char received[1024];   // "topic=data;" of each message
+static uint16_t received_len;
+
+static void
+connect_cb(struct mqtt_connection *c, enum mqtt_connack_status status, bool present)
+{
+  ++connacks;
+  session_present = present;
+}
+
+static void
+message_cb(struct mqtt_connection *c, struct mqtt_message *message)
+{
+  ++messages;
+  os_memcpy(topic, message->topic, message->topic_len);
+  topic[message->topic_len] = '\0';
+  data_len = message->data_len;
+  if(data_len < sizeof(data))
+  {
+    os_memcpy(data, message->data, data_len);
+    data[data_len] = '\0';
+  }
+  if(received_len + message->topic_len + data_len + 2 < sizeof(received))
+    received_len += os_sprintf(received + received_len, "%s=%.*s;", topic, data_len, (char *) message->data);
+}
+
+static void
+subscribe_cb(struct mqtt_connection *c, const uint16_t packet_id, const uint8_t *codes, uint16_t codes_len)
+{
+}
+
+static void
+delivered_cb(struct mqtt_connection *c, uint16_t packet_id)
+{
+  puback_id = packet_id;
+}
+
+static bool
+send_cb(struct mqtt_connection *c, uint8_t *buf, int len)
+{
+  return TRUE;
+}
+
+// Connected (CONNECT queued and sent), counters cleared
+static void
+setup(void)
+{
+  os_memset(&conn, 0, sizeof(conn));
+  conn.client_id = "test";
+  conn.username = "user";
+  conn.password = "pass";
+  conn.kalive = 60;
+  conn.connect_cb = connect_cb;
+  conn.message_cb = message_cb;
+  conn.subscribe_cb = subscribe_cb;
+  conn.send_cb = send_cb;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  mqtt_sent(&conn);
+  connacks = 0;
+  messages = 0;
+  puback_id = 0;
+  received_len = 0;
+  received[0] = '\0';
+}
+
+static void
+feed(const uint8_t *bytes, int len)
+{
+  mqtt_parse_packet(&conn, (uint8_t *) bytes, len);
+}
+
+//
+// FRAMING
+//
+
+// Packets split across segments and several packets on one segment
+static void
+test_fragmented(void)
+{
+  const uint8_t publish[] = {0x30, 0x08, 0x00, 0x03, 'a', '/', 'b', 'x', 'y', 'z'};
+  uint8_t both[sizeof(publish) + 4] = {0x20, 0x02, 0x01, 0x00};
+  int i;
+
+  setup();
+  for(i = 0; i < sizeof(publish); i++)
+    feed(&publish[i], 1);
+  CHECK(messages == 1 && strcmp(topic, "a/b") == 0 && strcmp(data, "xyz") == 0);
+
+  os_memcpy(both + 4, publish, sizeof(publish));
+  feed(both, 7);
+  CHECK(connacks == 1 && session_present && messages == 1);
+  feed(both + 7, sizeof(both) - 7);
+  CHECK(messages == 2);
+}
+
+// Remaining length on several bytes, body bigger than one segment
+static void
+test_long_remaining_length(void)
+{
+  uint8_t publish[3 + 2 + 3 + 200] = {0x30, 0xCD, 0x01, 0x00, 0x03, 'l', '/', 'n'};
+
+  setup();
+  os_memset(publish + 8, 'd', 200);
+  feed(publish, 100);
+  CHECK(messages == 0);
+  feed(publish + 100, sizeof(publish) - 100);
+  CHECK(messages == 1 && strcmp(topic, "l/n") == 0 && data_len == 200);
+}
+
+// Same stream cut at random points delivers the same messages, in order
+static void
+test_random_splits(void)
+{
+  static const uint8_t packets[] = {
+    0x20, 0x02, 0x00, 0x00,                                       // CONNACK
+    0x30, 0x06, 0x00, 0x01, 'a', 'x', 'y', 'z',                   // PUBLISH a=xyz
+    0xD0, 0x00,                                                   // PINGRESP
+    0x32, 0x08, 0x00, 0x03, 'b', '/', '1', 0x00, 0x07, '1',       // PUBLISH QoS 1 b/1=1
+    0x90, 0x03, 0x00, 0x01, 0x00,                                 // SUBACK
+    0x30, 0x04, 0x00, 0x02, 'c', 'c',                             // PUBLISH cc= (empty)
+    0x34, 0x09, 0x00, 0x03, 'd', '/', '2', 0x00, 0x08, '2', '2',  // PUBLISH QoS 2 d/2=22
+    0x62, 0x02, 0x00, 0x08                                        // PUBREL
+  };
+  static uint8_t stream[sizeof(packets) + 3 + 2 + 1 + 300];
+  static char expected[sizeof(received)];
+  uint32_t seed = 1, stream_len, i, cut;
+  uint8_t expected_messages;
+  uint16_t run;
+  int failures = 0;
+
+  // Stream ends with a PUBLISH on 2 bytes remaining length
+  os_memcpy(stream, packets, sizeof(packets));
+  stream_len = sizeof(packets);
+  os_memcpy(stream + stream_len, "\x30\xAF\x02\x00\x01" "e", 6);
+  os_memset(stream + stream_len + 6, 'E', 300);
+  stream_len += 6 + 300;
+
+  setup();
+  feed(stream, stream_len);
+  expected_messages = messages;
+  os_strcpy(expected, received);
+  CHECK(expected_messages == 5 && connacks == 1);
+
+  for(run = 0; run < 500; run++)
+  {
+    setup();
+    for(i = 0; i < stream_len; i += cut)
+    {
+      // Small cuts mostly (1 to 16 bytes), sometimes up to 64
+      seed = seed * 1103515245 + 12345;
+      cut = 1 + ((seed >> 16) % (((seed >> 8) & 0x07) == 0 ? 64 : 16));
+      if(cut > stream_len - i)
+        cut = stream_len - i;
+      feed(stream + i, cut);
+    }
+    if(messages != expected_messages || connacks != 1 || os_strcmp(received, expected) != 0)
+      ++failures;
+  }
+  CHECK(failures == 0);
+}
+
+//
+// MALFORMED PACKETS
+//
+
+// Packets shorter than their fixed fields are dropped, parser stays in sync
+static void
+test_short_packets(void)
+{
+  const uint8_t connack[] = {0x20, 0x01, 0x01};
+  const uint8_t puback[] = {0x40, 0x00};
+  const uint8_t suback[] = {0x90, 0x02, 0x00, 0x01};
+  const uint8_t publish[] = {0x30, 0x01, 0x00};
+  const uint8_t pingresp[] = {0xD0, 0x00};
+  const uint8_t valid[] = {0x30, 0x05, 0x00, 0x01, 't', 'o', 'k'};
+
+  setup();
+  feed(connack, sizeof(connack));
+  CHECK(connacks == 0);
+  feed(puback, sizeof(puback));
+  feed(suback, sizeof(suback));
+  feed(publish, sizeof(publish));
+  CHECK(messages == 0);
+  feed(pingresp, sizeof(pingresp));
+
+  // Same packets split byte by byte (gathered on parser buffer)
+  feed(connack, 2);
+  feed(connack + 2, 1);
+  CHECK(connacks == 0);
+
+  feed(valid, sizeof(valid));
+  CHECK(messages == 1 && strcmp(data, "ok") == 0);
+}
+
+// Short acks never release in-flight messages
+static void
+test_short_ack(void)
+{
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+  const uint8_t puback_short[] = {0x40, 0x01, 0x00};
+  uint8_t puback[] = {0x40, 0x02, 0x00, 0x00};
+  const struct mqtt_fragment frag = {(const uint8_t *) "v", 1};
+
+  setup();
+  feed(connack, sizeof(connack));
+  CHECK(mqtt_publishv(&conn, "q/1", &frag, 1, MQTT_QOS_1, FALSE, delivered_cb) == MQTT_OK);
+  mqtt_sent(&conn);
+  CHECK(conn.session.count == 1);
+
+  feed(puback_short, sizeof(puback_short));
+  CHECK(conn.session.count == 1 && puback_id == 0);
+
+  puback[2] = conn.session.inflight[0].packet_id >> 8;
+  puback[3] = conn.session.inflight[0].packet_id & 0xFF;
+  feed(puback, sizeof(puback));
+  CHECK(conn.session.count == 0 && puback_id != 0);
+}
+
+int
+main(void)
+{
+  sdk_reset();
+  RUN(test_fragmented);
+  RUN(test_long_remaining_length);
+  RUN(test_random_splits);
+  RUN(test_short_packets);
+  RUN(test_short_ack);
+  return TEST_RESULT();
+}
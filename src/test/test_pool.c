@@ -0,0 +1,143 @@
+#include "test.h"
+#include "sdk.h"
+#include "modules/utils/pool.h"
+
+static pool_stats_t
+stats(uint8_t cls)
+{
+  pool_stats_t s;
+  CHECK(pool_stats(cls, &s));
+  return s;
+}
+
+// Exhausted class borrows from larger ones, heap only when all are taken
+static void
+test_borrow(void)
+{
+  void *blocks[POOL_CLASS_0_COUNT + POOL_CLASS_1_COUNT + POOL_CLASS_2_COUNT + POOL_CLASS_3_COUNT + 1];
+  const uint16_t total = sizeof(blocks) / sizeof(blocks[0]) - 1;
+  uint16_t i;
+
+  for(i = 0; i < POOL_CLASS_0_COUNT; i++)
+    blocks[i] = pool_alloc(POOL_CLASS_0_SIZE);
+  CHECK(stats(0).used == POOL_CLASS_0_COUNT && stats(0).borrowed == 0);
+
+  blocks[i++] = pool_alloc(POOL_CLASS_0_SIZE);
+  CHECK(stats(1).used == 1 && stats(0).borrowed == 1 && stats(0).fallbacks == 0);
+
+  for(; i < total; i++)
+    blocks[i] = pool_alloc(1);
+  CHECK(stats(3).used == POOL_CLASS_3_COUNT && stats(0).fallbacks == 0);
+
+  blocks[i] = pool_alloc(1);
+  CHECK(blocks[i] != NULL && stats(0).fallbacks == 1);
+
+  // Larger classes never borrow from smaller ones
+  pool_free(blocks[0]);
+  void *big = pool_alloc(POOL_CLASS_3_SIZE);
+  CHECK(stats(3).fallbacks == 1 && stats(0).used == POOL_CLASS_0_COUNT - 1);
+  pool_free(big);
+
+  for(i = 1; i <= total; i++)
+    pool_free(blocks[i]);
+  CHECK(stats(0).used == 0 && stats(1).used == 0 && stats(2).used == 0 && stats(3).used == 0);
+}
+
+// Smallest class that fits serves the request, too big ones go to heap
+static void
+test_size_classes(void)
+{
+  const uint32_t sizes[] = {1, POOL_CLASS_0_SIZE, POOL_CLASS_0_SIZE + 1, POOL_CLASS_1_SIZE,
+                            POOL_CLASS_2_SIZE, POOL_CLASS_3_SIZE};
+  const uint8_t expected[] = {0, 0, 1, 1, 2, 3};
+  pool_stats_t before;
+  void *block;
+  uint8_t i;
+
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    before = stats(expected[i]);
+    block = pool_alloc(sizes[i]);
+    CHECK(block != NULL && ((uintptr_t) block & 0x03) == 0);
+    CHECK(stats(expected[i]).used == before.used + 1 && stats(expected[i]).borrowed == before.borrowed);
+    pool_free(block);
+    CHECK(stats(expected[i]).used == before.used);
+  }
+
+  // No class fits: heap, not counted as a fallback of any class
+  before = stats(3);
+  block = pool_alloc(POOL_CLASS_3_SIZE + 1);
+  CHECK(block != NULL && stats(3).used == before.used && stats(3).fallbacks == before.fallbacks);
+  pool_free(block);
+
+  CHECK(!pool_stats(POOL_CLASSES, &before));
+  pool_free(NULL);
+}
+
+// Blocks never overlap, freed blocks are reused first (zeroed on request)
+static void
+test_reuse(void)
+{
+  uint8_t *blocks[POOL_CLASS_1_COUNT];
+  uint8_t i, j, intact = 0;
+
+  for(i = 0; i < POOL_CLASS_1_COUNT; i++)
+  {
+    blocks[i] = pool_alloc(POOL_CLASS_1_SIZE);
+    os_memset(blocks[i], i + 1, POOL_CLASS_1_SIZE);
+  }
+  for(i = 0; i < POOL_CLASS_1_COUNT; i++)
+  {
+    for(j = 0; j < POOL_CLASS_1_SIZE && blocks[i][j] == i + 1; j++);
+    intact += (j == POOL_CLASS_1_SIZE);
+  }
+  CHECK(intact == POOL_CLASS_1_COUNT);
+  CHECK(stats(1).high_water == POOL_CLASS_1_COUNT);
+
+  pool_free(blocks[3]);
+  CHECK(pool_zalloc(POOL_CLASS_1_SIZE) == blocks[3]);
+  for(j = 0; j < POOL_CLASS_1_SIZE && blocks[3][j] == 0; j++);
+  CHECK(j == POOL_CLASS_1_SIZE);
+
+  for(i = 0; i < POOL_CLASS_1_COUNT; i++)
+    pool_free(blocks[i]);
+  CHECK(stats(1).used == 0 && stats(1).high_water == POOL_CLASS_1_COUNT);
+}
+
+// Every class that fits taken and heap exhausted: NULL
+static void
+test_exhausted(void)
+{
+  void *blocks[POOL_CLASS_3_COUNT];
+  pool_stats_t before;
+  uint8_t i;
+
+  for(i = 0; i < POOL_CLASS_3_COUNT; i++)
+    blocks[i] = pool_alloc(POOL_CLASS_3_SIZE);
+  before = stats(3);
+
+  sdk_out_of_memory = TRUE;
+  CHECK(pool_alloc(POOL_CLASS_3_SIZE) == NULL && pool_zalloc(POOL_CLASS_3_SIZE) == NULL);
+  CHECK(stats(3).fallbacks == before.fallbacks + 2 && stats(3).used == POOL_CLASS_3_COUNT);
+
+  // Smaller classes still served
+  void *small = pool_alloc(POOL_CLASS_0_SIZE);
+  CHECK(small != NULL);
+  sdk_out_of_memory = FALSE;
+
+  pool_free(small);
+  for(i = 0; i < POOL_CLASS_3_COUNT; i++)
+    pool_free(blocks[i]);
+  CHECK(stats(3).used == 0);
+}
+
+int
+main(void)
+{
+  sdk_reset();
+  RUN(test_borrow);
+  RUN(test_size_classes);
+  RUN(test_reuse);
+  RUN(test_exhausted);
+  return TEST_RESULT();
+}
@@ -0,0 +1,130 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_proto.h"
+
+static struct mqtt_connection conn;
+
+static void
+connect_cb(struct mqtt_connection *c, enum mqtt_connack_status status, bool present)
+{
+}
+
+static void
+message_cb(struct mqtt_connection *c, struct mqtt_message *message)
+{
+}
+
+static void
+subscribe_cb(struct mqtt_connection *c, const uint16_t packet_id, const uint8_t *codes, uint16_t codes_len)
+{
+}
+
+static bool
+send_cb(struct mqtt_connection *c, uint8_t *buf, int len)
+{
+  return espconn_send(NULL, buf, len) == ESPCONN_OK;
+}
+
+static void
+sent_cb(void *arg)
+{
+  mqtt_sent(&conn);
+}
+
+// Connected (CONNACK received), nothing sent yet, same packet ids every time
+static void
+setup(void)
+{
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+
+  os_memset(&conn, 0, sizeof(conn));
+  conn.client_id = "test";
+  conn.username = "user";
+  conn.password = "pass";
+  conn.kalive = 60;
+  conn.connect_cb = connect_cb;
+  conn.message_cb = message_cb;
+  conn.subscribe_cb = subscribe_cb;
+  conn.send_cb = send_cb;
+  sdk_reset();
+  sdk_socket->sent_cb = sent_cb;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  sdk_flush();
+  mqtt_parse_packet(&conn, (uint8_t *) connack, sizeof(connack));
+  sdk_out_len = 0;
+}
+
+//
+// TOPIC HANDLES
+//
+
+// Registered topic encodes the same bytes as the topic string
+static void
+test_handle_equivalence(void)
+{
+  static const struct {
+    const char *topic;      // template
+    const char *arg;
+    const char *expanded;
+  } topics[] = {
+    { "plain/topic", NULL, "plain/topic" },
+    { "devices/%s/temperature", "esp-01", "devices/esp-01/temperature" },
+    { "tail/%s", "x", "tail/x" },
+    { "%s", "whole", "whole" },
+    { "no/arg/%s", NULL, "no/arg/%s" }
+  };
+  const struct mqtt_fragment frags[] = {{(const uint8_t *) "12", 2}, {(const uint8_t *) "3", 1}};
+  static uint8_t expected[256];
+  uint32_t expected_len, id_offset;
+  struct mqtt_topic *handle;
+  enum mqtt_qos qos;
+  uint8_t i, retain, same = 0, runs = 0;
+
+  for(i = 0; i < sizeof(topics) / sizeof(topics[0]); i++)
+    for(qos = MQTT_QOS_0; qos <= MQTT_QOS_2; qos++)
+      for(retain = 0; retain < 2; retain++)
+      {
+        setup();
+        CHECK(mqtt_publishv(&conn, (char *) topics[i].expanded, frags, 2, qos, retain, NULL) == MQTT_OK);
+        sdk_flush();
+        expected_len = sdk_out_len;
+        os_memcpy(expected, sdk_out, sdk_out_len);
+
+        setup();
+        handle = mqtt_topic_register(topics[i].topic, topics[i].arg, qos, retain);
+        CHECK(handle != NULL);
+        CHECK(mqtt_publish_topic(&conn, handle, frags, 2, NULL) == MQTT_OK);
+        sdk_flush();
+        same += (sdk_out_len == expected_len && os_memcmp(sdk_out, expected, expected_len) == 0);
+        ++runs;
+
+        // Handle reused: packet id (before the 3 payload bytes) differs only
+        CHECK(mqtt_publish_topic(&conn, handle, frags, 2, NULL) == MQTT_OK);
+        sdk_flush();
+        id_offset = expected_len - 3 - ((qos != MQTT_QOS_0) ? 2 : 0);
+        CHECK(sdk_out_len == 2 * expected_len);
+        CHECK(os_memcmp(sdk_out + expected_len, expected, id_offset) == 0);
+        CHECK(os_memcmp(sdk_out + 2 * expected_len - 3, expected + expected_len - 3, 3) == 0);
+        mqtt_topic_unregister(handle);
+      }
+  CHECK(same == runs);
+}
+
+// Registration fails without memory
+static void
+test_handle_no_memory(void)
+{
+  sdk_out_of_memory = TRUE;
+  CHECK(mqtt_topic_register("t/%s", "x", MQTT_QOS_0, FALSE) == NULL);
+  sdk_out_of_memory = FALSE;
+}
+
+int
+main(void)
+{
+  RUN(test_handle_equivalence);
+  RUN(test_handle_no_memory);
+  return TEST_RESULT();
+}
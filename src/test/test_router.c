@@ -0,0 +1,175 @@
+#include <string.h>
+
+#include "test.h"
+#include "modules/esp-mqtt/mqtt_router.h"
+
+static struct mqtt_router router;
+
+static void
+handler(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+}
+
+// Checks topic matches filter (alone on router), router left empty
+static bool
+matches(const char *filter, const char *topic)
+{
+  struct mqtt_route_node *routes[MQTT_ROUTER_MAX_MATCHES];
+  uint8_t flags;
+  uint8_t count;
+
+  CHECK(mqtt_router_add(&router, filter, handler, 0));
+  count = mqtt_router_match(&router, topic, strlen(topic), routes, MQTT_ROUTER_MAX_MATCHES, &flags);
+  CHECK(mqtt_router_remove(&router, filter));
+  CHECK(router.root.children_cnt == 0 && router.root.plus == NULL && router.root.hash == NULL);
+  return count == 1;
+}
+
+static uint8_t
+match_count(const char *topic)
+{
+  struct mqtt_route_node *routes[MQTT_ROUTER_MAX_MATCHES];
+  uint8_t flags;
+
+  return mqtt_router_match(&router, topic, strlen(topic), routes, MQTT_ROUTER_MAX_MATCHES, &flags);
+}
+
+//
+// MQTT 3.1.1 SECTION 4.7
+//
+
+// 4.7.1.2 Multi-level wildcard
+static void
+test_multi_level(void)
+{
+  CHECK(matches("sport/tennis/player1/#", "sport/tennis/player1"));
+  CHECK(matches("sport/tennis/player1/#", "sport/tennis/player1/ranking"));
+  CHECK(matches("sport/tennis/player1/#", "sport/tennis/player1/score/wimbledon"));
+  CHECK(!matches("sport/tennis/player1/#", "sport/tennis/player2"));
+  CHECK(matches("sport/#", "sport"));
+  CHECK(matches("#", "sport/tennis/player1"));
+  CHECK(matches("#", "/"));
+  CHECK(!mqtt_router_add(&router, "sport/tennis#", handler, 0));
+  CHECK(!mqtt_router_add(&router, "sport/tennis/#/ranking", handler, 0));
+}
+
+// 4.7.1.3 Single-level wildcard
+static void
+test_single_level(void)
+{
+  CHECK(matches("sport/tennis/+", "sport/tennis/player1"));
+  CHECK(matches("sport/tennis/+", "sport/tennis/player2"));
+  CHECK(!matches("sport/tennis/+", "sport/tennis/player1/ranking"));
+  CHECK(!matches("sport/+", "sport"));
+  CHECK(matches("sport/+", "sport/"));
+  CHECK(matches("+", "sport"));
+  CHECK(matches("+/tennis/#", "sport/tennis/player1"));
+  CHECK(matches("sport/+/player1", "sport/tennis/player1"));
+  CHECK(matches("+/+", "/finance"));
+  CHECK(matches("/+", "/finance"));
+  CHECK(!matches("+", "/finance"));
+  CHECK(!mqtt_router_add(&router, "sport+", handler, 0));
+  CHECK(!mqtt_router_add(&router, "sport/+tennis", handler, 0));
+}
+
+// 4.7.2 Topics beginning with $
+static void
+test_dollar_topics(void)
+{
+  CHECK(!matches("#", "$SYS/broker/clients"));
+  CHECK(!matches("+/monitor/Clients", "$SYS/monitor/Clients"));
+  CHECK(!matches("+", "$SYS"));
+  CHECK(matches("$SYS/#", "$SYS/monitor/Clients"));
+  CHECK(matches("$SYS/monitor/+", "$SYS/monitor/Clients"));
+  CHECK(matches("a/+", "a/$b"));
+  CHECK(matches("a/#", "a/$b/c"));
+}
+
+// 4.7.3 Topic semantic and usage
+static void
+test_topic_names(void)
+{
+  CHECK(!matches("ACCOUNTS", "Accounts"));
+  CHECK(matches("Accounts payable", "Accounts payable"));
+  CHECK(!matches("/finance", "finance"));
+  CHECK(!matches("finance", "/finance"));
+  CHECK(matches("a//b", "a//b"));
+  CHECK(matches("a/+/b", "a//b"));
+  CHECK(!matches("a/b", "a"));
+  CHECK(!matches("a", "a/b"));
+  CHECK(!matches("a/bc", "a/b"));
+  CHECK(!mqtt_router_add(&router, "", handler, 0));
+}
+
+//
+// ROUTER
+//
+
+// Overlapping filters all reported, removal prunes the trie
+static void
+test_overlapping_filters(void)
+{
+  const char *filters[] = {"a/+", "a/#", "a/b", "#", "+/b"};
+  uint8_t i;
+
+  for(i = 0; i < 5; i++)
+    CHECK(mqtt_router_add(&router, filters[i], handler, 0));
+  CHECK(match_count("a/b") == 5);
+  CHECK(match_count("a") == 2);
+  CHECK(mqtt_router_find(&router, "a/b")->stats.overlaps == 4);
+
+  CHECK(mqtt_router_remove(&router, "a/+"));
+  CHECK(!mqtt_router_remove(&router, "a/+"));
+  CHECK(!mqtt_router_remove(&router, "a"));
+  CHECK(match_count("a/b") == 4);
+  CHECK(mqtt_router_find(&router, "a/b")->stats.overlaps == 3);
+
+  for(i = 1; i < 5; i++)
+    CHECK(mqtt_router_remove(&router, filters[i]));
+  CHECK(router.root.children_cnt == 0 && router.root.plus == NULL && router.root.hash == NULL);
+}
+
+// Cached results dropped on filter change
+static void
+test_cache(void)
+{
+  CHECK(match_count("x/y") == 0);
+  CHECK(mqtt_router_add(&router, "x/+", handler, 0));
+  CHECK(match_count("x/y") == 1);
+  CHECK(match_count("x/y") == 1);
+  #if MQTT_ROUTER_CACHE_SIZE
+  CHECK(router.stats.hits > 0);
+  #endif
+  mqtt_router_clear(&router);
+  CHECK(match_count("x/y") == 0);
+}
+
+// Wildcard captures in filter order
+static void
+test_captures(void)
+{
+  struct mqtt_capture captures[4];
+  const char *topic = "home/kitchen/temp/now";
+
+  CHECK(mqtt_router_add(&router, "home/+/+/#", handler, 0));
+  CHECK(mqtt_router_captures(mqtt_router_find(&router, "home/+/+/#"), topic, strlen(topic), captures, 4) == 3);
+  CHECK(captures[0].offset == 5 && captures[0].len == 7);
+  CHECK(captures[1].offset == 13 && captures[1].len == 4);
+  CHECK(captures[2].offset == 18 && captures[2].len == 3);
+  CHECK(mqtt_router_captures(mqtt_router_find(&router, "home/+/+/#"), "home/a/b", 8, captures, 4) == 3);
+  CHECK(captures[2].len == 0);
+  mqtt_router_clear(&router);
+}
+
+int
+main(void)
+{
+  RUN(test_multi_level);
+  RUN(test_single_level);
+  RUN(test_dollar_topics);
+  RUN(test_topic_names);
+  RUN(test_overlapping_filters);
+  RUN(test_cache);
+  RUN(test_captures);
+  return TEST_RESULT();
+}
@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include "test.h"
+#include "modules/esp-mqtt/mqtt_router.h"
+#include "build/test_routes.h"
+
+// Static table generated from routes.def (see Makefile), matched against
+// the trie holding the same filters
+
+static struct mqtt_router table_router;
+static struct mqtt_router trie_router;
+
+#define HANDLER(n) \
+  void on_##n(struct mqtt_connection *conn, struct mqtt_message *message) {}
+
+HANDLER(0) HANDLER(1) HANDLER(2) HANDLER(3) HANDLER(4) HANDLER(5) HANDLER(6)
+HANDLER(7) HANDLER(8) HANDLER(9) HANDLER(10) HANDLER(11) HANDLER(12)
+
+// Subscriptions without handler ("-") go to the client one
+HANDLER(client)
+
+// Routes of table and trie describe the same filter
+static bool
+same_route(const struct mqtt_route_node *a, const struct mqtt_route_node *b)
+{
+  return a->cb == b->cb && a->flags == b->flags && a->specificity == b->specificity && a->levels == b->levels &&
+         a->plus_levels == b->plus_levels && a->level_len == b->level_len &&
+         os_memcmp(a->level, b->level, a->level_len) == 0;
+}
+
+// Same routes matched on both routers (any order)
+static bool
+same_matches(const char *topic)
+{
+  struct mqtt_route_node *table[MQTT_ROUTER_MAX_MATCHES], *trie[MQTT_ROUTER_MAX_MATCHES];
+  uint8_t table_cnt, trie_cnt, table_flags, trie_flags, i, j;
+
+  table_cnt = mqtt_router_match(&table_router, topic, os_strlen(topic), table, MQTT_ROUTER_MAX_MATCHES, &table_flags);
+  trie_cnt = mqtt_router_match(&trie_router, topic, os_strlen(topic), trie, MQTT_ROUTER_MAX_MATCHES, &trie_flags);
+  if(table_cnt != trie_cnt || table_flags != trie_flags)
+  {
+    printf("%s: %d routes on table, %d on trie\n", topic, table_cnt, trie_cnt);
+    return FALSE;
+  }
+  for(i = 0; i < table_cnt; i++)
+  {
+    for(j = 0; j < trie_cnt && !same_route(table[i], trie[j]); j++);
+    if(j == trie_cnt)
+    {
+      printf("%s: route %d of table not on trie\n", topic, i);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void
+setup(void)
+{
+  uint8_t i, flags;
+
+  table_router.table = &test_routes;
+  for(i = 0; i < test_routes.subs_cnt; i++)
+  {
+    flags = (test_routes.subs[i].control ? MQTT_ROUTE_CONTROL : 0) | (test_routes.subs[i].once ? MQTT_ROUTE_ONCE : 0);
+    CHECK(mqtt_router_add(&trie_router, test_routes.subs[i].topic,
+                          test_routes.subs[i].cb != NULL ? test_routes.subs[i].cb : on_client, flags));
+    // Static routes without handler matched once the client sets one
+    if(test_routes.subs[i].cb == NULL)
+      CHECK(mqtt_router_add(&table_router, test_routes.subs[i].topic, on_client, flags));
+  }
+}
+
+//
+// GENERATED TABLE
+//
+
+// Wildcards, "$" topics and empty levels match as on the trie
+static void
+test_same_matches(void)
+{
+  static const char *topics[] = {
+    "a/b/c", "a/x/c", "a", "a/", "a/b", "a/b/c/d", "x", "x/", "x/b", "x/b/y/z",
+    "$SYS", "$SYS/", "$SYS/cpu/load", "$SYS/cpu/load/1", "$other/b/c",
+    "/", "//", "a//c", "/b", "/b/", "//c",
+    "sport/tennis/player1", "sport/tennis/player1/ranking", "sport/golf/player1", "sport/tennis/player2"
+  };
+  uint8_t i, same = 0;
+
+  for(i = 0; i < sizeof(topics) / sizeof(topics[0]); i++)
+    same += same_matches(topics[i]);
+  CHECK(same == sizeof(topics) / sizeof(topics[0]));
+}
+
+// Generated routes carry the counters the trie computes (overlaps)
+static void
+test_same_overlaps(void)
+{
+  const struct mqtt_route_node *node;
+  uint8_t i, same = 0;
+
+  for(i = 0; i < test_routes.subs_cnt; i++)
+  {
+    node = mqtt_router_find(&trie_router, test_routes.subs[i].topic);
+    same += (node != NULL && node->stats.overlaps == test_routes.routes[i].stats.overlaps);
+  }
+  CHECK(same == test_routes.subs_cnt);
+}
+
+int
+main(void)
+{
+  setup();
+  RUN(test_same_matches);
+  RUN(test_same_overlaps);
+  return TEST_RESULT();
+}
@@ -0,0 +1,504 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/utils/pool.h"
+#include "modules/esp-mqtt/mqtt_proto.h"
+
+// Offset of sent packet, -1 if not sent
+#define SENT(type, packet_id)  sdk_out_find((type), (packet_id), NULL)
+
+static struct mqtt_connection conn;
+static uint8_t messages;
+static uint8_t delivered;
+
+static void
+connect_cb(struct mqtt_connection *c, enum mqtt_connack_status status, bool present)
+{
+}
+
+static void
+message_cb(struct mqtt_connection *c, struct mqtt_message *message)
+{
+  ++messages;
+}
+
+static void
+subscribe_cb(struct mqtt_connection *c, const uint16_t packet_id, const uint8_t *codes, uint16_t codes_len)
+{
+}
+
+static void
+delivered_cb(struct mqtt_connection *c, uint16_t packet_id)
+{
+  ++delivered;
+}
+
+static bool
+send_cb(struct mqtt_connection *c, uint8_t *buf, int len)
+{
+  return espconn_send(NULL, buf, len) == ESPCONN_OK;
+}
+
+static void
+sent_cb(void *arg)
+{
+  mqtt_sent(&conn);
+}
+
+static void
+feed(const uint8_t *bytes, int len)
+{
+  mqtt_parse_packet(&conn, (uint8_t *) bytes, len);
+}
+
+static void
+feed_connack(bool session_present)
+{
+  const uint8_t connack[] = {0x20, 0x02, session_present, 0x00};
+  feed(connack, sizeof(connack));
+}
+
+static void
+feed_publish(enum mqtt_qos qos, uint16_t packet_id)
+{
+  const uint8_t publish[] = {0x30 | (qos << 1), 0x07, 0x00, 0x01, 't', packet_id >> 8, packet_id & 0xFF, 'x', 'y'};
+  feed(publish, sizeof(publish));
+}
+
+static void
+feed_ack(enum mqtt_packet_type type, uint16_t packet_id)
+{
+  const uint8_t ack[] = {(type << 4) | (type == MQTT_PUBREL ? 0x02 : 0), 0x02, packet_id >> 8, packet_id & 0xFF};
+  feed(ack, sizeof(ack));
+}
+
+// Connected (CONNACK received), nothing sent yet
+static void
+setup(void)
+{
+  os_memset(&conn, 0, sizeof(conn));
+  conn.client_id = "test";
+  conn.username = "user";
+  conn.password = "pass";
+  conn.kalive = 60;
+  conn.connect_cb = connect_cb;
+  conn.message_cb = message_cb;
+  conn.subscribe_cb = subscribe_cb;
+  conn.send_cb = send_cb;
+  sdk_reset();
+  sdk_socket->sent_cb = sent_cb;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  sdk_flush();
+  feed_connack(FALSE);
+  sdk_out_len = 0;
+  messages = 0;
+  delivered = 0;
+}
+
+// Reconnects keeping the session, sent bytes cleared before CONNACK
+static void
+reconnect(void)
+{
+  mqtt_disconnected(&conn);
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  sdk_flush();
+  sdk_out_len = 0;
+  feed_connack(TRUE);
+  sdk_flush();
+}
+
+//
+// ACKS
+//
+
+// Acks and PINGREQ held during a streamed PUBLISH, sent in order after it
+static void
+test_acks_during_stream(void)
+{
+  uint8_t payload[64];
+
+  setup();
+  CHECK(mqtt_publish_begin(&conn, "s", sizeof(payload), MQTT_QOS_0, FALSE) == MQTT_OK);
+  feed_publish(MQTT_QOS_1, 7);
+  feed_publish(MQTT_QOS_2, 8);
+  CHECK(mqtt_ping(&conn) == MQTT_WOULD_BLOCK);
+  CHECK(messages == 2 && conn.acks.count == 2 && conn.acks.ping);
+
+  sdk_flush();
+  CHECK(SENT(MQTT_PUBACK, 7) < 0 && SENT(MQTT_PUBREC, 8) < 0);
+
+  // Empty chunk takes no transmit slot
+  uint8_t slots = conn.tx.count;
+  CHECK(mqtt_publish_chunk(&conn, payload, 0) == 0 && conn.tx.count == slots);
+
+  os_memset(payload, 'p', sizeof(payload));
+  CHECK(mqtt_publish_chunk(&conn, payload, sizeof(payload)) == sizeof(payload));
+  sdk_flush();
+  CHECK(SENT(MQTT_PUBLISH, 0) == 0 && SENT(MQTT_PUBACK, 7) > 0);
+  CHECK(SENT(MQTT_PUBACK, 7) < SENT(MQTT_PUBREC, 8) && SENT(MQTT_PUBREC, 8) < SENT(MQTT_PINGREQ, 0));
+  CHECK(conn.acks.count == 0 && !conn.acks.ping);
+}
+
+// Acks held while the transmit queue is full (all slots taken)
+static void
+test_acks_queue_full(void)
+{
+  uint8_t payload[16] = {0};
+  const struct mqtt_fragment frag = {payload, sizeof(payload)};
+  uint8_t published = 0;
+
+  setup();
+  while(mqtt_publishv(&conn, "f", &frag, 1, MQTT_QOS_0, FALSE, NULL) == MQTT_OK)
+    ++published;
+  CHECK(published > 0);
+
+  feed_publish(MQTT_QOS_1, 9);
+  feed_ack(MQTT_PUBREL, 10);
+  CHECK(conn.acks.count == 2);
+
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_PUBLISH) == published);
+  CHECK(SENT(MQTT_PUBACK, 9) == sdk_out_len - 8 && SENT(MQTT_PUBCOMP, 10) == sdk_out_len - 4);
+}
+
+// Held acks belong to their connection
+static void
+test_acks_reset_on_connect(void)
+{
+  setup();
+  CHECK(mqtt_publish_begin(&conn, "s", 10, MQTT_QOS_0, FALSE) == MQTT_OK);
+  feed_publish(MQTT_QOS_1, 11);
+  CHECK(conn.acks.count == 1);
+
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  CHECK(conn.acks.count == 0 && conn.stream.remaining == 0);
+}
+
+//
+// IN-FLIGHT MESSAGES
+//
+
+// QoS 1/2 publish fails when its copy can't be kept
+static void
+test_inflight_no_memory(void)
+{
+  uint8_t payload[POOL_CLASS_3_SIZE * 2] = {0};
+  const struct mqtt_fragment frag = {payload, sizeof(payload)};
+
+  setup();
+  sdk_out_of_memory = TRUE;
+  CHECK(mqtt_publishv(&conn, "m", &frag, 1, MQTT_QOS_1, FALSE, NULL) == MQTT_NO_MEMORY);
+  CHECK(mqtt_publishv(&conn, "m", &frag, 1, MQTT_QOS_0, FALSE, NULL) == MQTT_OK);
+  sdk_out_of_memory = FALSE;
+  CHECK(conn.session.count == 0 && conn.session.used == 0 && !conn.session.timer.armed);
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_PUBLISH) == 1);
+
+  CHECK(mqtt_publishv(&conn, "m", &frag, 1, MQTT_QOS_1, FALSE, NULL) == MQTT_OK);
+  CHECK(conn.session.count == 1 && conn.session.timer.armed);
+}
+
+// Inbound message that can't be copied is neither handled nor acknowledged
+static void
+test_inbound_no_memory(void)
+{
+  // QoS 1, payload over the largest pool class (heap allocated)
+  uint8_t publish[8 + 200] = {0x32, 0xCD, 0x01, 0x00, 0x01, 't', 0x00, 30};
+
+  setup();
+  sdk_out_of_memory = TRUE;
+  feed(publish, sizeof(publish));
+  sdk_out_of_memory = FALSE;
+  sdk_flush();
+  CHECK(messages == 0 && SENT(MQTT_PUBACK, 30) < 0);
+
+  feed(publish, sizeof(publish));
+  sdk_flush();
+  CHECK(messages == 1 && SENT(MQTT_PUBACK, 30) >= 0);
+}
+
+// Inbound message bigger than the parser buffer, fragmented: dropped but
+// acknowledged (not resent forever)
+static void
+test_inbound_too_large(void)
+{
+  // Remaining length 2 + 1 + 2 + 600
+  uint8_t publish[3 + 5 + 600] = {0x32, 0xDD, 0x04, 0x00, 0x01, 't', 0x00, 40};
+
+  setup();
+  feed(publish, 100);
+  feed(publish + 100, sizeof(publish) - 100);
+  sdk_flush();
+  CHECK(messages == 0 && SENT(MQTT_PUBACK, 40) >= 0);
+
+  publish[0] = 0x34;
+  publish[7] = 41;
+  feed(publish, 100);
+  feed(publish + 100, sizeof(publish) - 100);
+  sdk_flush();
+  CHECK(messages == 0 && SENT(MQTT_PUBREC, 41) >= 0);
+
+  // Parser in sync afterwards
+  feed_publish(MQTT_QOS_1, 42);
+  sdk_flush();
+  CHECK(messages == 1 && SENT(MQTT_PUBACK, 42) >= 0);
+}
+
+//
+// INBOUND QOS 2
+//
+
+// Resent PUBLISH waiting PUBREL acknowledged again, delivered once
+static void
+test_inbound_duplicate(void)
+{
+  setup();
+  feed_publish(MQTT_QOS_2, 20);
+  feed_publish(MQTT_QOS_2, 20);
+  sdk_flush();
+  CHECK(messages == 1 && sdk_out_count(MQTT_PUBREC) == 2);
+
+  // Released: same id is a new message
+  feed_ack(MQTT_PUBREL, 20);
+  feed_publish(MQTT_QOS_2, 20);
+  sdk_flush();
+  CHECK(messages == 2 && SENT(MQTT_PUBCOMP, 20) >= 0);
+}
+
+// Ids waiting PUBREL kept only while broker keeps the session
+static void
+test_inbound_new_session(void)
+{
+  setup();
+  feed_publish(MQTT_QOS_2, 21);
+
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  feed_connack(TRUE);
+  feed_publish(MQTT_QOS_2, 21);
+  CHECK(messages == 1);
+
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  feed_connack(FALSE);
+  feed_publish(MQTT_QOS_2, 21);
+  CHECK(messages == 2);
+
+  // Clean session: forgotten on CONNECT
+  conn.clean_session = TRUE;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  CHECK(conn.session.inbound[0] == 0);
+}
+
+// Table full: message not accepted (no PUBREC) until a PUBREL frees a slot
+static void
+test_inbound_full(void)
+{
+  uint16_t id;
+
+  setup();
+  for(id = 1; id <= MQTT_MAX_INBOUND; ++id)
+    feed_publish(MQTT_QOS_2, id);
+  feed_publish(MQTT_QOS_2, id);
+  sdk_flush();
+  CHECK(messages == MQTT_MAX_INBOUND && sdk_out_count(MQTT_PUBREC) == MQTT_MAX_INBOUND);
+  CHECK(SENT(MQTT_PUBREC, id) < 0);
+
+  feed_ack(MQTT_PUBREL, 1);
+  feed_publish(MQTT_QOS_2, id);
+  sdk_flush();
+  CHECK(messages == MQTT_MAX_INBOUND + 1 && SENT(MQTT_PUBREC, id) >= 0);
+}
+
+// PUBREL of an id not waiting (already released) still answered, nothing delivered
+static void
+test_inbound_unknown_pubrel(void)
+{
+  setup();
+  feed_ack(MQTT_PUBREL, 30);
+  sdk_flush();
+  CHECK(messages == 0 && SENT(MQTT_PUBCOMP, 30) >= 0);
+
+  feed_publish(MQTT_QOS_2, 30);
+  feed_ack(MQTT_PUBREL, 30);
+  feed_ack(MQTT_PUBREL, 30);
+  sdk_flush();
+  CHECK(messages == 1 && sdk_out_count(MQTT_PUBCOMP) == 3 && conn.session.inbound[0] == 0);
+}
+
+//
+// QOS 2 OUTBOUND
+//
+
+// PUBLISH -> PUBREC -> PUBREL -> PUBCOMP, out of order acks ignored
+static void
+test_outbound_qos2(void)
+{
+  const struct mqtt_fragment frag = {(const uint8_t *) "v", 1};
+  struct mqtt_inflight *inflight = &conn.session.inflight[0];
+  uint16_t id;
+
+  setup();
+  CHECK(mqtt_publishv(&conn, "q", &frag, 1, MQTT_QOS_2, FALSE, delivered_cb) == MQTT_OK);
+  sdk_flush();
+  id = inflight->packet_id;
+  CHECK(SENT(MQTT_PUBLISH, id) >= 0 && inflight->state == MQTT_INFLIGHT_PUBREC && inflight->packet != NULL);
+
+  // Acks of other steps
+  feed_ack(MQTT_PUBCOMP, id);
+  feed_ack(MQTT_PUBACK, id);
+  CHECK(delivered == 0 && conn.session.count == 1 && inflight->state == MQTT_INFLIGHT_PUBREC);
+
+  // Broker owns the message: copy released
+  feed_ack(MQTT_PUBREC, id);
+  sdk_flush();
+  CHECK(SENT(MQTT_PUBREL, id) >= 0 && inflight->state == MQTT_INFLIGHT_PUBCOMP && inflight->packet == NULL);
+  CHECK(delivered == 0 && conn.session.count == 1);
+
+  // Duplicated PUBREC answered again
+  feed_ack(MQTT_PUBREC, id);
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_PUBREL) == 2 && inflight->state == MQTT_INFLIGHT_PUBCOMP);
+
+  feed_ack(MQTT_PUBCOMP, id);
+  CHECK(delivered == 1 && conn.session.count == 0);
+  feed_ack(MQTT_PUBCOMP, id);
+  CHECK(delivered == 1);
+}
+
+// Reconnection resends PUBLISH (DUP) before PUBREC, PUBREL after it
+static void
+test_outbound_qos2_resend(void)
+{
+  const struct mqtt_fragment frag = {(const uint8_t *) "v", 1};
+  uint16_t id;
+  uint8_t flags;
+
+  setup();
+  CHECK(mqtt_publishv(&conn, "q", &frag, 1, MQTT_QOS_2, FALSE, delivered_cb) == MQTT_OK);
+  sdk_flush();
+  id = conn.session.inflight[0].packet_id;
+
+  reconnect();
+  CHECK(sdk_out_find(MQTT_PUBLISH, id, &flags) >= 0 && (flags & 0x08) != 0);
+  CHECK(SENT(MQTT_PUBREL, id) < 0);
+
+  feed_ack(MQTT_PUBREC, id);
+  reconnect();
+  CHECK(SENT(MQTT_PUBREL, id) >= 0 && SENT(MQTT_PUBLISH, id) < 0);
+
+  feed_ack(MQTT_PUBCOMP, id);
+  CHECK(delivered == 1 && conn.session.count == 0);
+}
+
+//
+// CONNECT CACHE
+//
+
+// Sends CONNECT, TRUE if the same bytes as "previous" (updated)
+static bool
+connect_same(uint8_t *previous, uint32_t *previous_len)
+{
+  bool same;
+
+  sdk_out_len = 0;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  sdk_flush();
+  same = (sdk_out_len == *previous_len && os_memcmp(sdk_out, previous, sdk_out_len) == 0);
+  os_memcpy(previous, sdk_out, sdk_out_len);
+  *previous_len = sdk_out_len;
+  return same;
+}
+
+// Sent bytes contain "text"
+static bool
+sent_has(const char *text)
+{
+  uint32_t i, len = os_strlen(text);
+
+  for(i = 0; i + len <= sdk_out_len; i++)
+    if(os_memcmp(sdk_out + i, text, len) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+// Cached CONNECT reused until a field it was encoded from changes
+static void
+test_connect_cache(void)
+{
+  static uint8_t previous[256];
+  static char password[] = "pass";
+  uint32_t previous_len = 0;
+  uint8_t *cached;
+
+  setup();
+  CHECK(conn.connect.data != NULL);
+  cached = conn.connect.data;
+  connect_same(previous, &previous_len);
+  CHECK(connect_same(previous, &previous_len) && conn.connect.data == cached);
+
+  // Fields pointing to other strings
+  conn.password = "other";
+  CHECK(!connect_same(previous, &previous_len) && sent_has("other"));
+  conn.kalive = 30;
+  CHECK(!connect_same(previous, &previous_len));
+  conn.clean_session = TRUE;
+  CHECK(!connect_same(previous, &previous_len));
+  conn.last_will.topic = (uint8_t *) "lw";
+  conn.last_will.data = (uint8_t *) "gone";
+  CHECK(!connect_same(previous, &previous_len) && sent_has("gone"));
+  CHECK(connect_same(previous, &previous_len));
+
+  // Strings changed in place: noticed only once invalidated
+  conn.password = password;
+  connect_same(previous, &previous_len);
+  password[0] = 'P';
+  CHECK(connect_same(previous, &previous_len));
+  mqtt_connect_invalidate(&conn);
+  CHECK(conn.connect.data == NULL);
+  CHECK(!connect_same(previous, &previous_len) && sent_has("Pass"));
+  mqtt_connect_invalidate(&conn);
+}
+
+//
+// TRANSMIT QUEUE
+//
+
+// Writes rejected by transport retried from timer
+static void
+test_transport_retry(void)
+{
+  setup();
+  sdk_send_result = ESPCONN_MAXNUM;
+  CHECK(mqtt_ping(&conn) == MQTT_OK);
+  CHECK(sdk_out_len == 0 && conn.tx.timer.armed && conn.tx.timer.period == MQTT_TX_RETRY_DELAY);
+
+  // Still rejected: armed again
+  CHECK(sdk_fire(&conn.tx.timer));
+  CHECK(sdk_out_len == 0 && conn.tx.timer.armed);
+
+  sdk_send_result = ESPCONN_OK;
+  CHECK(sdk_fire(&conn.tx.timer));
+  CHECK(SENT(MQTT_PINGREQ, 0) == 0 && !conn.tx.timer.armed);
+  sdk_flush();
+  CHECK(conn.tx.count == 0);
+}
+
+int
+main(void)
+{
+  RUN(test_acks_during_stream);
+  RUN(test_acks_queue_full);
+  RUN(test_acks_reset_on_connect);
+  RUN(test_inflight_no_memory);
+  RUN(test_inbound_no_memory);
+  RUN(test_inbound_too_large);
+  RUN(test_inbound_duplicate);
+  RUN(test_inbound_new_session);
+  RUN(test_inbound_full);
+  RUN(test_inbound_unknown_pubrel);
+  RUN(test_outbound_qos2);
+  RUN(test_outbound_qos2_resend);
+  RUN(test_connect_cache);
+  RUN(test_transport_retry);
+  return TEST_RESULT();
+}
@@ -0,0 +1,334 @@
+#include <string.h>
+
+#include "test.h"
+#include "sdk.h"
+#include "modules/esp-mqtt/mqtt_proto.h"
+
+// Built with MQTT_V5 (see Makefile)
+
+static struct mqtt_connection conn;
+static char topic_seen[16];
+static uint8_t messages, tx_ready;
+static struct {
+  enum mqtt_packet_type type;
+  uint16_t packet_id;
+  enum mqtt_reason_code reason;
+  uint8_t count;
+} reasons;
+
+static void
+connect_cb(struct mqtt_connection *c, enum mqtt_connack_status status, bool present)
+{
+}
+
+// Keeps topic of last message (valid during callback only)
+static void
+message_cb(struct mqtt_connection *c, struct mqtt_message *message)
+{
+  os_memcpy(topic_seen, message->topic, message->topic_len);
+  topic_seen[message->topic_len] = '\0';
+  ++messages;
+}
+
+static void
+reason_cb(struct mqtt_connection *c, enum mqtt_packet_type type, uint16_t packet_id, enum mqtt_reason_code reason)
+{
+  reasons.type = type;
+  reasons.packet_id = packet_id;
+  reasons.reason = reason;
+  ++reasons.count;
+}
+
+static void
+tx_ready_cb(struct mqtt_connection *c)
+{
+  ++tx_ready;
+}
+
+static void
+subscribe_cb(struct mqtt_connection *c, const uint16_t packet_id, const uint8_t *codes, uint16_t codes_len)
+{
+}
+
+static bool
+send_cb(struct mqtt_connection *c, uint8_t *buf, int len)
+{
+  return espconn_send(NULL, buf, len) == ESPCONN_OK;
+}
+
+static void
+sent_cb(void *arg)
+{
+  mqtt_sent(&conn);
+}
+
+static void
+feed_connack(bool session_present)
+{
+  // No properties
+  uint8_t connack[] = {0x20, 0x03, session_present, 0x00, 0x00};
+  mqtt_parse_packet(&conn, connack, sizeof(connack));
+}
+
+// Reconnects, broker CONNACK with properties (broker limits)
+static void
+reconnect(const uint8_t *props, uint8_t props_len)
+{
+  uint8_t connack[5 + 16] = {0x20, 3 + props_len, 0x00, 0x00, props_len};
+
+  mqtt_disconnected(&conn);
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  sdk_flush();
+  if(props_len > 0)
+    os_memcpy(connack + 5, props, props_len);
+  mqtt_parse_packet(&conn, connack, 5 + props_len);
+  sdk_flush();
+  sdk_out_len = 0;
+}
+
+static void
+feed(const uint8_t *packet, uint16_t len)
+{
+  mqtt_parse_packet(&conn, (uint8_t *) packet, len);
+}
+
+// Packet id of 1st in-flight message (0 = none)
+static uint16_t
+inflight_id(void)
+{
+  uint8_t i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++)
+    if(conn.session.used & (1UL << i))
+      return conn.session.inflight[i].packet_id;
+  return 0;
+}
+
+// Connected (CONNACK received), nothing sent yet
+static void
+setup(void)
+{
+  os_memset(&conn, 0, sizeof(conn));
+  conn.client_id = "test";
+  conn.username = "user";
+  conn.password = "pass";
+  conn.kalive = 60;
+  conn.connect_cb = connect_cb;
+  conn.message_cb = message_cb;
+  conn.subscribe_cb = subscribe_cb;
+  conn.send_cb = send_cb;
+  conn.reason_cb = reason_cb;
+  conn.tx_ready_cb = tx_ready_cb;
+  os_memset(&reasons, 0, sizeof(reasons));
+  messages = tx_ready = 0;
+  sdk_reset();
+  sdk_socket->sent_cb = sent_cb;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  sdk_flush();
+  feed_connack(FALSE);
+  sdk_out_len = 0;
+  sdk_timer_last = NULL;
+}
+
+//
+// IN-FLIGHT MESSAGES
+//
+
+// Unacknowledged PUBLISH resent only on reconnection, with DUP flag
+static void
+test_resend_on_reconnect(void)
+{
+  uint8_t flags;
+  int first;
+
+  setup();
+  CHECK(mqtt_publish(&conn, "r", (uint8_t *) "x", MQTT_QOS_1, FALSE) == MQTT_OK);
+  sdk_flush();
+  first = sdk_out_find(MQTT_PUBLISH, 0, &flags);
+  CHECK(first == 0 && (flags & 0x08) == 0 && conn.session.count == 1);
+  CHECK(sdk_timer_last == NULL || sdk_timer_last->period != MQTT_RETRY_TIMEOUT);
+
+  mqtt_disconnected(&conn);
+  sdk_out_len = 0;
+  CHECK(mqtt_connect(&conn) == MQTT_OK);
+  sdk_flush();
+  feed_connack(TRUE);
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_PUBLISH) == 1 && sdk_out_find(MQTT_PUBLISH, 0, &flags) > 0 && (flags & 0x08) != 0);
+  CHECK(sdk_timer_last == NULL || sdk_timer_last->period != MQTT_RETRY_TIMEOUT);
+}
+
+//
+// TOPIC ALIASES
+//
+
+// QoS 0 topic sent once with an alias, then as the alias alone
+static void
+test_alias_out(void)
+{
+  const uint8_t limits[] = {MQTT_PROP_TOPIC_ALIAS_MAXIMUM, 0x00, 0x02};
+  const uint8_t first[] = {0x30, 0x0A, 0x00, 0x03, 't', '/', 'a', 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, 'x'};
+  const uint8_t again[] = {0x30, 0x07, 0x00, 0x00, 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, 'x'};
+  const uint8_t plain[] = {0x30, 0x07, 0x00, 0x03, 't', '/', 'a', 0x00, 'x'};
+
+  // Broker accepts no aliases by default
+  setup();
+  CHECK(mqtt_publish(&conn, "t/a", (uint8_t *) "x", MQTT_QOS_0, FALSE) == MQTT_OK);
+  sdk_flush();
+  CHECK(sdk_out_len == sizeof(plain) && os_memcmp(sdk_out, plain, sizeof(plain)) == 0);
+
+  reconnect(limits, sizeof(limits));
+  CHECK(mqtt_publish(&conn, "t/a", (uint8_t *) "x", MQTT_QOS_0, FALSE) == MQTT_OK);
+  sdk_flush();
+  CHECK(sdk_out_len == sizeof(first) && os_memcmp(sdk_out, first, sizeof(first)) == 0);
+  sdk_out_len = 0;
+  CHECK(mqtt_publish(&conn, "t/a", (uint8_t *) "x", MQTT_QOS_0, FALSE) == MQTT_OK);
+  sdk_flush();
+  CHECK(sdk_out_len == sizeof(again) && os_memcmp(sdk_out, again, sizeof(again)) == 0);
+
+  // QoS 1 keeps the topic (may be resent on a new connection)
+  sdk_out_len = 0;
+  CHECK(mqtt_publish(&conn, "t/a", (uint8_t *) "x", MQTT_QOS_1, FALSE) == MQTT_OK);
+  sdk_flush();
+  CHECK(sdk_out_len == sizeof(plain) + 2 && os_memcmp(sdk_out + 2, plain + 2, 5) == 0);
+
+  // Aliases forgotten on a new connection
+  reconnect(limits, sizeof(limits));
+  CHECK(mqtt_publish(&conn, "t/a", (uint8_t *) "x", MQTT_QOS_0, FALSE) == MQTT_OK);
+  sdk_flush();
+  CHECK(sdk_out_len >= sizeof(first) && os_memcmp(sdk_out, first, sizeof(first)) == 0);
+}
+
+// Broker aliases resolved, unknown ones rejected
+static void
+test_alias_in(void)
+{
+  const uint8_t define[] = {0x30, 0x0A, 0x00, 0x03, 's', '/', '1', 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, 'p'};
+  const uint8_t aliased[] = {0x30, 0x07, 0x00, 0x00, 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, 'p'};
+  const uint8_t unknown[] = {0x30, 0x07, 0x00, 0x00, 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x02, 'p'};
+  const uint8_t too_high[] = {0x30, 0x0A, 0x00, 0x03, 's', '/', '2', 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, MQTT_V5_ALIASES_IN + 1, 'p'};
+  const uint8_t no_topic[] = {0x30, 0x04, 0x00, 0x00, 0x00, 'p'};
+
+  setup();
+  feed(define, sizeof(define));
+  CHECK(messages == 1 && os_strcmp(topic_seen, "s/1") == 0);
+  topic_seen[0] = '\0';
+  feed(aliased, sizeof(aliased));
+  CHECK(messages == 2 && os_strcmp(topic_seen, "s/1") == 0);
+
+  feed(unknown, sizeof(unknown));
+  CHECK(messages == 2 && reasons.count == 1);
+  CHECK(reasons.type == MQTT_PUBLISH && reasons.reason == MQTT_REASON_TOPIC_ALIAS_INVALID);
+  feed(too_high, sizeof(too_high));
+  CHECK(messages == 2 && reasons.count == 2 && reasons.reason == MQTT_REASON_TOPIC_ALIAS_INVALID);
+  feed(no_topic, sizeof(no_topic));
+  CHECK(messages == 2 && reasons.count == 3 && reasons.reason == MQTT_REASON_TOPIC_ALIAS_INVALID);
+
+  // Aliases forgotten on a new connection
+  reconnect(NULL, 0);
+  feed(aliased, sizeof(aliased));
+  CHECK(messages == 2 && reasons.count == 4);
+}
+
+//
+// BROKER LIMITS
+//
+
+// QoS 1/2 in-flight bounded by broker Receive Maximum, released by acks
+static void
+test_receive_maximum(void)
+{
+  const uint8_t limits[] = {MQTT_PROP_RECEIVE_MAXIMUM, 0x00, 0x02};
+  uint8_t puback[] = {0x40, 0x02, 0x00, 0x00};
+  uint16_t packet_id;
+
+  setup();
+  reconnect(limits, sizeof(limits));
+  CHECK(conn.v5.receive_max == 2);
+  CHECK(mqtt_publish(&conn, "q", (uint8_t *) "1", MQTT_QOS_1, FALSE) == MQTT_OK);
+  CHECK(mqtt_publish(&conn, "q", (uint8_t *) "2", MQTT_QOS_2, FALSE) == MQTT_OK);
+  CHECK(mqtt_publish(&conn, "q", (uint8_t *) "3", MQTT_QOS_1, FALSE) == MQTT_WOULD_BLOCK);
+  // QoS 0 not bounded
+  CHECK(mqtt_publish(&conn, "q", (uint8_t *) "4", MQTT_QOS_0, FALSE) == MQTT_OK);
+  sdk_flush();
+  CHECK(sdk_out_count(MQTT_PUBLISH) == 3 && tx_ready == 0);
+
+  packet_id = inflight_id();
+  puback[2] = packet_id >> 8;
+  puback[3] = packet_id & 0xFF;
+  feed(puback, sizeof(puback));
+  CHECK(tx_ready == 1 && conn.session.count == 1);
+  CHECK(mqtt_publish(&conn, "q", (uint8_t *) "3", MQTT_QOS_1, FALSE) == MQTT_OK);
+}
+
+// Packets over broker Maximum Packet Size refused, nothing sent
+static void
+test_maximum_packet_size(void)
+{
+  const uint8_t limits[] = {MQTT_PROP_MAXIMUM_PACKET_SIZE, 0x00, 0x00, 0x00, 0x10};
+  const struct mqtt_fragment fit = {(const uint8_t *) "1234567890", 10};
+  const struct mqtt_fragment over = {(const uint8_t *) "12345678901", 11};
+
+  setup();
+  reconnect(limits, sizeof(limits));
+  CHECK(conn.v5.max_packet_size == 16);
+
+  // Header 2, topic 3, properties 1 and payload 10 bytes
+  CHECK(mqtt_publishv(&conn, "q", &fit, 1, MQTT_QOS_0, FALSE, NULL) == MQTT_OK);
+  sdk_flush();
+  CHECK(sdk_out_len == 16);
+  sdk_out_len = 0;
+
+  CHECK(mqtt_publishv(&conn, "q", &over, 1, MQTT_QOS_0, FALSE, NULL) == MQTT_ERROR);
+  CHECK(mqtt_publishv(&conn, "q", &fit, 1, MQTT_QOS_1, FALSE, NULL) == MQTT_ERROR);
+  CHECK(mqtt_publish_begin(&conn, "q", 11, MQTT_QOS_0, FALSE) == MQTT_ERROR);
+  sdk_flush();
+  CHECK(sdk_out_len == 0 && conn.session.count == 0);
+
+  // No limit on a new connection without the property
+  reconnect(NULL, 0);
+  CHECK(mqtt_publishv(&conn, "q", &over, 1, MQTT_QOS_1, FALSE, NULL) == MQTT_OK);
+}
+
+//
+// REASON CODES
+//
+
+// Broker failures reported with the packet they came on
+static void
+test_reason_codes(void)
+{
+  uint8_t puback[] = {0x40, 0x03, 0x00, 0x00, MQTT_REASON_NOT_AUTHORIZED};
+  const uint8_t disconnect[] = {0xE0, 0x01, MQTT_REASON_SERVER_BUSY};
+  const uint8_t success[] = {0x40, 0x03, 0x12, 0x34, MQTT_REASON_SUCCESS};
+  uint16_t packet_id;
+
+  setup();
+  CHECK(mqtt_publish(&conn, "q", (uint8_t *) "1", MQTT_QOS_1, FALSE) == MQTT_OK);
+  packet_id = inflight_id();
+  puback[2] = packet_id >> 8;
+  puback[3] = packet_id & 0xFF;
+  feed(puback, sizeof(puback));
+  CHECK(reasons.count == 1 && reasons.type == MQTT_PUBACK);
+  CHECK(reasons.packet_id == packet_id && reasons.reason == MQTT_REASON_NOT_AUTHORIZED);
+  CHECK(conn.session.count == 0);
+
+  // Success codes (and unknown packet ids) not reported
+  feed(success, sizeof(success));
+  CHECK(reasons.count == 1);
+
+  feed(disconnect, sizeof(disconnect));
+  CHECK(reasons.count == 2 && reasons.type == MQTT_DISCONNECT && reasons.reason == MQTT_REASON_SERVER_BUSY);
+}
+
+int
+main(void)
+{
+  RUN(test_resend_on_reconnect);
+  RUN(test_alias_out);
+  RUN(test_alias_in);
+  RUN(test_receive_maximum);
+  RUN(test_maximum_packet_size);
+  RUN(test_reason_codes);
+  return TEST_RESULT();
+}
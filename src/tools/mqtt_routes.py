@@ -0,0 +1,343 @@
+#!/usr/bin/env python3
+"""
+Static MQTT route table generator
+
+Compiles a subscription table known at build time into C code for the
+router (see "struct mqtt_route_table"): filter levels become per-level
+matching functions (switch on level hash, names compared from flash) and
+routes are static, nothing is allocated at runtime.
+
+Table format, one subscription per line ("//" starts a comment):
+
+    // filter             qos  handler     flags
+    commands/relay/+      0    on_relay    control
+    sensors/+/temp        1    on_temp     once
+    sensors/#             1    on_sensor   once
+    status                0    -
+
+Handler "-" leaves the subscription to the client single handler. Flags
+(comma separated): "control" (control dispatch lane), "once" (overlapping
+"once" filters, most specific one handles).
+
+Usage:
+    python3 tools/mqtt_routes.py routes.def -o user/mqtt_routes [-n mqtt_routes]
+
+Writes <out>.c and <out>.h, the client uses the table with:
+    mqtt_client.router.table = &mqtt_routes;
+"""
+
+import argparse
+import os
+import re
+import sys
+
+FLAGS = {'control': 'MQTT_ROUTE_CONTROL', 'once': 'MQTT_ROUTE_ONCE'}
+IDENT = re.compile(r'^[A-Za-z_][A-Za-z0-9_]*$')
+
+
+class Route(object):
+    def __init__(self, index, filter, qos, handler, flags):
+        self.index = index
+        self.filter = filter
+        self.levels = filter.split('/')
+        self.qos = qos
+        self.handler = handler
+        self.flags = flags
+        self.overlaps = 0
+
+
+class Node(object):
+    def __init__(self, name):
+        self.name = name
+        self.id = None
+        self.children = {}      # exact levels
+        self.plus = None
+        self.hash = None        # route of "#" level (always a leaf)
+        self.route = None
+
+
+#
+# LEVELS (same as router "level_scan")
+#
+
+def level_hash(name):
+    h = 2166136261
+    for c in name.encode('utf-8'):
+        h = ((h ^ c) * 16777619) & 0xFFFFFFFF
+    return (h ^ (h >> 16)) & 0xFFFF
+
+
+def filter_valid(filter):
+    if not filter:
+        return False
+    levels = filter.split('/')
+    for i, level in enumerate(levels):
+        if len(level) > 1 and ('+' in level or '#' in level):
+            return False
+        if level == '#' and i != len(levels) - 1:
+            return False
+    return True
+
+
+def overlap(a, b):
+    """Checks filters match some topic in common"""
+    # Wildcards on 1st level never match "$" topics
+    if (a[0] in ('+', '#') and b[0].startswith('$')) or (b[0] in ('+', '#') and a[0].startswith('$')):
+        return False
+    for i in range(max(len(a), len(b))):
+        x = a[i] if i < len(a) else None
+        y = b[i] if i < len(b) else None
+        if x == '#' or y == '#':
+            return True
+        if x is None or y is None:
+            return False
+        if x != '+' and y != '+' and x != y:
+            return False
+    return True
+
+
+#
+# TABLE
+#
+
+def parse(path):
+    routes = []
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            fields = re.split(r'(?:^|\s)//', line, 1)[0].split()
+            if not fields:
+                continue
+            where = '%s:%d' % (path, number)
+            if len(fields) < 3 or len(fields) > 4:
+                sys.exit('%s: expected "filter qos handler [flags]"' % where)
+            filter, qos, handler = fields[0], fields[1], fields[2]
+            flags = [x for x in fields[3].split(',') if x] if len(fields) == 4 else []
+            if not filter_valid(filter):
+                sys.exit('%s: invalid filter "%s"' % (where, filter))
+            if any(r.filter == filter for r in routes):
+                sys.exit('%s: duplicated filter "%s"' % (where, filter))
+            if qos not in ('0', '1', '2'):
+                sys.exit('%s: invalid QoS "%s"' % (where, qos))
+            if handler != '-' and not IDENT.match(handler):
+                sys.exit('%s: invalid handler "%s"' % (where, handler))
+            for flag in flags:
+                if flag not in FLAGS:
+                    sys.exit('%s: unknown flag "%s"' % (where, flag))
+            routes.append(Route(len(routes), filter, int(qos), None if handler == '-' else handler, flags))
+    if not routes:
+        sys.exit('%s: no subscriptions' % path)
+    if len(routes) > 255:
+        sys.exit('%s: too many subscriptions (max 255)' % path)
+
+    for r in routes:
+        r.overlaps = min(255, sum(1 for o in routes if o is not r and overlap(r.levels, o.levels)))
+    return routes
+
+
+def build(routes):
+    root = Node(None)
+    for r in routes:
+        node = root
+        for level in r.levels[:-1]:
+            node = descend(node, level)
+        last = r.levels[-1]
+        if last == '#':
+            node.hash = r
+        else:
+            descend(node, last).route = r
+    return root
+
+
+def descend(node, level):
+    if level == '+':
+        if node.plus is None:
+            node.plus = Node(level)
+        return node.plus
+    if level not in node.children:
+        node.children[level] = Node(level)
+    return node.children[level]
+
+
+def number(node, nodes):
+    """Post-order ids (functions defined before their callers)"""
+    for child in sorted(node.children.values(), key=lambda n: n.name):
+        number(child, nodes)
+    if node.plus is not None:
+        number(node.plus, nodes)
+    node.id = len(nodes)
+    nodes.append(node)
+
+
+#
+# CODE
+#
+
+def c_string(text):
+    return '"%s"' % text.replace('\\', '\\\\').replace('"', '\\"')
+
+
+class Names(object):
+    """Level names packed on flash words (little endian, shared)"""
+
+    def __init__(self):
+        self.offsets = {}
+        self.words = []
+
+    def add(self, name):
+        if name not in self.offsets:
+            data = name.encode('utf-8')
+            self.offsets[name] = len(self.words)
+            for i in range(0, len(data), 4):
+                chunk = data[i:i + 4].ljust(4, b'\0')
+                self.words.append(chunk[0] | chunk[1] << 8 | chunk[2] << 16 | chunk[3] << 24)
+        return self.offsets[name]
+
+
+def collect(route, indent):
+    return '%smqtt_router_collect(m, &routes[%d]);   // %s\n' % (indent, route.index, route.filter)
+
+
+def node_code(node, names, prefix, is_root):
+    exact = sorted(node.children.values(), key=lambda n: (level_hash(n.name), n.name))
+    out = []
+    if is_root:
+        out.append('static void ICACHE_FLASH_ATTR\n%s_match(const char *level, const char *end, '
+                   'struct mqtt_route_matches *m)\n{\n' % prefix)
+    else:
+        out.append('static void ICACHE_FLASH_ATTR\n%s_%d(const char *level, const char *end, '
+                   'struct mqtt_route_matches *m)\n{\n' % (prefix, node.id))
+    wildcards = is_root and (node.hash is not None or node.plus is not None)
+    if exact or node.plus is not None:
+        out.append('  const char *next;\n  uint16_t len, hash;\n')
+    if wildcards:
+        # Wildcards on 1st level never match "$" topics (e.g. "$SYS")
+        out.append('  const bool wildcards = (*level != \'$\');\n')
+    if not exact and node.plus is None:
+        # Last level of every filter here (topic end not needed)
+        out.append('  (void) end;\n')
+    if exact or node.plus is not None or wildcards:
+        out.append('\n')
+
+    if not is_root:
+        # Topic ends on this level
+        ends = [r for r in (node.route, node.hash) if r is not None]
+        if ends:
+            out.append('  if(level == NULL)\n  {\n')
+            out.extend(collect(r, '    ') for r in ends)
+            out.append('    return;\n  }\n')
+        else:
+            out.append('  if(level == NULL)\n    return;\n')
+
+    if node.hash is not None:
+        if is_root:
+            out.append('  if(wildcards)\n' + collect(node.hash, '    '))
+        else:
+            out.append(collect(node.hash, '  '))
+
+    if exact or node.plus is not None:
+        out.append('  len = mqtt_router_level(level, end, &hash);\n')
+        out.append('  next = (level + len < end) ? level + len + 1 : NULL;\n')
+    if exact:
+        out.append('  switch(hash)\n  {\n')
+        i = 0
+        while i < len(exact):
+            h = level_hash(exact[i].name)
+            out.append('    case 0x%04x:\n' % h)
+            keyword = 'if'
+            while i < len(exact) and level_hash(exact[i].name) == h:
+                child = exact[i]
+                out.append('      %s(mqtt_router_level_is(level, len, levels + %d, %d))   // %s\n'
+                           % (keyword, names.add(child.name), len(child.name.encode('utf-8')), child.name))
+                out.append('        %s_%d(next, end, m);\n' % (prefix, child.id))
+                keyword = 'else if'
+                i += 1
+            out.append('      break;\n')
+        out.append('  }\n')
+    if node.plus is not None:
+        if is_root:
+            out.append('  if(wildcards)\n    %s_%d(next, end, m);\n' % (prefix, node.plus.id))
+        else:
+            out.append('  %s_%d(next, end, m);\n' % (prefix, node.plus.id))
+    out.append('}\n')
+    return ''.join(out)
+
+
+def route_code(r):
+    specificity = sum(2 if l not in ('+', '#') else (1 if l == '+' else 0) for l in r.levels)
+    plus = 0
+    for i, level in enumerate(r.levels[:32]):
+        if level == '+':
+            plus |= 1 << i
+    flags = ' | '.join(FLAGS[f] for f in r.flags) or '0'
+    last = r.levels[-1]
+    return ('  { .cb = %s, .flags = %s, .specificity = %d, .levels = %d, .plus_levels = 0x%08x,\n'
+            '    .stats = { .overlaps = %d }, .level = (char *) %s, .level_len = %d },   // %s\n'
+            % (r.handler or 'NULL', flags, specificity, len(r.levels), plus, r.overlaps,
+               c_string(last), len(last.encode('utf-8')), r.filter))
+
+
+def generate(routes, source, name):
+    root = build(routes)
+    nodes = []
+    number(root, nodes)
+    names = Names()
+    functions = [node_code(n, names, name, n is root) for n in nodes]
+
+    banner = '/* Generated by tools/mqtt_routes.py from %s, do not edit */\n' % os.path.basename(source)
+    c = [banner, '\n#include <osapi.h>\n\n#include "modules/esp-mqtt/mqtt_router.h"\n\n']
+
+    handlers = sorted(set(r.handler for r in routes if r.handler))
+    if handlers:
+        c.append('// Handlers\n')
+        for h in handlers:
+            c.append('void %s(struct mqtt_connection *, struct mqtt_message *);\n' % h)
+        c.append('\n')
+
+    c.append('// Level names (flash, read as aligned words)\n')
+    c.append('static const uint32_t levels[] ICACHE_RODATA_ATTR = {')
+    words = names.words or [0]
+    for i, w in enumerate(words):
+        c.append('%s0x%08x,' % ('\n  ' if i % 6 == 0 else ' ', w))
+    c.append('\n};\n\n')
+
+    c.append('// Subscriptions (SUBSCRIBE on connect)\nstatic const struct mqtt_subscription subs[] = {\n')
+    for r in routes:
+        c.append('  { %s, MQTT_QOS_%d, %s, %s, %s },\n' % (c_string(r.filter), r.qos, r.handler or 'NULL',
+                 'TRUE' if 'control' in r.flags else 'FALSE', 'TRUE' if 'once' in r.flags else 'FALSE'))
+    c.append('};\n\n')
+
+    c.append('// Routes (handler, flags and counters, same order as "subs")\n')
+    c.append('static struct mqtt_route_node routes[] = {\n')
+    for r in routes:
+        c.append(route_code(r))
+    c.append('};\n\n')
+
+    c.append('//\n// MATCHING (one function per filter level)\n//\n\n')
+    c.append('\n'.join(functions))
+    c.append('\nconst struct mqtt_route_table %s = { %s_match, routes, subs, %d };\n' % (name, name, len(routes)))
+
+    guard = '%s_H' % name.upper()
+    h = [banner, '\n#ifndef %s\n#define %s\n\n' % (guard, guard),
+         '#include "modules/esp-mqtt/mqtt_router.h"\n\n',
+         'extern const struct mqtt_route_table %s;\n\n#endif\n' % name]
+    return ''.join(c), ''.join(h)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generates static MQTT route table')
+    parser.add_argument('table', help='subscription table')
+    parser.add_argument('-o', '--output', default='mqtt_routes', help='output path (no extension)')
+    parser.add_argument('-n', '--name', default='mqtt_routes', help='table symbol name')
+    args = parser.parse_args()
+    if not IDENT.match(args.name):
+        sys.exit('invalid table name "%s"' % args.name)
+
+    c, h = generate(parse(args.table), args.table, args.name)
+    with open(args.output + '.c', 'w') as f:
+        f.write(c)
+    with open(args.output + '.h', 'w') as f:
+        f.write(h)
+
+
+if __name__ == '__main__':
+    main()
@@ -31,17 +31,27 @@ on_message(struct mqtt_connection *conn, struct mqtt_message *message)
   LOGGER("fallback handler received %s", message->data);
 }
 
+void ICACHE_FLASH_ATTR
+on_relay(struct mqtt_connection *conn, struct mqtt_message *message)
+{
+  // Handler for "commands/relay/+" (relay name on 1st capture)
+  char relay[16];
+  const struct mqtt_capture *capture = &message->captures[0];
+  const uint16_t len = (capture->len < sizeof(relay)) ? capture->len : sizeof(relay) - 1;
+  os_memcpy(relay, message->topic + capture->offset, len);
+  relay[len] = '\0';
+  LOGGER("/commands/relay/%s handler received: %s", relay, message->data);
+}
+
+// Subscriptions (restored by the client on every reconnection)
+static const struct mqtt_subscription subscriptions[] = {
+  { "commands/relay/+", MQTT_QOS_0, on_relay, TRUE }   // control lane (deferred dispatch)
+};
+
 void ICACHE_FLASH_ATTR
 on_connected(struct mqtt_connection *conn)
 {
   LOGGER("MQTT: Client connected\r\n");
-  // Handler for "commands/relay/+"
-  mqtt_client_subscribe(conn, "commands/relay/+", MQTT_QOS_0, ({
-    void cb(struct mqtt_connection *conn, struct mqtt_message *message) {
-      LOGGER("/commands/relay/+ handler received: %s", message->data);
-    }
-    cb;
-  }));
 }
 
 void ICACHE_FLASH_ATTR
@@ -72,6 +82,8 @@ user_init(void)
     .host_port = MQTT_PORT,
     .user_connect_cb = on_connected,
     .user_message_cb = on_message,
+    .subs = subscriptions,
+    .subs_cnt = sizeof(subscriptions) / sizeof(subscriptions[0]),
     .mqtt_conn = {
       .client_id = MQTT_CLIENT_ID,
       .username = MQTT_CLIENT_ID,